@@ -0,0 +1,121 @@
+#define _POSIX_C_SOURCE 199309L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../include/cpu.h"
+
+/*
+ * Compares instructions/second of cpu_run() and cpu_run_threaded() on
+ * a loop in the style of data/bin/program00.bin (without the output):
+ *
+ *     movr B 7
+ *     movr C ITERATIONS
+ *     movr D 1
+ *     inc B        <- index 9
+ *     add B
+ *     dec C
+ *     div D
+ *     loop 9
+ *     halt
+ */
+
+typedef long long (*run_engine)(struct cpu *cpu, size_t steps);
+
+static struct cpu *create_cpu(int32_t iterations)
+{
+    const int32_t program[] = {
+        9, REGISTER_B, 7,
+        9, REGISTER_C, iterations,
+        9, REGISTER_D, 1,
+        6, REGISTER_B,
+        2, REGISTER_B,
+        7, REGISTER_C,
+        5, REGISTER_D,
+        8, 9,
+        1
+    };
+
+    FILE *file = tmpfile();
+    if (file == NULL)
+        return NULL;
+    for (size_t i = 0; i < sizeof(program) / sizeof(int32_t); ++i) {
+        for (int byte = 0; byte < 4; ++byte)
+            fputc(((uint32_t) program[i] >> (byte * 8)) & 0xff, file);
+    }
+    rewind(file);
+
+    int32_t *stack_bottom;
+    int32_t *memory = cpu_create_memory(file, 0, &stack_bottom);
+    fclose(file);
+    if (memory == NULL)
+        return NULL;
+
+    struct cpu *cpu = cpu_create(memory, stack_bottom, 0);
+    if (cpu == NULL)
+        free(memory);
+    return cpu;
+}
+
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static long long measure(struct cpu *cpu, run_engine engine, double *seconds)
+{
+    long long total = 0;
+    long long executed = 5000;
+
+    double start = now();
+    while (executed == 5000 && cpu_get_status(cpu) == CPU_OK) {
+        executed = engine(cpu, executed);
+        total += executed < 0 ? -executed : executed;
+    }
+    *seconds = now() - start;
+    return total;
+}
+
+int main(int argc, const char *argv[])
+{
+    int32_t iterations = 50000000;
+    if (argc > 1)
+        iterations = strtol(argv[1], NULL, 10);
+
+    const char *names[] = { "run", "threaded" };
+    run_engine engines[] = { cpu_run, cpu_run_threaded };
+    struct cpu *cpus[2];
+
+    for (int i = 0; i < 2; ++i) {
+        cpus[i] = create_cpu(iterations);
+        if (cpus[i] == NULL) {
+            puts("Insufficient memory for allocation.");
+            return -1;
+        }
+
+        double seconds;
+        long long total = measure(cpus[i], engines[i], &seconds);
+        printf("%-9s %12lld instructions %8.3f s %14.0f instructions/s\n",
+               names[i], total, seconds, total / seconds);
+    }
+
+    int same = cpu_get_status(cpus[0]) == cpu_get_status(cpus[1]) &&
+               cpus[0]->instruction_index == cpus[1]->instruction_index &&
+               memcmp(cpus[0]->arithmetic_regs, cpus[1]->arithmetic_regs,
+                      sizeof(cpus[0]->arithmetic_regs)) == 0;
+
+    for (int i = 0; i < 2; ++i) {
+        cpu_destroy(cpus[i]);
+        free(cpus[i]);
+    }
+
+    if (!same) {
+        puts("engines finished in different states");
+        return -1;
+    }
+    return 0;
+}
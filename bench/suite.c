@@ -0,0 +1,331 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+#include "../include/cpu.h"
+#include "../include/io.h"
+
+/*
+ * Runs generated programs stressing each class of instructions with
+ * cpu_run(), one warmup run and TRIALS measured ones for each, every run
+ * on a fresh cpu in a child process of its own, so its max RSS is the peak
+ * of that run alone. Prints the median of each program and writes every
+ * trial into a CSV file (the first argument, build/bench.csv by default),
+ * so results of different versions can be compared.
+ *
+ * The programs and the input are always the same, so the counts
+ * of executed instructions are too.
+ */
+
+#define TRIALS 5
+
+/* size of the input of the echo program, generated by an LCG */
+#define ECHO_INPUT_SIZE (16 * 1024 * 1024)
+
+/* result of one run, sent by the child process which did it */
+struct trial {
+    /* executed instructions, -1 if the program did not halt */
+    long long total;
+    double seconds;
+    long max_rss_kb;
+};
+
+struct workload {
+    const char *name;
+    const int32_t *program;
+    size_t length;
+    size_t stack_capacity;
+    /* the program reads the generated input */
+    int echo;
+};
+
+/* register instructions, 11 in each of 10M iterations */
+static const int32_t arithmetic[] = {
+    9, REGISTER_B, 7,
+    9, REGISTER_C, 10000000,
+    9, REGISTER_D, 3,
+    9, REGISTER_A, 100,         /* index 9 */
+    2, REGISTER_B,
+    4, REGISTER_D,
+    3, REGISTER_B,
+    5, REGISTER_D,
+    6, REGISTER_B,
+    7, REGISTER_B,
+    16, REGISTER_A, REGISTER_B,
+    16, REGISTER_A, REGISTER_B,
+    7, REGISTER_C,
+    8, 9,
+    1
+};
+
+/* fills the whole stack of 1024 cells and empties it, 20000 times */
+static const int32_t push_pop[] = {
+    9, REGISTER_D, 20000,
+    9, REGISTER_C, 1024,        /* index 3 */
+    17, REGISTER_A,             /* index 6 */
+    7, REGISTER_C,
+    8, 6,
+    9, REGISTER_C, 1024,
+    18, REGISTER_B,             /* index 15 */
+    7, REGISTER_C,
+    8, 15,
+    16, REGISTER_C, REGISTER_D,
+    7, REGISTER_C,
+    8, 29,
+    1,
+    16, REGISTER_C, REGISTER_D, /* index 29 */
+    9, REGISTER_C, 1,
+    8, 3
+};
+
+/* loads and stores at D + NUM in a stack of 8 cells, 9 in each of 10M */
+static const int32_t load_store[] = {
+    9, REGISTER_A, 5,
+    9, REGISTER_C, 8,
+    17, REGISTER_A,             /* index 6 */
+    6, REGISTER_A,
+    7, REGISTER_C,
+    8, 6,
+    9, REGISTER_C, 10000000,
+    9, REGISTER_D, 1,
+    10, REGISTER_A, 0,          /* index 20 */
+    10, REGISTER_B, 3,
+    11, REGISTER_A, 2,
+    11, REGISTER_B, 5,
+    6, REGISTER_D,
+    10, REGISTER_B, 4,
+    11, REGISTER_B, -1,
+    7, REGISTER_D,
+    7, REGISTER_C,
+    8, 20,
+    1
+};
+
+/* copies the input to the output byte by byte (get, put) */
+static const int32_t echo[] = {
+    9, REGISTER_C, 1,
+    13, REGISTER_A,             /* index 3 */
+    8, 8,
+    1,
+    15, REGISTER_A,             /* index 8 */
+    8, 3
+};
+
+static const struct workload workloads[] = {
+    { "arithmetic", arithmetic, sizeof(arithmetic) / sizeof(int32_t), 0, 0 },
+    { "push_pop", push_pop, sizeof(push_pop) / sizeof(int32_t), 1024, 0 },
+    { "load_store", load_store, sizeof(load_store) / sizeof(int32_t), 8, 0 },
+    { "echo", echo, sizeof(echo) / sizeof(int32_t), 0, 1 }
+};
+
+static struct cpu *create_cpu(const struct workload *workload)
+{
+    FILE *file = tmpfile();
+    if (file == NULL)
+        return NULL;
+    for (size_t i = 0; i < workload->length; ++i) {
+        uint32_t word = (uint32_t) workload->program[i];
+        for (int byte = 0; byte < 4; ++byte)
+            fputc((word >> (byte * 8)) & 0xff, file);
+    }
+    rewind(file);
+
+    int32_t *stack_bottom;
+    int32_t *memory = cpu_create_memory(file, workload->stack_capacity,
+                                        &stack_bottom);
+    fclose(file);
+    if (memory == NULL)
+        return NULL;
+
+    struct cpu *cpu = cpu_create(memory, stack_bottom,
+                                 workload->stack_capacity);
+    if (cpu == NULL)
+        free(memory);
+    return cpu;
+}
+
+/* returns a descriptor of a temporary file with the input of echo */
+static int create_input(void)
+{
+    FILE *file = tmpfile();
+    if (file == NULL)
+        return -1;
+
+    uint32_t state = 12345;
+    for (size_t i = 0; i < ECHO_INPUT_SIZE; ++i) {
+        state = state * 1103515245u + 12345u;
+        fputc((state >> 16) & 0xff, file);
+    }
+    fflush(file);
+    /* the file was already removed, the duplicate keeps it open */
+    int fd = dup(fileno(file));
+    fclose(file);
+    return fd;
+}
+
+static double now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static long max_rss_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/* runs the workload on a fresh cpu, returns executed instructions or -1 */
+static long long measure(const struct workload *workload, int input_fd,
+                         int output_fd, double *seconds)
+{
+    struct cpu *cpu = create_cpu(workload);
+    if (cpu == NULL)
+        return -1;
+
+    struct cpu_io *io = NULL;
+    if (workload->echo) {
+        lseek(input_fd, 0, SEEK_SET);
+        io = io_create_buffered(input_fd, output_fd);
+        if (io == NULL) {
+            cpu_destroy(cpu);
+            free(cpu);
+            return -1;
+        }
+        cpu_set_io(cpu, io);
+    }
+
+    long long total = 0;
+    long long executed = 5000;
+
+    double start = now();
+    while (executed == 5000 && cpu_get_status(cpu) == CPU_OK) {
+        executed = cpu_run(cpu, executed);
+        total += executed < 0 ? -executed : executed;
+    }
+    *seconds = now() - start;
+
+    if (cpu_get_status(cpu) != CPU_HALTED)
+        total = -1;
+    cpu_destroy(cpu);
+    free(cpu);
+    if (io != NULL)
+        io_destroy_buffered(io);
+    return total;
+}
+
+/* runs measure() in a child process, returns -1 if the run failed */
+static int measure_apart(const struct workload *workload, int input_fd,
+                         int output_fd, struct trial *trial)
+{
+    int fds[2];
+    if (pipe(fds) != 0)
+        return -1;
+    /* the child flushes stdout when its cpu is destroyed */
+    fflush(NULL);
+    pid_t pid = fork();
+    if (pid < 0) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+
+    if (pid == 0) {
+        close(fds[0]);
+        struct trial result;
+        result.total = measure(workload, input_fd, output_fd, &result.seconds);
+        result.max_rss_kb = max_rss_kb();
+        ssize_t written = write(fds[1], &result, sizeof(result));
+        _exit(written == (ssize_t) sizeof(result) ? 0 : 1);
+    }
+
+    close(fds[1]);
+    ssize_t length = read(fds[0], trial, sizeof(*trial));
+    close(fds[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    if (length != (ssize_t) sizeof(*trial) || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0)
+        return -1;
+    return trial->total < 0 ? -1 : 0;
+}
+
+static int compare_doubles(const void *first, const void *second)
+{
+    double a = *(const double *) first;
+    double b = *(const double *) second;
+    return (a > b) - (a < b);
+}
+
+int main(int argc, const char *argv[])
+{
+    const char *csv_name = argc > 1 ? argv[1] : "build/bench.csv";
+    int trials = argc > 2 ? atoi(argv[2]) : TRIALS;
+    if (trials < 1)
+        trials = 1;
+
+    FILE *csv = fopen(csv_name, "w");
+    if (csv == NULL) {
+        printf("Could not open file: %s\n", csv_name);
+        return -1;
+    }
+    int input_fd = create_input();
+    int output_fd = open("/dev/null", O_WRONLY);
+    if (input_fd < 0 || output_fd < 0) {
+        puts("Could not create the input of echo.");
+        fclose(csv);
+        return -1;
+    }
+
+    fputs("workload,trial,instructions,seconds,instructions_per_second,"
+          "ns_per_instruction,max_rss_kb\n", csv);
+    printf("%-12s %12s %16s %12s %12s\n", "workload", "instructions",
+           "instructions/s", "ns/ins", "max RSS KiB");
+
+    int result = 0;
+    for (size_t w = 0; w < sizeof(workloads) / sizeof(workloads[0]); ++w) {
+        const struct workload *workload = &workloads[w];
+        double rates[trials];
+        struct trial run;
+        long max_rss = 0;
+
+        /* the warmup run is not reported */
+        bool halted = measure_apart(workload, input_fd, output_fd, &run) == 0;
+        for (int trial = 0; halted && trial < trials; ++trial) {
+            halted = measure_apart(workload, input_fd, output_fd, &run) == 0;
+            if (!halted)
+                break;
+            rates[trial] = run.total / run.seconds;
+            if (run.max_rss_kb > max_rss)
+                max_rss = run.max_rss_kb;
+            fprintf(csv, "%s,%d,%lld,%.6f,%.0f,%.3f,%ld\n", workload->name,
+                    trial, run.total, run.seconds, rates[trial],
+                    1e9 / rates[trial], run.max_rss_kb);
+        }
+        if (!halted) {
+            printf("%s did not halt\n", workload->name);
+            result = -1;
+            continue;
+        }
+
+        qsort(rates, trials, sizeof(double), &compare_doubles);
+        double median = rates[trials / 2];
+        printf("%-12s %12lld %16.0f %12.3f %12ld\n", workload->name,
+               run.total, median, 1e9 / median, max_rss);
+    }
+
+    close(input_fd);
+    close(output_fd);
+    fclose(csv);
+    return result;
+}
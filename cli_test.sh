@@ -11,3 +11,105 @@ if [ "$(./build/cpu32 run 16 data/bin/program01.bin)" = $'2137cpu status: INVALI
 else
     echo "program01.bin failed."
 fi
+
+if [ "$(./build/cpu32 threaded 0 data/bin/program00.bin)" = $'8421\nahoj!\ncpu status: HALTED' ]; then
+    echo "program00.bin (threaded) passed."
+else
+    echo "program00.bin (threaded) failed."
+fi
+
+if [ "$(./build/cpu32 threaded 16 data/bin/program01.bin)" = $'2137cpu status: INVALID_STACK_OPERATION' ]; then
+    echo "program01.bin (threaded) passed."
+else
+    echo "program01.bin (threaded) failed."
+fi
+
+if [ "$(./build/cpu32 jit 0 data/bin/program00.bin)" = $'8421\nahoj!\ncpu status: HALTED' ]; then
+    echo "program00.bin (jit) passed."
+else
+    echo "program00.bin (jit) failed."
+fi
+
+if [ "$(./build/cpu32 jit 16 data/bin/program01.bin)" = $'2137cpu status: INVALID_STACK_OPERATION' ]; then
+    echo "program01.bin (jit) passed."
+else
+    echo "program01.bin (jit) failed."
+fi
+
+if [ "$(./build/cpu32 batch 16 --programs data/bin/program00.bin data/bin/program01.bin)" = $'==> data/bin/program00.bin <==\n8421\nahoj!\ncpu status: HALTED\n==> data/bin/program01.bin <==\n2137cpu status: INVALID_STACK_OPERATION' ]; then
+    echo "batch passed."
+else
+    echo "batch failed."
+fi
+
+if [ "$(./build/cpu32 lockstep 16 data/bin/program00.bin /dev/null /dev/null)" = $'==> /dev/null <==\n8421\nahoj!\ncpu status: HALTED\n==> /dev/null <==\n8421\nahoj!\ncpu status: HALTED' ]; then
+    echo "lockstep passed."
+else
+    echo "lockstep failed."
+fi
+
+if CPU32_PROFILE_JSON=/dev/null ./build/cpu32 profile 0 data/bin/program00.bin | grep -q '^instructions executed: 39$'; then
+    echo "program00.bin (profile) passed."
+else
+    echo "program00.bin (profile) failed."
+fi
+
+if CPU32_TRACE=trace_test.trace ./build/cpu32 trace-write 0 data/bin/program00.bin > /dev/null &&
+   [ "$(./build/cpu32 trace-dump trace_test.trace)" = "$(./build/cpu32 trace 0 data/bin/program00.bin)" ]; then
+    echo "program00.bin (trace-dump) passed."
+else
+    echo "program00.bin (trace-dump) failed."
+fi
+rm -f trace_test.trace
+
+if [ "$(./build/cpu32 run 0 data/txt/program00.txt)" = $'8421\nahoj!\ncpu status: HALTED' ]; then
+    echo "program00.txt passed."
+else
+    echo "program00.txt failed."
+fi
+
+if [ "$(./build/cpu32 guarded 1024 data/bin/program00.bin)" = $'8421\nahoj!\ncpu status: HALTED' ]; then
+    echo "program00.bin (guarded) passed."
+else
+    echo "program00.bin (guarded) failed."
+fi
+
+if [ "$(./build/cpu32 guarded 1024 data/bin/program01.bin)" = $'2137cpu status: INVALID_STACK_OPERATION' ]; then
+    echo "program01.bin (guarded) passed."
+else
+    echo "program01.bin (guarded) failed."
+fi
+
+if CPU32_REPLAY=replay_test.replay ./build/cpu32 record 0 data/bin/program00.bin > /dev/null &&
+   [ "$(CPU32_REPLAY=replay_test.replay ./build/cpu32 replay 0 data/bin/program00.bin < /dev/null)" = $'8421\nahoj!\ncpu status: HALTED' ]; then
+    echo "program00.bin (replay) passed."
+else
+    echo "program00.bin (replay) failed."
+fi
+rm -f replay_test.replay
+
+if CPU32_REPLAY=debug_test.replay ./build/cpu32 record 0 data/bin/program00.bin > /dev/null &&
+   [ "$(printf 'c\nrs 39\nq\n' | CPU32_REPLAY=debug_test.replay ./build/cpu32 debug 0 data/bin/program00.bin | tail -n 6)" = $'(cpu32) at the start\nstep 0, index 0\nA: 0, B: 0, C: 0, D: 0\nstack size: 0\ncpu status: OK\n(cpu32) ' ]; then
+    echo "program00.bin (debug) passed."
+else
+    echo "program00.bin (debug) failed."
+fi
+rm -f debug_test.replay
+
+if [ "$(printf '+$Z0,38,4#81+$c#63+$p0#a0+$D#44+' | ./build/cpu32 gdb 0 data/bin/program00.bin 2> /dev/null)" = '+$OK#9a+$T05swbreak:;#1d+$08000000#88+$OK#9a' ]; then
+    echo "program00.bin (gdb) passed."
+else
+    echo "program00.bin (gdb) failed."
+fi
+
+if [ "$(./build/test_scheduler)" = $'42 6\n3 6' ]; then
+    echo "scheduler passed."
+else
+    echo "scheduler failed."
+fi
+
+if [ "$(./build/test_snapshot)" = "snapshot restored into a clone" ]; then
+    echo "snapshot passed."
+else
+    echo "snapshot failed."
+fi
@@ -0,0 +1,92 @@
+#ifndef ASM_H
+#define ASM_H
+
+/**
+ * @file asm.h
+ * @brief Assembler and disassembler of the text format (see data/txt).
+ *
+ * Every line holds at most one instruction, a mnemonic followed by its
+ * operands separated by spaces (or commas):
+ *
+ *   movr B 7        registers are A, B, C, D, numbers are decimal
+ *   loop 14         or hexadecimal (0x...), INDEX is a word index
+ *   loop again      or a label
+ *   again:          defines a label, it can also precede an instruction
+ *   .word 19 -1     stores the words as they are (data, invalid opcodes)
+ *   ; comment       `;` and `#` start a comment up to the end of the line
+ *
+ * Blank lines are ignored. Labels may be used before they are defined.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct asm_program {
+    /* assembled words in the host byte order */
+    int32_t *words;
+    size_t length;
+    /* table of basic blocks, see asm_block_starts() */
+    unsigned char *block_starts;
+};
+
+struct asm_error {
+    /* line of the error counted from 1, 0 if it does not belong to a line */
+    size_t line;
+    const char *message;
+};
+
+/**
+ * @brief Assembles the source text into program words.
+ *
+ * The words can be loaded by cpu_create_memory_from_words().
+ *
+ * @param source  text of the program, it doesn't have to end with '\0'
+ * @param size    length of the text
+ * @param program out parameter, where the words and the table of basic
+ *                blocks are stored, freed by asm_program_destroy()
+ * @param error   out parameter, where the error is described
+ *
+ * @return 0 on success, -1 in case of error (nothing has to be freed)
+ */
+int asm_assemble(const char *source, size_t size, struct asm_program *program,
+                 struct asm_error *error);
+
+/**
+ * @brief Frees the words and the table, not the struct itself.
+ */
+void asm_program_destroy(struct asm_program *program);
+
+/**
+ * @brief Finds the first words of basic blocks of the program.
+ *
+ * The words are decoded one instruction after another from index 0 (words
+ * which are not a valid instruction are taken one by one). A block starts
+ * at index 0, at every target of `loop` inside the program and after every
+ * `loop` and `halt`, so a block is always left by its last instruction
+ * (or by an error) and is entered only by its first one.
+ *
+ * @param words  program words
+ * @param length count of words
+ *
+ * @return array of `length` flags, non-zero at the start of a block,
+ *         NULL in case of error
+ */
+unsigned char *asm_block_starts(const int32_t *words, size_t length);
+
+/**
+ * @brief Prints the program in the text format, asm_assemble() of the text
+ * gives the same words back.
+ *
+ * Targets of `loop` get labels (L<index>), blocks are separated by blank
+ * lines. Words which are not a valid instruction are printed as `.word`.
+ *
+ * @param words  program words
+ * @param length count of words
+ * @param out    stream the text is written to
+ *
+ * @return 0 on success, -1 in case of error
+ */
+int asm_disassemble(const int32_t *words, size_t length, FILE *out);
+
+#endif  // ASM_H
@@ -0,0 +1,87 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/**
+ * @file batch.h
+ * @brief Running many independent programs in parallel on worker threads.
+ *
+ * Jobs run in clones of their program (see cpu_clone()), so the
+ * instructions and the decoded program are shared by all jobs running the
+ * same program, only the stack, registers and I/O buffers are per job.
+ * A worker keeps the clone and I/O buffers of its last finished job for
+ * the next one, when it runs the same program, the clone is only restarted
+ * (see cpu_restart()), so many short jobs don't pay for the setup of each.
+ *
+ * Jobs are dealt out to per-worker deques in their order. A worker runs
+ * the job at the head of its deque for a quantum of instructions, if other
+ * jobs wait in the deque, the job goes back to its tail and the next one
+ * runs. A worker with an empty deque steals from the tail of another one,
+ * so a few long jobs don't keep the short ones queued behind them while
+ * other cores are idle. Results are stored into the jobs.
+ */
+
+#include <stddef.h>
+
+#include "cpu.h"
+
+typedef long long (*batch_engine)(struct cpu *cpu, size_t steps);
+
+struct batch_job {
+    /* program of the job, it is only cloned, never run itself */
+    const struct cpu *program;
+    /* where in, get, out and put instructions of the job read and write */
+    int input_fd;
+    int output_fd;
+
+    /* status of the cpu when the job finished */
+    enum cpu_status status;
+    /* count of executed instructions, -1 if the job could not be started */
+    long long executed;
+};
+
+/* what a worker did during batch_run(), times are in nanoseconds */
+struct batch_worker_stats {
+    /* time from the start of the worker to its end */
+    unsigned long long total_ns;
+    /* time spent running the engine */
+    unsigned long long busy_ns;
+    /* time spent waiting for a job to be queued */
+    unsigned long long idle_ns;
+    /* count of quanta run */
+    unsigned long long slices;
+    /* count of jobs taken from deques of other workers */
+    unsigned long long steals;
+    /* count of jobs finished by the worker */
+    unsigned long long jobs;
+    /* count of instructions executed by the worker */
+    unsigned long long instructions;
+};
+
+/**
+ * @brief Returns the count of worker threads used when none is requested,
+ * the count of online processors.
+ */
+size_t batch_default_threads(void);
+
+/**
+ * @brief Runs every job to its end (until the cpu is not CPU_OK) with the
+ * given engine (e.g. cpu_run()) on `threads` worker threads, each job
+ * with the buffered I/O backend.
+ *
+ * @param jobs    array of jobs, results are stored there
+ * @param count   count of jobs
+ * @param threads count of worker threads, 0 for batch_default_threads()
+ * @param engine  function running the cpu for at most `steps` instructions
+ * @param stats   NULL or array for the stats of each worker, it needs
+ *                room for `threads` (or batch_default_threads()) entries
+ *
+ * @return count of workers (at most `threads` and `count`), 0 if the batch
+ * could not be started
+ *
+ * @note The calling thread is one of the workers, if other threads can't be
+ * started, the jobs are run on the calling thread only.
+ */
+size_t batch_run(struct batch_job *jobs, size_t count, size_t threads,
+                 batch_engine engine, struct batch_worker_stats *stats);
+
+#endif  // BATCH_H
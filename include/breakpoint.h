@@ -0,0 +1,68 @@
+#ifndef BREAKPOINT_H
+#define BREAKPOINT_H
+
+/**
+ * @file breakpoint.h
+ * @brief Breakpoints patched into the decoded program.
+ *
+ * The program image is never changed. While breakpoints are enabled,
+ * the decoded op at the index of each breakpoint gets a handler which
+ * executes nothing and stops the cpu with CPU_BREAKPOINT. Fused
+ * and translated ops covering a breakpoint in their sequence (see cpu_fuse()
+ * and cpu_translate()) execute only their first instruction, so the
+ * dispatch reaches the breakpoint. Disabling puts the original ops back,
+ * a program without enabled breakpoints runs exactly as fast as before.
+ *
+ * Breakpoints stop cpu_run() and cpu_step(). Like a waiting `in`, the run
+ * stopped by a breakpoint returns -K, where K includes the instruction
+ * under the breakpoint, although it was not executed. The instruction is
+ * executed by disabling the breakpoints for one cpu_step().
+ */
+
+#include <stdbool.h>
+
+#include "cpu.h"
+
+struct breakpoints;
+
+/**
+ * @brief Allocates an empty set of breakpoints of the program of the cpu
+ * (shared with its clones).
+ *
+ * @return pointer to the set, NULL in case of error
+ */
+struct breakpoints *breakpoints_create(struct cpu *cpu);
+
+/**
+ * @brief Adds a breakpoint at the instruction index, it is patched in
+ * if the breakpoints are enabled.
+ *
+ * @return 0 on success, -1 if the index lies outside of the program or
+ * in case of error
+ */
+int breakpoint_insert(struct breakpoints *breakpoints, int32_t index);
+
+/**
+ * @brief Removes the breakpoint at the instruction index.
+ *
+ * @return 0 on success, -1 if there is no breakpoint at the index
+ */
+int breakpoint_remove(struct breakpoints *breakpoints, int32_t index);
+
+/**
+ * @brief Returns true if there is a breakpoint at the instruction index.
+ */
+bool breakpoint_at(const struct breakpoints *breakpoints, int32_t index);
+
+/**
+ * @brief Patches the breakpoints into the decoded program (`enabled`)
+ * or puts the original ops back.
+ */
+void breakpoints_enable(struct breakpoints *breakpoints, bool enabled);
+
+/**
+ * @brief Puts the original ops back and releases the set.
+ */
+void breakpoints_destroy(struct breakpoints *breakpoints);
+
+#endif  // BREAKPOINT_H
@@ -12,9 +12,16 @@ enum cpu_status {
     CPU_INVALID_ADDRESS,
     CPU_INVALID_STACK_OPERATION,
     CPU_DIV_BY_ZERO,
-    CPU_IO_ERROR
+    CPU_IO_ERROR,
+    /* in or get found no input yet, see cpu_resume() */
+    CPU_WAITING_INPUT,
+    /* the next instruction has a breakpoint, see breakpoint.h */
+    CPU_BREAKPOINT
 };
 
+/* count of stack cells in a 4 KiB block of the memory */
+#define CPU_PAGE_CELLS 1024
+
 enum cpu_register {
     REGISTER_A,
     REGISTER_B,
@@ -22,6 +29,14 @@ enum cpu_register {
     REGISTER_D,
 };
 
+struct decoded_op;
+struct jit;
+struct guard;
+struct translation;
+struct cpu_io;
+struct cpu_page;
+struct cpu_snapshot;
+
 struct cpu {
     enum cpu_status status;
     int32_t *memory;
@@ -34,6 +49,50 @@ struct cpu {
     int32_t *stack_top;
     /* stack roof is the lowest valid stack adress (closest to instructions) */
     int32_t *stack_roof;
+
+    /* start of the 4 KiB block of the memory containing stack roof */
+    int32_t *stack_pages;
+    /* one flag per block of the stack, set when the block is written to */
+    unsigned char *stack_dirty;
+    /* blocks of the snapshot last taken or restored (see cpu_snapshot()) */
+    struct cpu_page **snapshot_pages;
+
+    /* program decoded by cpu_decode(), one op per word in front of the stack */
+    struct decoded_op *program;
+    int32_t program_size;
+    /*
+     * incremented whenever ops of the decoded program are patched (see
+     * breakpoint.h), engines keeping copies of the ops refresh them
+     */
+    uint32_t program_changes;
+    /* blocks run by translated ops of the program (see cpu_translate()) */
+    struct translation *translation;
+    /*
+     * count of instructions the dispatched op may execute, set by cpu_run()
+     * and cpu_run_guarded(), translated loops iterate within it
+     */
+    size_t budget;
+    /*
+     * non-zero if the memory in front of the stack, the decoded program
+     * and its translation are borrowed from another cpu (see cpu_clone()),
+     * the stack is then allocated separately
+     */
+    int8_t shares_program;
+    /*
+     * non-zero if cpu_verify() proved the program never leaves it, cpu_run()
+     * then skips the bound check of instruction_index (it has to be changed
+     * only by the execution, cpu_reset() and cpu_restore())
+     */
+    int8_t verified;
+    /* label addresses used by cpu_run_threaded(), built on its first call */
+    void **threaded_code;
+    /* compiled blocks used by cpu_run_jit(), created on its first call */
+    struct jit *jit;
+    /* guard-page stack used by cpu_run_guarded(), created on its first call */
+    struct guard *guard;
+
+    /* backend of in, get, out and put instructions (see io.h) */
+    struct cpu_io *io;
 };
 
 /**
@@ -45,6 +104,15 @@ struct cpu {
  * when pushing (stack bottom is the highest address). The address space
  * between the end of instructions and start (top) of the stack is filled
  * with zeros.
+ *
+ * Regular files are mapped (mmap) and copied into the memory at once,
+ * other streams (e.g. pipes) are read in blocks.
+ *
+ * The memory is allocated zeroed (calloc) and only the program is written,
+ * so pages of a big stack are committed by the kernel when the program
+ * touches them for the first time (allocations of megabytes are fresh
+ * anonymous mappings). A stack of 100M cells costs no time nor RSS until
+ * it is used.
  * 
  * @param program        file handler containing the program to be executed
  * @param stack_capacity desired stack size, count of int32_t cells, not bytes
@@ -53,13 +121,48 @@ struct cpu {
  * @return pointer to the memory, NULL in case of error
  * 
  * @note If the program size is not divisible by 4 (sizeof int32_t), it is
- * considered as an error.
+ * considered as an error (checked before anything is allocated).
  */
 int32_t *cpu_create_memory(FILE *program, size_t stack_capacity,
                            int32_t **stack_bottom);
 
+/**
+ * @brief Creates the memory like cpu_create_memory(), the program is
+ * copied from a buffer in the format of program files (little-endian words).
+ *
+ * @param bytes          content of a program file
+ * @param length         count of bytes, it has to be divisible by 4
+ * @param stack_capacity desired stack size, count of int32_t cells, not bytes
+ * @param stack_bottom   out parameter, where stack bottom is stored
+ *
+ * @return pointer to the memory, NULL in case of error
+ */
+int32_t *cpu_create_memory_from_bytes(const void *bytes, size_t length,
+                                      size_t stack_capacity,
+                                      int32_t **stack_bottom);
+
+/**
+ * @brief Creates the memory like cpu_create_memory(), the program is
+ * copied from words already in the host byte order (e.g. assembled
+ * by asm_assemble()).
+ *
+ * @param words          program words
+ * @param count          count of program words
+ * @param stack_capacity desired stack size, count of int32_t cells, not bytes
+ * @param stack_bottom   out parameter, where stack bottom is stored
+ *
+ * @return pointer to the memory, NULL in case of error
+ */
+int32_t *cpu_create_memory_from_words(const int32_t *words, size_t count,
+                                      size_t stack_capacity,
+                                      int32_t **stack_bottom);
+
 /**
  * @brief Allocates and initializes struct cpu.
+ *
+ * The program in the memory is decoded (see decode.h), so it is executed
+ * without re-fetching and re-validating the instructions on every step,
+ * and its straight-line code is optimized (see translate.h).
  * 
  * @param memory         pointer to the memory created by cpu_create_memory()
  * @param stack_capacity
@@ -70,6 +173,30 @@ int32_t *cpu_create_memory(FILE *program, size_t stack_capacity,
 struct cpu *cpu_create(int32_t *memory, int32_t *stack_bottom,
                        size_t stack_capacity);
 
+/**
+ * @brief Allocates a cpu running the same program as `prototype`.
+ *
+ * The instructions and the decoded program are shared read-only, only the
+ * stack (of the same capacity) and registers are allocated for the new cpu,
+ * so many clones may run in parallel on different threads. The clone starts
+ * in the initial state, whatever the state of the prototype is, and uses
+ * cpu_io_stdio. The prototype must not be destroyed before its clones.
+ *
+ * @param prototype pointer to the cpu created by cpu_create()
+ *
+ * @return pointer to the struct cpu, NULL in case of error
+ */
+struct cpu *cpu_clone(const struct cpu *prototype);
+
+/**
+ * @brief Attaches I/O backend to the cpu (cpu_io_stdio is attached
+ * by cpu_create()). The backend is not owned by the cpu.
+ *
+ * @param cpu pointer to the cpu
+ * @param io  pointer to the backend, NULL to attach cpu_io_stdio
+ */
+void cpu_set_io(struct cpu *cpu, struct cpu_io *io);
+
 int32_t cpu_get_register(struct cpu *cpu, enum cpu_register reg);
 
 void cpu_set_register(struct cpu *cpu, enum cpu_register reg, int32_t value);
@@ -78,6 +205,12 @@ enum cpu_status cpu_get_status(struct cpu *cpu);
 
 int32_t cpu_get_stack_size(struct cpu *cpu);
 
+/**
+ * @brief Returns opcode of the instruction which will be executed next,
+ * -1 if the instruction index or the opcode is not valid.
+ */
+int32_t cpu_get_opcode(struct cpu *cpu);
+
 /**
  * @brief Sets registers/pointers to 0/NULL and releases resources (memory)
  * 
@@ -88,13 +221,86 @@ void cpu_destroy(struct cpu *cpu);
 /**
  * @brief Zeroes out registers (status included) and stack. Doesn't deallocate
  * any memory.
+ *
+ * Only the filled part of the stack is cleared (the rest is always zero),
+ * big ranges of whole pages are released with madvise(), so they don't stay
+ * resident.
  * 
  * @param cpu pointer to the cpu
  */
 void cpu_reset(struct cpu *cpu);
 
+/**
+ * @brief Lets a cpu waiting for input (CPU_WAITING_INPUT) run again, its
+ * `in` or `get` is executed again by the next run. Other statuses are kept.
+ *
+ * A run stopped by the waiting instruction returns a negative count which
+ * includes the instruction, same as a run stopped by an error.
+ *
+ * @param cpu pointer to the cpu
+ */
+void cpu_resume(struct cpu *cpu);
+
+/**
+ * @brief Prepares the cpu for another run of its program with new I/O.
+ *
+ * The output of the previous run is flushed, then the cpu is reset (see
+ * cpu_reset()). Everything derived from the program is kept: the memory,
+ * the decoded and verified program, compiled code of other engines and
+ * the guarded stack, so a run after cpu_restart() costs the same as
+ * the first one without paying for the setup again.
+ *
+ * @param cpu pointer to the cpu
+ * @param io  backend used by the next run, NULL for cpu_io_stdio
+ */
+void cpu_restart(struct cpu *cpu, struct cpu_io *io);
+
+/**
+ * @brief Captures registers, status, stack pointers and stack contents.
+ *
+ * The stack is captured in 4 KiB blocks, as the memory is allocated. Blocks
+ * are copy-on-write: blocks not written to since the last snapshot
+ * of the cpu was taken or restored are shared with that snapshot, and blocks
+ * between stack roof and stack top are not stored at all (they are zeroed).
+ * The I/O backend and its buffers are not part of the snapshot.
+ *
+ * @param cpu pointer to the cpu
+ *
+ * @return pointer to the snapshot, NULL in case of error
+ */
+struct cpu_snapshot *cpu_snapshot(struct cpu *cpu);
+
+/**
+ * @brief Returns the cpu to the state captured by cpu_snapshot(), only
+ * blocks which differ from the snapshot are copied.
+ *
+ * The snapshot may be restored any number of times, also into clones of the
+ * captured cpu (see cpu_clone()), and many cpus may be restored from one
+ * snapshot in parallel.
+ *
+ * @param cpu      pointer to the cpu running the same program as the
+ *                 captured one
+ * @param snapshot pointer to the snapshot
+ */
+void cpu_restore(struct cpu *cpu, const struct cpu_snapshot *snapshot);
+
+/**
+ * @brief Releases the snapshot, blocks still shared with other snapshots
+ * or cpus are kept.
+ */
+void cpu_snapshot_destroy(struct cpu_snapshot *snapshot);
+
+/**
+ * @brief Returns the count of bytes the snapshot takes. Blocks shared with
+ * other snapshots or cpus are counted by their share, so the sizes of all
+ * snapshots of a cpu add up to about the memory they take together.
+ */
+size_t cpu_snapshot_size(const struct cpu_snapshot *snapshot);
+
 /**
  * @brief Executes one instruction.
+ *
+ * The output of the I/O backend is flushed when the cpu stops.
  * 
  * @param cpu pointer to the cpu
  * 
@@ -112,4 +318,32 @@ int cpu_step(struct cpu *cpu);
  */
 long long cpu_run(struct cpu *cpu, size_t steps);
 
+/**
+ * @brief Executes `steps` instructions using the direct-threaded interpreter.
+ *
+ * Produces the same results as cpu_run() (return value included), it only
+ * uses a faster dispatch (labels as values, GCC extension). Without GCC
+ * it falls back to cpu_run().
+ */
+long long cpu_run_threaded(struct cpu *cpu, size_t steps);
+
+/**
+ * @brief Executes `steps` instructions, hot blocks are compiled
+ * to native code (see jit.h).
+ *
+ * Produces the same results as cpu_run() (return value included). On other
+ * platforms than x86-64 Linux it falls back to cpu_run().
+ */
+long long cpu_run_jit(struct cpu *cpu, size_t steps);
+
+/**
+ * @brief Executes `steps` instructions, the stack is bracketed by guard
+ * pages, so push and pop don't check its bounds (see guard.h).
+ *
+ * Produces the same results as cpu_run() (return value included). For
+ * stack capacities which are not a multiple of the page size and on other
+ * platforms than Linux with GCC it falls back to cpu_run().
+ */
+long long cpu_run_guarded(struct cpu *cpu, size_t steps);
+
 #endif  // CPU_H
@@ -0,0 +1,302 @@
+#ifndef CPU32_H
+#define CPU32_H
+
+/**
+ * @file cpu32.h
+ * @brief Public API of libcpu32, the emulator embedded into other programs.
+ *
+ * The vm is opaque, its layout can change without breaking programs linked
+ * against the library (libcpu32.so or libcpu32.a, see `make lib`). Only this
+ * header is needed to use it, the other headers describe the internals.
+ *
+ * A vm is created from a program already in memory, it runs with cpu_run()
+ * and reads and writes through callbacks (or the standard streams):
+ *
+ *   struct cpu32_vm *vm = cpu32_create(bytes, length, 1024);
+ *   cpu32_set_io(vm, &callbacks);
+ *   cpu32_run_until(vm, cpu32_now() + 10000000);  // at most 10 ms
+ *   if (cpu32_get_status(vm) == CPU32_HALTED) ...
+ *   cpu32_destroy(vm);
+ *
+ * A vm must not be used by two threads at once, different vms can be.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * marks the functions exported by libcpu32.so, the library is compiled with
+ * -fvisibility=hidden, so nothing else of it is visible to the host
+ */
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define CPU32_API __attribute__((visibility("default")))
+#else
+#define CPU32_API
+#endif
+
+/* incremented when the API changes incompatibly */
+#define CPU32_API_VERSION 1
+
+/* values are the same as of enum cpu_status */
+enum cpu32_status {
+    CPU32_OK = 0,
+    CPU32_HALTED = 1,
+    CPU32_ILLEGAL_INSTRUCTION = 2,
+    CPU32_ILLEGAL_OPERAND = 3,
+    CPU32_INVALID_ADDRESS = 4,
+    CPU32_INVALID_STACK_OPERATION = 5,
+    CPU32_DIV_BY_ZERO = 6,
+    CPU32_IO_ERROR = 7,
+    /* a read callback returned CPU32_IO_WAIT, see cpu32_resume() */
+    CPU32_WAITING_INPUT = 8
+};
+
+enum cpu32_register {
+    CPU32_REGISTER_A = 0,
+    CPU32_REGISTER_B = 1,
+    CPU32_REGISTER_C = 2,
+    CPU32_REGISTER_D = 3
+};
+
+struct cpu32_vm;
+
+/*
+ * returned by the read callbacks when the input is not there yet, the vm
+ * stops waiting for it instead of blocking (nothing may be consumed then)
+ */
+#define CPU32_IO_WAIT (-2)
+
+/*
+ * I/O of the `in`, `get`, `out` and `put` instructions, every callback gets
+ * the context. Only flush may be NULL.
+ */
+struct cpu32_io {
+    void *context;
+
+    /*
+     * Reads a number like scanf("%d"), returns 1, 0 or EOF as it does,
+     * or CPU32_IO_WAIT.
+     */
+    int (*read_number)(void *context, int32_t *number);
+
+    /* Reads a single byte, returns EOF at the end of input, CPU32_IO_WAIT. */
+    int (*read_byte)(void *context);
+
+    /* Writes a number in decimal. */
+    void (*write_number)(void *context, int32_t number);
+
+    /* Writes a single byte. */
+    void (*write_byte)(void *context, unsigned char byte);
+
+    /* Writes out everything buffered, called when a run stops. */
+    void (*flush)(void *context);
+};
+
+/**
+ * @brief Returns CPU32_API_VERSION the library was built with.
+ */
+CPU32_API int cpu32_api_version(void);
+
+/**
+ * @brief Returns the current time of the monotonic clock in nanoseconds,
+ * the clock cpu32_run_until() uses.
+ */
+CPU32_API uint64_t cpu32_now(void);
+
+/**
+ * @brief Creates a vm running the program, the I/O goes to the standard
+ * streams until cpu32_set_io() is called.
+ *
+ * @param program        content of a program file (little-endian words),
+ *                       it is copied
+ * @param length         count of bytes, it has to be divisible by 4
+ * @param stack_capacity count of stack cells
+ *
+ * @return pointer to the vm, NULL in case of error
+ */
+CPU32_API struct cpu32_vm *cpu32_create(const void *program, size_t length,
+                                        size_t stack_capacity);
+
+/**
+ * @brief Creates a vm running the program of another one, which is shared,
+ * so only the stack is allocated (see cpu_clone()). The I/O goes to
+ * the standard streams until cpu32_set_io() is called.
+ *
+ * @param prototype vm created by cpu32_create(), it has to stay alive until
+ *                  the clone is destroyed and it must not be run meanwhile
+ *
+ * @return pointer to the vm, NULL in case of error
+ */
+CPU32_API struct cpu32_vm *cpu32_clone(const struct cpu32_vm *prototype);
+
+/**
+ * @brief Flushes the output and releases the vm.
+ */
+CPU32_API void cpu32_destroy(struct cpu32_vm *vm);
+
+/**
+ * @brief Sets the callbacks the vm reads and writes through, the struct is
+ * copied. NULL sets the standard streams back.
+ */
+CPU32_API void cpu32_set_io(struct cpu32_vm *vm, const struct cpu32_io *io);
+
+/**
+ * @brief Flushes the output and resets the vm (registers, status, stack)
+ * for another run of the program, the I/O stays set.
+ */
+CPU32_API void cpu32_reset(struct cpu32_vm *vm);
+
+/**
+ * @brief Lets a vm waiting for input (CPU32_WAITING_INPUT) run again, the
+ * waiting instruction reads again in the next run.
+ */
+CPU32_API void cpu32_resume(struct cpu32_vm *vm);
+
+/**
+ * @brief Runs at most `steps` instructions.
+ *
+ * @return count of executed instructions, negative if the run stopped
+ * on an error (see cpu_run())
+ */
+CPU32_API long long cpu32_run(struct cpu32_vm *vm, size_t steps);
+
+/**
+ * @brief Runs until the vm stops or until the deadline passes.
+ *
+ * The clock is checked every few thousand instructions, so the run ends
+ * a few microseconds after the deadline (later if a callback blocks).
+ *
+ * @param deadline time of cpu32_now() when the run has to end
+ *
+ * @return count of executed instructions, negative if the run stopped
+ * on an error. The status is CPU32_OK if the deadline ended the run.
+ */
+CPU32_API long long cpu32_run_until(struct cpu32_vm *vm, uint64_t deadline);
+
+CPU32_API enum cpu32_status cpu32_get_status(const struct cpu32_vm *vm);
+
+CPU32_API int32_t cpu32_get_register(const struct cpu32_vm *vm,
+                                     enum cpu32_register reg);
+
+CPU32_API void cpu32_set_register(struct cpu32_vm *vm,
+                                  enum cpu32_register reg, int32_t value);
+
+/**
+ * @brief Returns count of values on the stack.
+ */
+CPU32_API size_t cpu32_get_stack_size(const struct cpu32_vm *vm);
+
+/**
+ * @brief Makes the vm read from and write to queues instead of callbacks
+ * or the standard streams. The host pushes the input as it arrives, `in`
+ * and `get` reading past it stop the vm with CPU32_WAITING_INPUT, and
+ * the output stays queued until the host takes it. cpu32_set_io() drops
+ * the queues.
+ *
+ * @return 0 on success, -1 in case of error
+ */
+CPU32_API int cpu32_set_queue_io(struct cpu32_vm *vm);
+
+/**
+ * @brief Appends the bytes to the input queue of the vm. A number is read
+ * only once it is followed by another character or the input is closed.
+ *
+ * @return 0 on success, -1 if the vm has no queues or in case of error
+ */
+CPU32_API int cpu32_push_input(struct cpu32_vm *vm, const void *bytes,
+                               size_t length);
+
+/**
+ * @brief Ends the input queue, reads past it return EOF instead of waiting.
+ */
+CPU32_API void cpu32_close_input(struct cpu32_vm *vm);
+
+/**
+ * @brief Moves at most `size` bytes of the queued output to the buffer.
+ *
+ * @return count of moved bytes
+ */
+CPU32_API size_t cpu32_take_output(struct cpu32_vm *vm, void *buffer,
+                                   size_t size);
+
+/*
+ * Round-robin scheduler running many vms on the calling thread, e.g. from
+ * an event loop (see scheduler.h for the internals):
+ *
+ *   cpu32_scheduler_add(scheduler, vm, 10000);
+ *   while (cpu32_scheduler_runnable(scheduler) > 0) {
+ *       struct cpu32_vm *vm = cpu32_scheduler_step(scheduler);
+ *       if (vm != NULL && cpu32_get_status(vm) == CPU32_WAITING_INPUT)
+ *           ...  // later cpu32_push_input() and cpu32_scheduler_wake()
+ *   }
+ *
+ * A vm is in at most one scheduler. A scheduler and its vms belong to one
+ * thread.
+ */
+struct cpu32_scheduler;
+
+/**
+ * @return pointer to an empty scheduler, NULL in case of error
+ */
+CPU32_API struct cpu32_scheduler *cpu32_scheduler_create(void);
+
+/**
+ * @brief Releases the scheduler, its vms have to be removed or destroyed
+ * before.
+ */
+CPU32_API void cpu32_scheduler_destroy(struct cpu32_scheduler *scheduler);
+
+/**
+ * @brief Adds the vm to the end of the queue if it can run (CPU32_OK),
+ * the vm runs at most `budget` instructions in one turn. The count
+ * of executed instructions of the vm starts again from 0.
+ */
+CPU32_API void cpu32_scheduler_add(struct cpu32_scheduler *scheduler,
+                                   struct cpu32_vm *vm, size_t budget);
+
+/**
+ * @brief Lets a vm which stopped waiting for input run again (see
+ * cpu32_resume()), nothing happens if it is queued already or stopped
+ * for another reason.
+ */
+CPU32_API void cpu32_scheduler_wake(struct cpu32_scheduler *scheduler,
+                                    struct cpu32_vm *vm);
+
+/**
+ * @brief Removes the vm from the scheduler, cpu32_destroy() does it too.
+ */
+CPU32_API void cpu32_scheduler_remove(struct cpu32_scheduler *scheduler,
+                                      struct cpu32_vm *vm);
+
+/**
+ * @brief Returns the count of queued vms.
+ */
+CPU32_API size_t cpu32_scheduler_runnable(
+    const struct cpu32_scheduler *scheduler);
+
+/**
+ * @brief Runs one turn of the first vm of the queue.
+ *
+ * @return the vm if it left the queue because it stopped (waiting
+ * for input, halted or failed), NULL if it was queued again or the queue
+ * is empty
+ */
+CPU32_API struct cpu32_vm *cpu32_scheduler_step(
+    struct cpu32_scheduler *scheduler);
+
+/**
+ * @brief Returns the count of instructions the vm executed in its turns
+ * since cpu32_scheduler_add(), an `in` or `get` which waited is counted
+ * once, when it read.
+ */
+CPU32_API long long cpu32_scheduler_executed(const struct cpu32_vm *vm);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // CPU32_H
@@ -0,0 +1,146 @@
+#ifndef DEBUG_H
+#define DEBUG_H
+
+/**
+ * @file debug.h
+ * @brief Time-travel debugging of a replayed run (see replay.h).
+ *
+ * The debugger moves a replay forward and backward. Every state is
+ * identified by its position, the count of instructions executed from
+ * the start. Going back restores the nearest checkpoint of the replay
+ * and executes the rest again, so stepping back costs at most one interval
+ * of instructions, however long the run is. The memory of checkpoints is
+ * bounded by the budget of the replay.
+ *
+ * Breakpoints stop in front of an instruction index, watchpoints after
+ * an instruction which changed a register or a stack cell. Without
+ * watchpoints, the replay runs by cpu_run() with the breakpoints patched
+ * into the decoded program (see breakpoint.h), so continuing is as fast
+ * as a run. Watchpoints are checked after every instruction.
+ *
+ * debugger_reverse_continue() goes back to the last event in front of
+ * the current position: it executes the interval from the checkpoint
+ * in front of it, remembers the last breakpoint or change of a watched
+ * value and seeks to it, or tries the previous interval if there was none.
+ * A watchpoint stops in front of the instruction changing the value, so
+ * stepping forward changes it again.
+ */
+
+#include <stdint.h>
+
+#include "cpu.h"
+#include "replay.h"
+
+enum debug_event {
+    /* all steps were executed */
+    DEBUG_STEPPED,
+    /* the next instruction has a breakpoint */
+    DEBUG_BREAKPOINT,
+    /* a watched value changed, see debugger_hit() */
+    DEBUG_WATCHPOINT,
+    /* the program stopped (halt or error) */
+    DEBUG_STOPPED,
+    /* going back reached the start */
+    DEBUG_START,
+    DEBUG_ERROR
+};
+
+struct debugger;
+
+/**
+ * @brief Allocates a debugger of the replay, the cpu has to be the one
+ * of the replay.
+ *
+ * @return pointer to the debugger, NULL in case of error
+ */
+struct debugger *debugger_create(struct cpu *cpu, struct replay *replay);
+
+/**
+ * @brief Removes the breakpoints from the program and releases the debugger
+ * (the replay is kept).
+ */
+void debugger_destroy(struct debugger *debugger);
+
+/**
+ * @brief Sets a breakpoint at the instruction index.
+ *
+ * @return 0 on success, -1 if the index is outside of the program or
+ * in case of error
+ */
+int debugger_break(struct debugger *debugger, int32_t index);
+
+/**
+ * @brief Removes the breakpoint at the instruction index.
+ *
+ * @return 0 on success, -1 if there is no breakpoint at the index
+ */
+int debugger_delete(struct debugger *debugger, int32_t index);
+
+/**
+ * @brief Watches the register.
+ *
+ * @return number of the watchpoint, -1 in case of error
+ */
+int debugger_watch_register(struct debugger *debugger,
+                            enum cpu_register reg);
+
+/**
+ * @brief Watches the stack cell, counted from the stack bottom (0 is
+ * the first pushed value).
+ *
+ * @return number of the watchpoint, -1 if the cell is outside of the stack
+ * or in case of error
+ */
+int debugger_watch_cell(struct debugger *debugger, int32_t cell);
+
+/**
+ * @brief Removes the watchpoint.
+ *
+ * @return 0 on success, -1 if there is no such watchpoint
+ */
+int debugger_unwatch(struct debugger *debugger, int watch);
+
+/**
+ * @brief Returns the number of the watchpoint which stopped the last
+ * movement, -1 if it was not a watchpoint.
+ */
+int debugger_hit(const struct debugger *debugger);
+
+/**
+ * @brief Executes `count` instructions, breakpoints and watchpoints are
+ * not checked.
+ */
+enum debug_event debugger_step(struct debugger *debugger, uint64_t count);
+
+/**
+ * @brief Executes instructions until a breakpoint, a watchpoint or a stop
+ * of the program.
+ */
+enum debug_event debugger_continue(struct debugger *debugger);
+
+/**
+ * @brief Goes `count` instructions back (at most to the start), breakpoints
+ * and watchpoints are not checked.
+ */
+enum debug_event debugger_reverse_step(struct debugger *debugger,
+                                       uint64_t count);
+
+/**
+ * @brief Goes back to the last breakpoint or watchpoint in front of the
+ * current position, or to the start.
+ */
+enum debug_event debugger_reverse_continue(struct debugger *debugger);
+
+/**
+ * @brief Goes to the state after `step` instructions from the start.
+ *
+ * @return DEBUG_STEPPED, DEBUG_STOPPED if the program stops before the step
+ */
+enum debug_event debugger_goto(struct debugger *debugger, uint64_t step);
+
+/**
+ * @brief Returns the count of instructions executed from the start.
+ */
+uint64_t debugger_position(const struct debugger *debugger);
+
+#endif  // DEBUG_H
@@ -0,0 +1,128 @@
+#ifndef DECODE_H
+#define DECODE_H
+
+/**
+ * @file decode.h
+ * @brief Load-time decoding of the program image.
+ *
+ * Every word below the stack roof is decoded once into a struct decoded_op.
+ * Opcodes and register operands are validated during decoding, so the
+ * handlers executing decoded ops don't have to re-fetch or re-check them.
+ * Invalid instructions are decoded into ops which only set the
+ * corresponding cpu status, so the observable behaviour stays the same.
+ */
+
+#include "cpu.h"
+
+struct decoded_op;
+
+/* count of words taken by the longest instruction */
+#define INSTRUCTION_MAX_LENGTH 3
+
+/*
+ * the longest sequence of instructions executed by one op, fused by cpu_fuse()
+ * or translated by cpu_translate()
+ */
+#define FUSED_MAX_LENGTH 16
+
+/**
+ * Returns count of executed instructions (1 for single instructions).
+ * If the execution should stop, returns -K, where K is the count
+ * of instructions executed before the one which stopped it
+ * (so single instructions return 1 on success and 0 otherwise, same
+ * convention as instructions in instructions.h).
+ */
+typedef int (*decoded_handler)(struct cpu *cpu, const struct decoded_op *op);
+
+struct decoded_op {
+    decoded_handler execute;
+    int32_t opcode;
+    /* register operands, already checked to be in range <0, 3> */
+    int32_t reg1;
+    int32_t reg2;
+    /* NUM or INDEX operand */
+    int32_t number;
+    /* instruction_index of the following instruction */
+    int32_t next;
+    /*
+     * count of instructions executed by `execute`, more than 1 if the op was
+     * fused with the following ones by cpu_fuse(); the other fields always
+     * describe only the first instruction
+     */
+    int32_t length;
+};
+
+/* count of words (opcode included) taken by each instruction */
+extern const int32_t instruction_lengths[19];
+
+/* mnemonics of instructions */
+extern const char *const instruction_names[19];
+
+/**
+ * @brief Decodes a single instruction located at memory + index.
+ *
+ * @param memory pointer to the memory created by cpu_create_memory()
+ * @param size   count of words which can be decoded ahead (see cpu_decode())
+ * @param index  index of the instruction
+ * @param op     out parameter, where the decoded op is stored
+ */
+void decode_instruction(const int32_t *memory, int32_t size, int32_t index,
+                        struct decoded_op *op);
+
+/**
+ * @brief Decodes every word of the program image into a decoded op.
+ *
+ * Instructions whose operands would reach into the stack
+ * (index + length > size) can't be decoded ahead, because the stack content
+ * changes at run time. They are decoded into ops which fetch and execute
+ * the instruction from the memory every time.
+ *
+ * @param memory pointer to the memory created by cpu_create_memory()
+ * @param size   count of words in front of the stack roof
+ *
+ * @return array of `size` decoded ops, NULL in case of error
+ */
+struct decoded_op *cpu_decode(const int32_t *memory, int32_t size);
+
+/**
+ * @brief Fuses frequent sequences of instructions into superinstructions.
+ *
+ * The first op of a recognized sequence gets a fused handler executing
+ * the whole sequence, the ops of the following instructions are kept
+ * as they are (they can still be jumped to). A fused op leaves the cpu
+ * in the same state as the sequence would, also when it stops in the middle.
+ *
+ * Recognized sequences:
+ *   add R; dec S; loop INDEX
+ *   dec R; loop INDEX
+ *   movr R NUM; put R (0 <= NUM <= 255)
+ *   movr R NUM; out R
+ *   movr R NUM; movr S NUM
+ *   push R; pop S
+ *
+ * @param program decoded program created by cpu_decode()
+ * @param size    count of ops in the program
+ */
+void cpu_fuse(struct decoded_op *program, int32_t size);
+
+/**
+ * @brief Proves that the execution of the program stays inside of it.
+ *
+ * Instructions reachable from index 0 are walked through both the following
+ * instruction and `loop` targets. The program is verified if every reachable
+ * instruction is valid (known opcode, registers in range, operands in front
+ * of the stack roof) and every reachable index lies inside the program and
+ * on an instruction boundary (not in the operands of another reachable
+ * instruction). Then instruction_index never has to be checked before
+ * dispatch, an instruction can only stop the execution by its own checks
+ * (stack, division, I/O) or by halt.
+ *
+ * @param program decoded program created by cpu_decode()
+ * @param size    count of ops in the program
+ *
+ * @return non-zero if the program is verified, 0 if it is not (or there is
+ *         not enough memory to verify it)
+ */
+int cpu_verify(const struct decoded_op *program, int32_t size);
+
+#endif  // DECODE_H
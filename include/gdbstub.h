@@ -0,0 +1,72 @@
+#ifndef GDBSTUB_H
+#define GDBSTUB_H
+
+/**
+ * @file gdbstub.h
+ * @brief GDB remote serial protocol stub, used by `gdb` mode.
+ *
+ * The debugger talks to the stub over a Unix-domain socket or a pair
+ * of descriptors (e.g. stdin and stdout of `target remote | cpu32 gdb ...`).
+ * The cpu is seen as a 32-bit target described by target.xml
+ * (qXfer:features:read):
+ *
+ *   a, b, c, d  registers A-D
+ *   pc          instruction_index * 4
+ *   sp          byte address of the stack top (of the cell behind the stack
+ *               bottom if the stack is empty), read only
+ *
+ * Memory is addressed in bytes from the start of the cpu memory: words
+ * of the program followed by the stack, little-endian. All of it can be
+ * read, only the filled part of the stack can be written (the program is
+ * decoded on load).
+ *
+ * Breakpoints (Z0/z0 at instruction_index * 4) are patched into the decoded
+ * program (see breakpoint.h), the image stays unchanged. `c` runs
+ * the program by cpu_run() in chunks of GDBSTUB_CHUNK instructions and
+ * checks for an interrupt (^C) between them, `s` executes one instruction.
+ * Stops are reported as SIGTRAP, errors of the program as signals (illegal
+ * instruction as SIGILL, invalid address or stack operation as SIGSEGV,
+ * division by zero as SIGFPE, I/O error as SIGIO), halt as exit code 0.
+ *
+ * Nothing of this is compiled into the other modes, they run unchanged.
+ */
+
+#include "cpu.h"
+
+/* the longest packet accepted or sent */
+#define GDBSTUB_PACKET_SIZE 4096
+
+/* count of instructions executed between checks for an interrupt */
+#define GDBSTUB_CHUNK (1024 * 1024)
+
+/**
+ * @brief Creates a Unix-domain socket at `path` (replacing a stale one)
+ * the debugger can connect to.
+ *
+ * @return descriptor of the listening socket, -1 in case of error
+ */
+int gdbstub_listen(const char *path);
+
+/**
+ * @brief Waits for one debugger to connect, then closes the listening
+ * socket and removes its path.
+ *
+ * @return descriptor of the connection, -1 in case of error
+ */
+int gdbstub_accept(int listener, const char *path);
+
+/**
+ * @brief Serves the debugger until it detaches, kills the program,
+ * closes the connection or the program halts.
+ *
+ * @param cpu    cpu to debug, its breakpoints are removed before returning
+ * @param in_fd  descriptor the packets are read from
+ * @param out_fd descriptor the replies are written to
+ *
+ * @return 0 if the debugger detached, closed the connection or the program
+ * halted (the cpu may be run on), -1 if the debugger killed the program
+ * or in case of error
+ */
+int gdbstub_serve(struct cpu *cpu, int in_fd, int out_fd);
+
+#endif  // GDBSTUB_H
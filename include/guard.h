@@ -0,0 +1,47 @@
+#ifndef GUARD_H
+#define GUARD_H
+
+/**
+ * @file guard.h
+ * @brief Guard-page stack used by cpu_run_guarded().
+ *
+ * On the first call of cpu_run_guarded() the stack is moved into its own
+ * mapping, bracketed by PROT_NONE pages: the cell in front of stack roof
+ * and the cell behind stack bottom are not accessible. push and pop then
+ * don't check the stack bounds, pushing to a full stack writes in front
+ * of the roof and popping from an empty one reads behind the bottom.
+ * The SIGSEGV is caught and turned into CPU_INVALID_STACK_OPERATION of the
+ * instruction, which leaves the cpu as the checked one would.
+ *
+ * The stack roof has to start a page and the bottom has to end one, so only
+ * capacities which are multiples of the page size (in cells, 1024 with 4 KiB
+ * pages) can be guarded. load and store keep their check, their offsets can
+ * reach anywhere. The guarded stack stays in use by all engines until
+ * cpu_destroy(), only cpu_run_guarded() relies on the guard pages.
+ *
+ * Guard pages are supported on Linux with GCC, cpu_run_guarded() behaves
+ * like cpu_run() elsewhere (and for other capacities).
+ */
+
+#include "cpu.h"
+
+struct guard;
+
+/**
+ * @brief Moves the stack of the cpu between guard pages and installs
+ * the SIGSEGV handler (once per process).
+ *
+ * The previous SIGSEGV handler is still called for faults outside of guard
+ * pages of a running cpu_run_guarded().
+ *
+ * @return pointer to the guard state, NULL in case of error (or if the
+ * capacity or the platform is not supported), the stack is not moved then
+ */
+struct guard *guard_create(struct cpu *cpu);
+
+/**
+ * @brief Unmaps the guarded stack and releases the guard state.
+ */
+void guard_destroy(struct guard *guard);
+
+#endif  // GUARD_H
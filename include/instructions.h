@@ -14,6 +14,7 @@
  */
 
 #include "cpu.h"
+#include "decode.h"
 
 /**
  * @brief Instruction 0 - nop
@@ -122,6 +123,9 @@ int store(struct cpu *cpu);
  *
  * If there are no more numbers on the input (EOF), register C is set to 0 and
  * the value of REG is set to -1 (even if REG is C).
+ *
+ * If the backend has no input yet (CPU_IO_WAIT), instruction won't execute
+ * and cpu status is set to CPU_WAITING_INPUT.
  */
 int in(struct cpu *cpu);
 
@@ -132,6 +136,9 @@ int in(struct cpu *cpu);
  *
  * If there are no more numbers on the input (EOF), register C is set to 0 and
  * the value of REG is set to -1 (even if REG is C).
+ *
+ * If the backend has no input yet (CPU_IO_WAIT), instruction won't execute
+ * and cpu status is set to CPU_WAITING_INPUT.
  */
 int get(struct cpu *cpu);
 
@@ -180,6 +187,89 @@ int push(struct cpu *cpu);
  */
 int pop(struct cpu *cpu);
 
+/*
+ * The instructions above indexed by opcode. Each one executes its own
+ * instruction with the operands following cpu->instruction_index, whatever
+ * opcode is stored there.
+ */
 extern int (*instructions[19]) (struct cpu *);
 
+/*
+ * Handlers of decoded ops (see decode.h). They behave exactly like
+ * the instructions above, but take their operands from the decoded op,
+ * which were already validated by cpu_decode().
+ */
+
+int exec_nop(struct cpu *cpu, const struct decoded_op *op);
+int exec_halt(struct cpu *cpu, const struct decoded_op *op);
+int exec_add(struct cpu *cpu, const struct decoded_op *op);
+int exec_sub(struct cpu *cpu, const struct decoded_op *op);
+int exec_mul(struct cpu *cpu, const struct decoded_op *op);
+int exec_div(struct cpu *cpu, const struct decoded_op *op);
+int exec_inc(struct cpu *cpu, const struct decoded_op *op);
+int exec_dec(struct cpu *cpu, const struct decoded_op *op);
+int exec_loop(struct cpu *cpu, const struct decoded_op *op);
+int exec_movr(struct cpu *cpu, const struct decoded_op *op);
+int exec_load(struct cpu *cpu, const struct decoded_op *op);
+int exec_store(struct cpu *cpu, const struct decoded_op *op);
+int exec_in(struct cpu *cpu, const struct decoded_op *op);
+int exec_get(struct cpu *cpu, const struct decoded_op *op);
+int exec_out(struct cpu *cpu, const struct decoded_op *op);
+int exec_put(struct cpu *cpu, const struct decoded_op *op);
+int exec_swap(struct cpu *cpu, const struct decoded_op *op);
+int exec_push(struct cpu *cpu, const struct decoded_op *op);
+int exec_pop(struct cpu *cpu, const struct decoded_op *op);
+
+/**
+ * @brief Sets cpu status to CPU_ILLEGAL_INSTRUCTION.
+ */
+int exec_illegal_instruction(struct cpu *cpu, const struct decoded_op *op);
+
+/**
+ * @brief Sets cpu status to CPU_ILLEGAL_OPERAND.
+ */
+int exec_illegal_operand(struct cpu *cpu, const struct decoded_op *op);
+
+/**
+ * @brief Fetches the instruction from the memory and executes it
+ * (used when operands of the instruction are located in the stack).
+ */
+int exec_dynamic(struct cpu *cpu, const struct decoded_op *op);
+
+/*
+ * Fused handlers (see cpu_fuse()), `op` describes the first instruction
+ * of the sequence, the following ones are read from cpu->program.
+ */
+
+int exec_add_dec_loop(struct cpu *cpu, const struct decoded_op *op);
+int exec_dec_loop(struct cpu *cpu, const struct decoded_op *op);
+int exec_movr_put(struct cpu *cpu, const struct decoded_op *op);
+int exec_movr_out(struct cpu *cpu, const struct decoded_op *op);
+int exec_movr_movr(struct cpu *cpu, const struct decoded_op *op);
+int exec_push_pop(struct cpu *cpu, const struct decoded_op *op);
+
+extern decoded_handler decoded_instructions[19];
+
+/**
+ * @brief Returns non-zero if op executes a valid instruction, possibly fused
+ * with the following ones (its fields can be interpreted by the opcode).
+ */
+static inline int decoded_is_valid(const struct decoded_op *op)
+{
+    return op->length > 1 || (op->opcode >= 0 && op->opcode <= 18 &&
+                              op->execute == decoded_instructions[op->opcode]);
+}
+
+/**
+ * @brief Executes only the first instruction of op, even if it is fused.
+ *
+ * @return 1 on success, 0 if the execution should stop
+ */
+static inline int execute_single(struct cpu *cpu, const struct decoded_op *op)
+{
+    if (op->length > 1)
+        return decoded_instructions[op->opcode](cpu, op);
+    return op->execute(cpu, op);
+}
+
 #endif  // INSTRUCTIONS_H
@@ -0,0 +1,117 @@
+#ifndef IO_H
+#define IO_H
+
+/**
+ * @file io.h
+ * @brief Input/output backends used by instructions in, get, out and put.
+ *
+ * Every cpu has a backend attached (see cpu_set_io()), by default it is
+ * cpu_io_stdio. The buffered backend reads and writes file descriptors
+ * in big blocks with its own number parser and formatter, it is flushed
+ * when the cpu stops (halt or error), when the output buffer is full and
+ * before the input buffer is refilled. The queue backend never blocks,
+ * the host pushes its input and takes its output (see io_create_queue()).
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * returned by reads of a backend which doesn't block, when the input
+ * needed is not there yet (nothing is consumed then)
+ */
+#define CPU_IO_WAIT (-2)
+
+struct cpu_io {
+    /**
+     * Reads a decimal number (same as scanf("%" SCNd32)).
+     * Returns 1 on success, 0 if the input is not a number,
+     * EOF if there are no more numbers on the input, CPU_IO_WAIT.
+     */
+    int (*read_number)(struct cpu_io *io, int32_t *number);
+
+    /* Reads a single byte, returns EOF at the end of input, CPU_IO_WAIT. */
+    int (*read_byte)(struct cpu_io *io);
+
+    /* Writes number as a decimal number. */
+    void (*write_number)(struct cpu_io *io, int32_t number);
+
+    /* Writes a single byte. */
+    void (*write_byte)(struct cpu_io *io, unsigned char byte);
+
+    /* Writes out everything buffered. */
+    void (*flush)(struct cpu_io *io);
+};
+
+/* backend using scanf(), getchar(), printf() and putchar() */
+extern struct cpu_io cpu_io_stdio;
+
+/* size of each of the input and output buffers of the buffered backend */
+#define IO_BUFFER_SIZE (64 * 1024)
+
+/**
+ * @brief Allocates a buffered backend reading from `input_fd` and writing
+ * to `output_fd`.
+ *
+ * @return pointer to the backend, NULL in case of error
+ */
+struct cpu_io *io_create_buffered(int input_fd, int output_fd);
+
+/**
+ * @brief Flushes the buffered backend and makes it read from `input_fd`
+ * and write to `output_fd`, the rest of the previous input is dropped.
+ *
+ * Reuses the buffers, so a backend can serve many short runs one after
+ * another without being allocated for each of them.
+ */
+void io_rebind_buffered(struct cpu_io *io, int input_fd, int output_fd);
+
+/**
+ * @brief Flushes and releases the buffered backend.
+ */
+void io_destroy_buffered(struct cpu_io *io);
+
+/**
+ * @brief Allocates a queue backend, which never blocks.
+ *
+ * The host pushes the input as it arrives (e.g. from a socket), reads
+ * of the program return CPU_IO_WAIT when the input they need was not pushed
+ * yet, so `in` and `get` leave the cpu waiting (CPU_WAITING_INPUT) instead
+ * of blocking the thread. A number is read only once it is followed by
+ * another character or the input is closed. The output is queued until
+ * the host takes it.
+ *
+ * @return pointer to the backend, NULL in case of error
+ */
+struct cpu_io *io_create_queue(void);
+
+/**
+ * @brief Releases the queue backend with the queued input and output.
+ */
+void io_destroy_queue(struct cpu_io *io);
+
+/**
+ * @brief Appends the bytes to the input of the queue backend.
+ *
+ * @return 0 on success, -1 in case of error (nothing is appended)
+ */
+int io_queue_push(struct cpu_io *io, const void *bytes, size_t length);
+
+/**
+ * @brief Ends the input of the queue backend, reads behind the pushed
+ * input return EOF instead of CPU_IO_WAIT.
+ */
+void io_queue_close(struct cpu_io *io);
+
+/**
+ * @brief Returns the count of queued output bytes, stores where they are
+ * into `bytes`. The bytes are valid until the next run or consume.
+ */
+size_t io_queue_output(struct cpu_io *io, const unsigned char **bytes);
+
+/**
+ * @brief Drops the first `length` bytes of the queued output.
+ */
+void io_queue_consume(struct cpu_io *io, size_t length);
+
+#endif  // IO_H
@@ -0,0 +1,42 @@
+#ifndef JIT_H
+#define JIT_H
+
+/**
+ * @file jit.h
+ * @brief Basic-block JIT compiler to x86-64 used by cpu_run_jit().
+ *
+ * Blocks start at `loop` targets. When a target is jumped to
+ * JIT_THRESHOLD times, the block starting there is compiled into native
+ * code. The block contains only register instructions (nop, add, sub, mul,
+ * div, inc, dec, movr, swap) and ends at `loop`, `halt` or at the first
+ * instruction which can't be compiled. Such instructions (stack, I/O,
+ * invalid ones) and faulting paths (div by zero) are left
+ * to the interpreter, so cpu status and step counts stay exact.
+ *
+ * A block ending with `loop` to its own start iterates in the native code
+ * as long as the step budget allows a whole iteration.
+ */
+
+#include "cpu.h"
+
+#define JIT_THRESHOLD 16
+
+/* size of the executable buffer for compiled blocks */
+#define JIT_BUFFER_SIZE (4 * 1024 * 1024)
+
+struct jit;
+
+/**
+ * @brief Allocates JIT state for the decoded program of the cpu.
+ *
+ * @return pointer to the JIT state, NULL in case of error (or if the JIT is
+ * not supported on this platform)
+ */
+struct jit *jit_create(struct cpu *cpu);
+
+/**
+ * @brief Releases compiled code and the JIT state.
+ */
+void jit_destroy(struct jit *jit);
+
+#endif  // JIT_H
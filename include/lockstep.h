@@ -0,0 +1,55 @@
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+/**
+ * @file lockstep.h
+ * @brief Running one program on many cpus at once, instruction by
+ * instruction across all of them (SIMD lockstep).
+ *
+ * Cpus at the same instruction index form a group. Registers of the group
+ * are kept as a structure of arrays, one array of LOCKSTEP_LANES lanes
+ * per register, so register instructions (add, sub, mul, inc, dec, movr,
+ * swap) execute for all lanes by loops the compiler turns into vector
+ * instructions (AVX2 when the processor has it, SSE2 otherwise on x86-64).
+ * div, stack and I/O instructions are executed lane by lane, each lane
+ * with its own stack and I/O.
+ *
+ * When `loop` is taken by some lanes and not by others, the lanes which
+ * took the other path form a new group, which runs after the current one.
+ * A lane which stops (error) leaves the group, a group with only a few
+ * lanes left is finished by cpu_run(), one cpu after another. Statuses,
+ * registers, stacks, outputs and counts of executed instructions are the
+ * same as if each cpu was run by cpu_run().
+ */
+
+#include <stddef.h>
+
+#include "cpu.h"
+#include "batch.h"
+
+/* count of cpus run in lockstep by lockstep_run() at most */
+#define LOCKSTEP_LANES 64
+
+/**
+ * @brief Runs every cpu for at most `steps` instructions, cpus running
+ * the same program (clones of one cpu, see cpu_clone()) in lockstep.
+ *
+ * @param cpus     array of cpus, at most LOCKSTEP_LANES of them
+ * @param count    count of cpus
+ * @param steps    count of instructions each cpu runs at most
+ * @param executed out parameter, array where the result of each cpu
+ *                 is stored, the same as cpu_run() would return
+ */
+void lockstep_run(struct cpu **cpus, size_t count, size_t steps,
+                  long long *executed);
+
+/**
+ * @brief Runs every job to its end like batch_run(), on the calling thread,
+ * LOCKSTEP_LANES jobs running the same program at a time in lockstep.
+ *
+ * @param jobs  array of jobs, results are stored there
+ * @param count count of jobs
+ */
+void lockstep_batch(struct batch_job *jobs, size_t count);
+
+#endif  // LOCKSTEP_H
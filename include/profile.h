@@ -0,0 +1,50 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+/**
+ * @file profile.h
+ * @brief Execution profile of a program, used by `profile` mode.
+ *
+ * The program is run by profile_run(), an interpreter loop of its own
+ * which counts executed instructions per opcode and per instruction index,
+ * jumps to each `loop` target, taken and not taken `loop` branches and the
+ * highest stack size. Other engines contain no counting code at all.
+ */
+
+#include <stdio.h>
+
+#include "cpu.h"
+
+/* count of rows printed in each table of profile_report() */
+#define PROFILE_TOP 20
+
+struct profile;
+
+/**
+ * @brief Allocates an empty profile for the program of the cpu.
+ *
+ * @return pointer to the profile, NULL in case of error
+ */
+struct profile *profile_create(const struct cpu *cpu);
+
+/**
+ * @brief Executes `steps` instructions (one by one, without fused ops) and
+ * adds them to the profile.
+ *
+ * @return same as cpu_run()
+ */
+long long profile_run(struct profile *profile, struct cpu *cpu, size_t steps);
+
+/**
+ * @brief Prints tables sorted by count (the most frequent first).
+ */
+void profile_report(const struct profile *profile, FILE *out);
+
+/**
+ * @brief Prints the whole profile as a JSON object.
+ */
+void profile_json(const struct profile *profile, FILE *out);
+
+void profile_destroy(struct profile *profile);
+
+#endif  // PROFILE_H
@@ -0,0 +1,140 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+/**
+ * @file replay.h
+ * @brief Deterministic record and replay of the input of a program, written
+ * by `record` mode and read by `replay` mode.
+ *
+ * The program is deterministic except for its input, so a log of everything
+ * `in` and `get` read is enough to execute it again exactly. The log starts
+ * with REPLAY_MAGIC and REPLAY_VERSION, then every read adds one event:
+ *
+ *   REPLAY_BYTE        `get` read a byte, the byte follows
+ *   REPLAY_NUMBER      `in` read a number, a zigzag LEB128 varint follows
+ *   REPLAY_NOT_NUMBER  `in` found no number (CPU_IO_ERROR)
+ *   REPLAY_EOF         the input ended
+ *   REPLAY_WAIT        the input was not there yet (CPU_IO_WAIT)
+ *
+ * The output is not logged, the replayed program writes it again. The log
+ * is written out whenever the cpu flushes its output, so it survives
+ * a killed process up to the last stop.
+ *
+ * A replay maps the log into memory and feeds the reads from it. As it runs
+ * forward, it takes a checkpoint (cpu_snapshot() and the position in the log)
+ * every `interval` executed instructions, counted as cpu_run() counts them.
+ * replay_seek() restores the nearest checkpoint in front of the wanted step
+ * and executes only the rest again. The output of an instruction is written
+ * only the first time it is executed, executing it again is muted.
+ *
+ * The checkpoints take at most `budget` bytes (cpu_snapshot_size()). When
+ * they would take more, the interval is doubled and every checkpoint which
+ * is not at its multiple is released, so a long run keeps a bounded count
+ * of checkpoints spread evenly over it, at the cost of executing more
+ * instructions again per seek.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+#define REPLAY_MAGIC "cpu32rp"
+#define REPLAY_VERSION 1
+
+enum replay_event {
+    REPLAY_BYTE,
+    REPLAY_NUMBER,
+    REPLAY_NOT_NUMBER,
+    REPLAY_EOF,
+    REPLAY_WAIT
+};
+
+/* instructions between checkpoints of a replay, unless another is given */
+#define REPLAY_INTERVAL (1024 * 1024)
+
+/* bytes of memory for checkpoints, unless another budget is given */
+#define REPLAY_BUDGET (256 * 1024 * 1024)
+
+/* size of the write buffer of the recorder */
+#define REPLAY_BUFFER_SIZE (64 * 1024)
+
+struct replay_recorder;
+struct replay;
+
+/**
+ * @brief Starts recording the input of the cpu to `fd` and writes
+ * the header. The recorder is put between the cpu and its I/O backend until
+ * replay_record_close().
+ *
+ * @return pointer to the recorder, NULL in case of error
+ */
+struct replay_recorder *replay_record(struct cpu *cpu, int fd);
+
+/**
+ * @brief Writes out the rest of the log, gives the cpu its I/O backend back
+ * and releases the recorder.
+ *
+ * @return 0 on success, -1 if writing the log failed
+ */
+int replay_record_close(struct replay_recorder *recorder, struct cpu *cpu);
+
+/**
+ * @brief Starts a replay of the log in `fd` (a regular file, it may be closed
+ * afterwards). The cpu has to be in its initial state, the replay is put
+ * between the cpu and its I/O backend, which gets only the output.
+ *
+ * @param cpu      cpu running the recorded program
+ * @param fd       file descriptor of the log
+ * @param interval count of instructions between checkpoints, 0 for
+ *                 REPLAY_INTERVAL
+ * @param budget   bytes of memory for checkpoints, 0 for REPLAY_BUDGET
+ *
+ * @return pointer to the replay, NULL if the file is not a log or in case
+ * of error
+ */
+struct replay *replay_open(struct cpu *cpu, int fd, size_t interval,
+                           size_t budget);
+
+/**
+ * @brief Executes `steps` instructions of the replayed cpu by cpu_run(),
+ * checkpoints are taken on the way.
+ *
+ * @return same as cpu_run(), but an instruction under a breakpoint (see
+ * breakpoint.h) is not counted
+ */
+long long replay_run(struct replay *replay, size_t steps);
+
+/**
+ * @brief Brings the cpu to the state after `step` instructions from
+ * the start, forward or backward.
+ *
+ * @return 0 on success, -1 if the program stops before the step (the cpu
+ * is left stopped) or in case of error
+ */
+int replay_seek(struct replay *replay, uint64_t step);
+
+/**
+ * @brief Returns the step of the last checkpoint at `step` or in front
+ * of it, where replay_seek() to `step` starts executing.
+ */
+uint64_t replay_checkpoint(const struct replay *replay, uint64_t step);
+
+/**
+ * @brief Returns the count of instructions executed from the start.
+ */
+uint64_t replay_position(const struct replay *replay);
+
+/**
+ * @brief Returns non-zero if the program read something else than the log
+ * contains (the log belongs to another program), such reads got EOF.
+ */
+int replay_diverged(const struct replay *replay);
+
+/**
+ * @brief Gives the cpu its I/O backend back and releases the replay with its
+ * checkpoints.
+ */
+void replay_close(struct replay *replay);
+
+#endif  // REPLAY_H
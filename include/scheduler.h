@@ -0,0 +1,96 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+/**
+ * @file scheduler.h
+ * @brief Round-robin scheduler running many cpus on one thread.
+ *
+ * Every task gets a slice of at most `budget` instructions in its turn,
+ * then it goes to the end of the queue. A task leaves the queue when its
+ * cpu stops: a halted or failed one is done, one waiting for input
+ * (CPU_WAITING_INPUT, see io_create_queue()) is queued again by
+ * scheduler_wake() once the host pushed the input. Waiting tasks cost
+ * nothing, so a thread can serve tens of thousands of mostly idle cpus
+ * from its event loop:
+ *
+ *   while (scheduler_runnable(&scheduler) > 0) {
+ *       struct scheduler_task *task = scheduler_step(&scheduler);
+ *       if (task != NULL)
+ *           ...  // waiting for input or done, see cpu_get_status()
+ *   }
+ *
+ * A scheduler and its tasks belong to one thread, more threads use one
+ * scheduler each.
+ */
+
+#include <stddef.h>
+
+#include "cpu.h"
+
+typedef long long (*scheduler_engine)(struct cpu *cpu, size_t steps);
+
+struct scheduler_task {
+    struct cpu *cpu;
+    /* count of instructions the task runs in one turn, at least 1 */
+    size_t budget;
+    /*
+     * count of instructions executed by all turns of the task, an `in`
+     * or `get` which waited for input is counted once, when it read
+     */
+    long long executed;
+
+    /* next task in the queue, used by the scheduler */
+    struct scheduler_task *next;
+    /* non-zero while the task is in the queue */
+    int queued;
+};
+
+struct scheduler {
+    scheduler_engine engine;
+    struct scheduler_task *head;
+    struct scheduler_task *tail;
+    size_t runnable;
+};
+
+/**
+ * @brief Initializes an empty scheduler running the tasks with the given
+ * engine (e.g. cpu_run()).
+ */
+void scheduler_init(struct scheduler *scheduler, scheduler_engine engine);
+
+/**
+ * @brief Adds the task to the end of the queue if its cpu can run
+ * (CPU_OK), `executed` is set to 0.
+ */
+void scheduler_add(struct scheduler *scheduler, struct scheduler_task *task);
+
+/**
+ * @brief Lets the task run again after it stopped waiting for input
+ * (see cpu_resume()), nothing happens if the task is queued already
+ * or its cpu is stopped for another reason.
+ */
+void scheduler_wake(struct scheduler *scheduler, struct scheduler_task *task);
+
+/**
+ * @brief Removes the task from the queue, e.g. when it is cancelled.
+ *
+ * Takes time proportional to the count of queued tasks.
+ */
+void scheduler_remove(struct scheduler *scheduler,
+                      struct scheduler_task *task);
+
+/**
+ * @brief Returns the count of queued tasks.
+ */
+size_t scheduler_runnable(const struct scheduler *scheduler);
+
+/**
+ * @brief Runs one slice of the first task of the queue.
+ *
+ * @return the task if it left the queue because its cpu stopped (waiting
+ * for input, halted or failed), NULL if it was queued again or the queue
+ * is empty
+ */
+struct scheduler_task *scheduler_step(struct scheduler *scheduler);
+
+#endif  // SCHEDULER_H
@@ -0,0 +1,40 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/**
+ * @file snapshot.h
+ * @brief Copy-on-write blocks of the stack used by cpu_snapshot().
+ *
+ * The stack is split into 4 KiB blocks aligned as in the memory created
+ * by cpu_create_memory(), the first one starts at cpu->stack_pages. Every
+ * instruction writing to the stack marks the written block in
+ * cpu->stack_dirty. Captured blocks are immutable and reference counted,
+ * a snapshot shares the blocks not marked since the previous one
+ * (cpu->snapshot_pages), a restore copies only blocks which are marked
+ * or differ between the snapshots.
+ */
+
+#include <stddef.h>
+
+#include "cpu.h"
+
+/**
+ * @brief Returns the count of 4 KiB blocks covering the stack of the cpu.
+ */
+size_t snapshot_page_count(const struct cpu *cpu);
+
+/**
+ * @brief Marks the block containing the stack cell as written to.
+ */
+static inline void snapshot_mark(struct cpu *cpu, const int32_t *cell)
+{
+    cpu->stack_dirty[(cell - cpu->stack_pages) / CPU_PAGE_CELLS] = 1;
+}
+
+/**
+ * @brief Releases the blocks of the snapshot last taken or restored,
+ * used by cpu_destroy().
+ */
+void snapshot_release(struct cpu *cpu);
+
+#endif  // SNAPSHOT_H
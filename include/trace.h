@@ -0,0 +1,108 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/**
+ * @file trace.h
+ * @brief Compact binary execution trace, written by `trace-write` mode and
+ * printed as `trace` mode would print it by `trace-dump` mode.
+ *
+ * The trace starts with a header (TRACE_MAGIC, TRACE_VERSION), the program
+ * (program_size and the words in front of the stack roof) and the initial
+ * state (instruction index, registers, stack size, status). Every executed
+ * instruction (the failing one included) adds one record:
+ *
+ *   flags                  one byte, TRACE_* bits below
+ *   instruction index      delta if TRACE_JUMP, otherwise the index moved
+ *                          to the following instruction (as decoded from
+ *                          the program in the header)
+ *   registers              delta of every register with TRACE_REGISTER(r)
+ *   stack size             delta if TRACE_STACK
+ *   status                 new status if TRACE_STATUS
+ *
+ * Output of the program is stored in records of its own, one byte
+ * TRACE_OUTPUT | length (an instruction writes at most 11 bytes) followed
+ * by the bytes, in front of the record of the instruction which wrote them.
+ *
+ * Numbers are stored as LEB128 varints, signed ones zigzag encoded, register
+ * deltas wrap around 32 bits. A truncated trace (e.g. the process was killed)
+ * is read up to its last complete record.
+ */
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "cpu.h"
+
+#define TRACE_MAGIC "cpu32tr"
+#define TRACE_VERSION 1
+
+#define TRACE_REGISTER(reg) (1 << (reg))
+#define TRACE_STACK (1 << 4)
+#define TRACE_STATUS (1 << 5)
+#define TRACE_JUMP (1 << 6)
+#define TRACE_OUTPUT (1 << 7)
+
+/* size of the write buffer of the trace writer */
+#define TRACE_BUFFER_SIZE (64 * 1024)
+
+struct trace_state {
+    int32_t instruction_index;
+    int32_t arithmetic_regs[4];
+    int32_t stack_size;
+    enum cpu_status status;
+};
+
+struct trace_writer;
+struct trace_reader;
+
+/**
+ * @brief Starts a trace of the cpu written to `fd` and writes the header.
+ *
+ * Output of the cpu is recorded too, the writer is put between the cpu and
+ * its I/O backend until trace_close().
+ *
+ * @return pointer to the writer, NULL in case of error
+ */
+struct trace_writer *trace_create(struct cpu *cpu, int fd);
+
+/**
+ * @brief Executes `steps` instructions (one by one, without fused ops) and
+ * adds a record for each of them.
+ *
+ * @return same as cpu_run()
+ */
+long long trace_run(struct trace_writer *writer, struct cpu *cpu,
+                    size_t steps);
+
+/**
+ * @brief Writes out buffered records, gives the cpu its I/O backend back
+ * and releases the writer.
+ *
+ * @return 0 on success, -1 if writing the trace failed
+ */
+int trace_close(struct trace_writer *writer, struct cpu *cpu);
+
+/**
+ * @brief Reads the header of a trace and the initial state.
+ *
+ * @return pointer to the reader, NULL if the file is not a trace
+ * or in case of error
+ */
+struct trace_reader *trace_open(FILE *file, struct trace_state *state);
+
+/**
+ * @brief Reads the next record and applies it to the state.
+ *
+ * @param output out parameter, bytes written by the instruction (valid
+ *               until the next call)
+ * @param length out parameter, count of the bytes
+ *
+ * @return 1 if a record was read, 0 at the end of the trace
+ */
+int trace_next(struct trace_reader *reader, struct trace_state *state,
+               const unsigned char **output, size_t *length);
+
+void trace_reader_destroy(struct trace_reader *reader);
+
+#endif  // TRACE_H
@@ -0,0 +1,63 @@
+#ifndef TRANSLATE_H
+#define TRANSLATE_H
+
+/**
+ * @file translate.h
+ * @brief Load-time optimizing translation of straight-line code.
+ *
+ * The decoded program is lifted into blocks: starting at index 0 and at
+ * every reachable `loop` target and fall-through, instructions are followed
+ * as long as they only compute with registers and can't stop the execution
+ * (nop, movr, add, sub, mul, inc, dec, swap, out, put of a known byte, div
+ * by a known non-zero number), optionally ending with `loop`. Each block
+ * is translated into micro-ops by
+ *
+ *   - constant propagation over registers A-D (operations on known values
+ *     are folded, known operands become immediates),
+ *   - dead-store elimination (values overwritten before being read are not
+ *     computed, known values are stored once at the end of the block),
+ *   - strength reduction (mul by a power of two is a shift, mul by 0 or 1
+ *     and div by 1 or -1 need no multiplication or division).
+ *
+ * The first op of the block gets a handler running the micro-ops, all other
+ * ops stay as they were, so the program keeps its indices: jumps into
+ * the middle of a block, single steps (execute_single()) and the other
+ * engines see the original instructions. The handler returns the count
+ * of instructions of the block and leaves instruction_index where the last
+ * one would, so step counts and statuses of cpu_run() stay exact. Blocks
+ * are used only where they cover more instructions than cpu_fuse() did
+ * and save dispatches, or where they loop to themselves.
+ *
+ * A block ending with `loop` to its own start and without I/O iterates
+ * in its handler as long as C is not zero and whole iterations fit into
+ * cpu->budget, the count of instructions the engine allows (the handler
+ * returns the count of all of them). If every micro-op is affine (no mul
+ * of two registers, no div) and C changes by exactly 1 per iteration, the
+ * count of iterations left is known and they are skipped at once:
+ * the iteration is a map new = M * old + v of registers modulo 2^32, which is
+ * raised to the power of the count by repeated squaring.
+ */
+
+#include "cpu.h"
+
+struct decoded_op;
+struct translation;
+
+/**
+ * @brief Translates blocks of the decoded program, the handlers of the first
+ * ops of the blocks are replaced.
+ *
+ * @param program decoded program created by cpu_decode() (and cpu_fuse())
+ * @param size    count of ops in the program
+ *
+ * @return translated blocks, which have to be set to cpu->translation of every
+ * cpu running the program, NULL in case of error (the program is unchanged)
+ */
+struct translation *cpu_translate(struct decoded_op *program, int32_t size);
+
+/**
+ * @brief Releases the translated blocks.
+ */
+void translation_destroy(struct translation *translation);
+
+#endif  // TRANSLATE_H
@@ -0,0 +1,510 @@
+#include "../include/asm.h"
+#include "../include/cpu.h"
+#include "../include/decode.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+/*
+ * operands of each instruction: r register, n number, i index (a number
+ * or a label)
+ */
+static const char *const signatures[19] = {
+    "", "", "r", "r", "r", "r", "r", "r", "i", "rn",
+    "rn", "rn", "r", "r", "r", "r", "rr", "r", "r"
+};
+
+/* labels, a mnemonic and operands (or words of .word) on one line */
+#define ASM_MAX_TOKENS 32
+
+static const char register_names[4] = { 'A', 'B', 'C', 'D' };
+
+struct token {
+    const char *text;
+    size_t length;
+};
+
+struct label {
+    struct token name;
+    size_t index;
+};
+
+/* word waiting for the index of a label */
+struct fixup {
+    struct token name;
+    size_t index;
+    size_t line;
+};
+
+struct assembler {
+    int32_t *words;
+    size_t length;
+    size_t capacity;
+
+    struct label *labels;
+    size_t label_count;
+    size_t label_capacity;
+
+    struct fixup *fixups;
+    size_t fixup_count;
+    size_t fixup_capacity;
+};
+
+/*
+ * Makes room for one more item of the array, returns the (moved) array
+ * or NULL on failure, the old one is kept then.
+ */
+static void *reserve(void *items, size_t count, size_t *capacity, size_t size)
+{
+    if (count < *capacity)
+        return items;
+    size_t new_capacity = *capacity == 0 ? 64 : *capacity * 2;
+    void *temp_p = realloc(items, new_capacity * size);
+    if (temp_p != NULL)
+        *capacity = new_capacity;
+    return temp_p;
+}
+
+static bool emit(struct assembler *as, int32_t word)
+{
+    int32_t *words = reserve(as->words, as->length, &as->capacity,
+                             sizeof(int32_t));
+    if (words == NULL)
+        return false;
+    as->words = words;
+    as->words[as->length++] = word;
+    return true;
+}
+
+static bool token_equals(struct token token, const char *text)
+{
+    return strlen(text) == token.length &&
+           memcmp(token.text, text, token.length) == 0;
+}
+
+static bool names_equal(struct token first, struct token second)
+{
+    return first.length == second.length &&
+           memcmp(first.text, second.text, first.length) == 0;
+}
+
+static bool is_label_char(char c, bool first)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' ||
+           c == '.' || (!first && c >= '0' && c <= '9');
+}
+
+static bool is_label_name(struct token token)
+{
+    if (token.length == 0 || !is_label_char(token.text[0], true))
+        return false;
+    for (size_t i = 1; i < token.length; ++i) {
+        if (!is_label_char(token.text[i], false))
+            return false;
+    }
+    return true;
+}
+
+static const struct label *find_label(const struct assembler *as,
+                                      struct token name)
+{
+    for (size_t i = 0; i < as->label_count; ++i) {
+        if (names_equal(as->labels[i].name, name))
+            return &as->labels[i];
+    }
+    return NULL;
+}
+
+/* splits the line into tokens, returns their count or -1 if there are more */
+static int tokenize(const char *line, size_t length, struct token *tokens,
+                    int max)
+{
+    int count = 0;
+    size_t i = 0;
+    while (i < length) {
+        char c = line[i];
+        if (c == ';' || c == '#')
+            break;
+        if (c == ' ' || c == '\t' || c == '\r' || c == ',') {
+            ++i;
+            continue;
+        }
+        if (count == max)
+            return -1;
+
+        size_t start = i;
+        while (i < length && line[i] != ' ' && line[i] != '\t' &&
+               line[i] != '\r' && line[i] != ',' && line[i] != ';' &&
+               line[i] != '#')
+            ++i;
+        tokens[count].text = line + start;
+        tokens[count].length = i - start;
+        ++count;
+    }
+    return count;
+}
+
+/*
+ * Parses a decimal number in range of int32_t or a hexadecimal one
+ * of at most 32 bits.
+ */
+static bool parse_number(struct token token, int32_t *number)
+{
+    const char *text = token.text;
+    size_t length = token.length;
+    bool negative = false;
+    if (length > 0 && (text[0] == '-' || text[0] == '+')) {
+        negative = text[0] == '-';
+        ++text;
+        --length;
+    }
+
+    unsigned base = 10;
+    if (length > 2 && text[0] == '0' && (text[1] == 'x' || text[1] == 'X')) {
+        base = 16;
+        text += 2;
+        length -= 2;
+    }
+    if (length == 0)
+        return false;
+
+    uint64_t value = 0;
+    for (size_t i = 0; i < length; ++i) {
+        char c = text[i];
+        unsigned digit;
+        if (c >= '0' && c <= '9')
+            digit = c - '0';
+        else if (base == 16 && c >= 'a' && c <= 'f')
+            digit = c - 'a' + 10;
+        else if (base == 16 && c >= 'A' && c <= 'F')
+            digit = c - 'A' + 10;
+        else
+            return false;
+        value = value * base + digit;
+        if (value > UINT32_MAX)
+            return false;
+    }
+
+    if (base == 10 && value > (negative ? 2147483648u : INT32_MAX))
+        return false;
+    uint32_t word = (uint32_t) value;
+    *number = (int32_t) (negative ? 0u - word : word);
+    return true;
+}
+
+static bool parse_register(struct token token, int32_t *reg)
+{
+    if (token.length != 1)
+        return false;
+    for (int32_t i = 0; i < 4; ++i) {
+        if (token.text[0] == register_names[i] ||
+            token.text[0] == register_names[i] - 'A' + 'a') {
+            *reg = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static int32_t find_opcode(struct token mnemonic)
+{
+    for (int32_t i = 0; i < 19; ++i) {
+        if (token_equals(mnemonic, instruction_names[i]))
+            return i;
+    }
+    return -1;
+}
+
+/* assembles one line, returns NULL or the error message */
+static const char *assemble_line(struct assembler *as, const char *line,
+                                 size_t length, size_t line_number)
+{
+    struct token tokens[ASM_MAX_TOKENS];
+    int count = tokenize(line, length, tokens, ASM_MAX_TOKENS);
+    if (count < 0)
+        return "too many tokens";
+
+    int first = 0;
+    for (; first < count; ++first) {
+        struct token name = tokens[first];
+        if (name.length == 0 || name.text[name.length - 1] != ':')
+            break;
+        --name.length;
+        if (!is_label_name(name))
+            return "invalid label name";
+        if (find_label(as, name) != NULL)
+            return "duplicate label";
+        struct label *labels = reserve(as->labels, as->label_count,
+                                       &as->label_capacity,
+                                       sizeof(struct label));
+        if (labels == NULL)
+            return "insufficient memory";
+        as->labels = labels;
+        as->labels[as->label_count].name = name;
+        as->labels[as->label_count].index = as->length;
+        ++as->label_count;
+    }
+    if (first == count)
+        return NULL;
+
+    struct token *operands = &tokens[first + 1];
+    int operand_count = count - first - 1;
+
+    if (token_equals(tokens[first], ".word")) {
+        if (operand_count == 0)
+            return "expected a number";
+        for (int i = 0; i < operand_count; ++i) {
+            int32_t number;
+            if (!parse_number(operands[i], &number))
+                return "invalid number";
+            if (!emit(as, number))
+                return "insufficient memory";
+        }
+        return NULL;
+    }
+
+    int32_t opcode = find_opcode(tokens[first]);
+    if (opcode < 0)
+        return "unknown instruction";
+    const char *signature = signatures[opcode];
+    if (operand_count != (int) strlen(signature))
+        return operand_count < (int) strlen(signature) ? "missing operand"
+                                                       : "too many operands";
+
+    if (!emit(as, opcode))
+        return "insufficient memory";
+    for (int i = 0; i < operand_count; ++i) {
+        int32_t word = 0;
+        switch (signature[i]) {
+        case 'r':
+            if (!parse_register(operands[i], &word))
+                return "expected a register (A, B, C or D)";
+            break;
+        case 'n':
+            if (!parse_number(operands[i], &word))
+                return "invalid number";
+            break;
+        default:
+            if (parse_number(operands[i], &word))
+                break;
+            if (!is_label_name(operands[i]))
+                return "expected an index or a label";
+            struct fixup *fixups = reserve(as->fixups, as->fixup_count,
+                                           &as->fixup_capacity,
+                                           sizeof(struct fixup));
+            if (fixups == NULL)
+                return "insufficient memory";
+            as->fixups = fixups;
+            as->fixups[as->fixup_count].name = operands[i];
+            as->fixups[as->fixup_count].index = as->length;
+            as->fixups[as->fixup_count].line = line_number;
+            ++as->fixup_count;
+            break;
+        }
+        if (!emit(as, word))
+            return "insufficient memory";
+    }
+    return NULL;
+}
+
+/* replaces labels used as operands with their indexes */
+static const char *resolve(struct assembler *as, size_t *line)
+{
+    for (size_t i = 0; i < as->fixup_count; ++i) {
+        const struct fixup *fixup = &as->fixups[i];
+        const struct label *label = find_label(as, fixup->name);
+        if (label == NULL) {
+            *line = fixup->line;
+            return "undefined label";
+        }
+        if (label->index > INT32_MAX) {
+            *line = fixup->line;
+            return "label index out of range";
+        }
+        as->words[fixup->index] = (int32_t) label->index;
+    }
+    return NULL;
+}
+
+int asm_assemble(const char *source, size_t size, struct asm_program *program,
+                 struct asm_error *error)
+{
+    assert(source != NULL || size == 0);
+    assert(program != NULL);
+    assert(error != NULL);
+
+    struct assembler as = { 0 };
+    const char *message = NULL;
+    size_t line_number = 0;
+
+    size_t start = 0;
+    while (start < size && message == NULL) {
+        const char *end = memchr(source + start, '\n', size - start);
+        size_t length = end != NULL ? (size_t) (end - source) - start
+                                    : size - start;
+        ++line_number;
+        message = assemble_line(&as, source + start, length, line_number);
+        start += length + 1;
+    }
+    if (message == NULL)
+        message = resolve(&as, &line_number);
+
+    unsigned char *block_starts = NULL;
+    if (message == NULL) {
+        block_starts = asm_block_starts(as.words, as.length);
+        if (block_starts == NULL) {
+            message = "insufficient memory";
+            line_number = 0;
+        }
+    }
+
+    free(as.labels);
+    free(as.fixups);
+    if (message != NULL) {
+        free(as.words);
+        error->line = line_number;
+        error->message = message;
+        return -1;
+    }
+
+    program->words = as.words;
+    program->length = as.length;
+    program->block_starts = block_starts;
+    return 0;
+}
+
+void asm_program_destroy(struct asm_program *program)
+{
+    if (program == NULL)
+        return;
+    free(program->words);
+    free(program->block_starts);
+    program->words = NULL;
+    program->block_starts = NULL;
+    program->length = 0;
+}
+
+/*
+ * Returns length of the instruction at the index, 0 if the words there are
+ * not a valid instruction (unknown opcode, invalid register or missing
+ * operands).
+ */
+static size_t instruction_at(const int32_t *words, size_t length, size_t index)
+{
+    int32_t opcode = words[index];
+    if (opcode < 0 || opcode > 18)
+        return 0;
+    size_t size = instruction_lengths[opcode];
+    if (size > length - index)
+        return 0;
+
+    const char *signature = signatures[opcode];
+    for (size_t i = 0; signature[i] != '\0'; ++i) {
+        int32_t operand = words[index + 1 + i];
+        if (signature[i] == 'r' &&
+            (operand < REGISTER_A || operand > REGISTER_D))
+            return 0;
+    }
+    return size;
+}
+
+unsigned char *asm_block_starts(const int32_t *words, size_t length)
+{
+    assert(words != NULL || length == 0);
+
+    unsigned char *starts = calloc(length + 1, 1);
+    if (starts == NULL)
+        return NULL;
+    if (length == 0)
+        return starts;
+
+    starts[0] = 1;
+    size_t index = 0;
+    while (index < length) {
+        size_t size = instruction_at(words, length, index);
+        if (size == 0) {
+            ++index;
+            continue;
+        }
+
+        int32_t opcode = words[index];
+        index += size;
+        if (opcode != 8 && opcode != 1)
+            continue;
+        if (index < length)
+            starts[index] = 1;
+        if (opcode == 8) {
+            /* negative index is converted to a big unsigned number */
+            uint32_t target = (uint32_t) words[index - 1];
+            if (target < length)
+                starts[target] = 1;
+        }
+    }
+    return starts;
+}
+
+int asm_disassemble(const int32_t *words, size_t length, FILE *out)
+{
+    assert(words != NULL || length == 0);
+    assert(out != NULL);
+
+    unsigned char *starts = asm_block_starts(words, length);
+    /* labels are put only on the words an instruction is printed at */
+    unsigned char *printed = calloc(length + 1, 1);
+    unsigned char *targets = calloc(length + 1, 1);
+    if (starts == NULL || printed == NULL || targets == NULL) {
+        free(starts);
+        free(printed);
+        free(targets);
+        return -1;
+    }
+
+    for (size_t index = 0; index < length;) {
+        size_t size = instruction_at(words, length, index);
+        printed[index] = 1;
+        if (size == 0) {
+            ++index;
+            continue;
+        }
+        if (words[index] == 8 && (uint32_t) words[index + 1] < length)
+            targets[words[index + 1]] = 1;
+        index += size;
+    }
+
+    for (size_t index = 0; index < length;) {
+        if (index > 0 && starts[index])
+            fputc('\n', out);
+        if (printed[index] && targets[index])
+            fprintf(out, "L%zu:\n", index);
+
+        size_t size = instruction_at(words, length, index);
+        if (size == 0) {
+            fprintf(out, ".word %" PRId32 "\n", words[index]);
+            ++index;
+            continue;
+        }
+
+        int32_t opcode = words[index];
+        const char *signature = signatures[opcode];
+        fputs(instruction_names[opcode], out);
+        for (size_t i = 0; signature[i] != '\0'; ++i) {
+            int32_t operand = words[index + 1 + i];
+            if (signature[i] == 'r')
+                fprintf(out, " %c", register_names[operand]);
+            else if (signature[i] == 'i' && (uint32_t) operand < length &&
+                     printed[operand])
+                fprintf(out, " L%" PRId32, operand);
+            else
+                fprintf(out, " %" PRId32, operand);
+        }
+        fputc('\n', out);
+        index += size;
+    }
+
+    free(starts);
+    free(printed);
+    free(targets);
+    return ferror(out) ? -1 : 0;
+}
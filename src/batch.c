@@ -0,0 +1,344 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/batch.h"
+#include "../include/io.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* count of instructions a job runs before it goes back to the deque */
+#define BATCH_QUANTUM (256 * 1024)
+
+/* job in a deque, the cpu and I/O are created when it runs first */
+struct slice {
+    struct batch_job *job;
+    struct cpu *cpu;
+    struct cpu_io *io;
+    long long executed;
+
+    /* neighbours in the deque */
+    struct slice *previous;
+    struct slice *next;
+};
+
+/* slices of a worker, the owner takes the head, thieves the tail */
+struct deque {
+    pthread_mutex_t lock;
+    struct slice *head;
+    struct slice *tail;
+};
+
+struct batch {
+    struct deque *deques;
+    size_t workers;
+    batch_engine engine;
+
+    pthread_mutex_t lock;
+    /* signalled when a slice is queued or the last job finished */
+    pthread_cond_t changed;
+    /* count of jobs not finished yet */
+    size_t remaining;
+    /* incremented with every queued slice, idle workers wait for a change */
+    size_t generation;
+};
+
+struct worker {
+    struct batch *batch;
+    size_t index;
+    /* cpu and I/O of the last finished job, reused by the next one */
+    struct slice spare;
+    struct batch_worker_stats stats;
+};
+
+static uint64_t now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000u + time.tv_nsec;
+}
+
+/* appends the slice to the tail */
+static void push(struct deque *deque, struct slice *slice)
+{
+    pthread_mutex_lock(&deque->lock);
+    slice->previous = deque->tail;
+    slice->next = NULL;
+    if (deque->tail != NULL)
+        deque->tail->next = slice;
+    else
+        deque->head = slice;
+    deque->tail = slice;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+static struct slice *take(struct deque *deque, bool from_head)
+{
+    pthread_mutex_lock(&deque->lock);
+    struct slice *slice = from_head ? deque->head : deque->tail;
+    if (slice != NULL) {
+        if (slice->previous != NULL)
+            slice->previous->next = slice->next;
+        else
+            deque->head = slice->next;
+        if (slice->next != NULL)
+            slice->next->previous = slice->previous;
+        else
+            deque->tail = slice->previous;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return slice;
+}
+
+static bool is_empty(struct deque *deque)
+{
+    pthread_mutex_lock(&deque->lock);
+    bool empty = deque->head == NULL;
+    pthread_mutex_unlock(&deque->lock);
+    return empty;
+}
+
+static void release(struct slice *slice)
+{
+    if (slice->cpu != NULL) {
+        cpu_destroy(slice->cpu);
+        free(slice->cpu);
+    }
+    if (slice->io != NULL)
+        io_destroy_buffered(slice->io);
+    slice->cpu = NULL;
+    slice->io = NULL;
+}
+
+/* gives the slice its cpu and I/O, returns false in case of error */
+static bool start(struct worker *worker, struct slice *slice)
+{
+    struct batch_job *job = slice->job;
+    struct slice *spare = &worker->spare;
+
+    /* the clone of the last job is cheaper to reset than a new one */
+    if (spare->cpu != NULL && spare->job->program == job->program) {
+        io_rebind_buffered(spare->io, job->input_fd, job->output_fd);
+        cpu_restart(spare->cpu, spare->io);
+        slice->cpu = spare->cpu;
+        slice->io = spare->io;
+        spare->cpu = NULL;
+        spare->io = NULL;
+        return true;
+    }
+    release(spare);
+
+    slice->cpu = cpu_clone(job->program);
+    slice->io = io_create_buffered(job->input_fd, job->output_fd);
+    if (slice->cpu == NULL || slice->io == NULL) {
+        release(slice);
+        return false;
+    }
+    cpu_set_io(slice->cpu, slice->io);
+    return true;
+}
+
+static void finish(struct worker *worker, struct slice *slice, bool started)
+{
+    struct batch_job *job = slice->job;
+
+    if (started) {
+        /* the output has to be written before the job is reported as done */
+        slice->io->flush(slice->io);
+        job->status = cpu_get_status(slice->cpu);
+        job->executed = slice->executed;
+
+        release(&worker->spare);
+        worker->spare = *slice;
+        slice->cpu = NULL;
+        slice->io = NULL;
+    }
+    ++worker->stats.jobs;
+
+    struct batch *batch = worker->batch;
+    pthread_mutex_lock(&batch->lock);
+    if (--batch->remaining == 0)
+        pthread_cond_broadcast(&batch->changed);
+    pthread_mutex_unlock(&batch->lock);
+}
+
+/* runs quanta of the slice while no other slice waits for the worker */
+static void run_slice(struct worker *worker, struct slice *slice)
+{
+    struct batch *batch = worker->batch;
+    struct deque *own = &batch->deques[worker->index];
+
+    if (slice->cpu == NULL && !start(worker, slice)) {
+        finish(worker, slice, false);
+        return;
+    }
+
+    for (;;) {
+        uint64_t begin = now();
+        long long executed = batch->engine(slice->cpu, BATCH_QUANTUM);
+        worker->stats.busy_ns += now() - begin;
+        ++worker->stats.slices;
+
+        executed = executed < 0 ? -executed : executed;
+        slice->executed += executed;
+        worker->stats.instructions += executed;
+
+        if (cpu_get_status(slice->cpu) != CPU_OK) {
+            finish(worker, slice, true);
+            return;
+        }
+        /* alone, the slice would only move to another worker, keep it */
+        if (is_empty(own))
+            continue;
+
+        push(own, slice);
+        pthread_mutex_lock(&batch->lock);
+        ++batch->generation;
+        pthread_cond_broadcast(&batch->changed);
+        pthread_mutex_unlock(&batch->lock);
+        return;
+    }
+}
+
+/* returns the next slice to run, NULL when all jobs are finished */
+static struct slice *next_slice(struct worker *worker)
+{
+    struct batch *batch = worker->batch;
+
+    for (;;) {
+        pthread_mutex_lock(&batch->lock);
+        size_t generation = batch->generation;
+        size_t remaining = batch->remaining;
+        pthread_mutex_unlock(&batch->lock);
+        if (remaining == 0)
+            return NULL;
+
+        struct slice *slice = take(&batch->deques[worker->index], true);
+        if (slice != NULL)
+            return slice;
+        for (size_t i = 1; i < batch->workers; ++i) {
+            size_t victim = (worker->index + i) % batch->workers;
+            slice = take(&batch->deques[victim], false);
+            if (slice != NULL) {
+                ++worker->stats.steals;
+                return slice;
+            }
+        }
+
+        /* running slices can still be queued, wait for it */
+        uint64_t begin = now();
+        pthread_mutex_lock(&batch->lock);
+        while (batch->remaining > 0 && batch->generation == generation)
+            pthread_cond_wait(&batch->changed, &batch->lock);
+        pthread_mutex_unlock(&batch->lock);
+        worker->stats.idle_ns += now() - begin;
+    }
+}
+
+static void *worker_main(void *argument)
+{
+    struct worker *worker = argument;
+
+    uint64_t begin = now();
+    struct slice *slice;
+    while ((slice = next_slice(worker)) != NULL)
+        run_slice(worker, slice);
+    release(&worker->spare);
+    worker->stats.total_ns = now() - begin;
+    return NULL;
+}
+
+size_t batch_default_threads(void)
+{
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (size_t) count : 1;
+}
+
+static void run_workers(struct worker *workers, size_t threads)
+{
+    /*
+     * the calling thread is one of the workers, so all jobs are done even
+     * if no other thread could be started (the rest of the workers is run
+     * one after another then, their slices are stolen by the first one)
+     */
+    pthread_t *handles = malloc((threads - 1) * sizeof(pthread_t) + 1);
+    size_t started = 0;
+    while (handles != NULL && started < threads - 1 &&
+           pthread_create(&handles[started], NULL, &worker_main,
+                          &workers[started + 1]) == 0)
+        ++started;
+
+    worker_main(&workers[0]);
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(handles[i], NULL);
+    free(handles);
+
+    for (size_t i = started + 1; i < threads; ++i)
+        worker_main(&workers[i]);
+}
+
+size_t batch_run(struct batch_job *jobs, size_t count, size_t threads,
+                 batch_engine engine, struct batch_worker_stats *stats)
+{
+    assert(jobs != NULL || count == 0);
+    assert(engine != NULL);
+
+    if (threads == 0)
+        threads = batch_default_threads();
+    if (threads > count)
+        threads = count;
+    if (threads == 0)
+        return 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        jobs[i].executed = -1;
+        jobs[i].status = CPU_OK;
+    }
+
+    struct batch batch = {
+        .workers = threads,
+        .engine = engine,
+        .remaining = count,
+        .generation = 0
+    };
+    struct slice *slices = calloc(count, sizeof(struct slice));
+    batch.deques = calloc(threads, sizeof(struct deque));
+    struct worker *workers = calloc(threads, sizeof(struct worker));
+    if (slices == NULL || batch.deques == NULL || workers == NULL) {
+        /* every job stays marked as not started */
+        free(slices);
+        free(batch.deques);
+        free(workers);
+        return 0;
+    }
+    pthread_mutex_init(&batch.lock, NULL);
+    pthread_cond_init(&batch.changed, NULL);
+
+    for (size_t i = 0; i < threads; ++i) {
+        pthread_mutex_init(&batch.deques[i].lock, NULL);
+        workers[i].batch = &batch;
+        workers[i].index = i;
+    }
+    /* jobs are dealt out in their order, stealing evens out the rest */
+    for (size_t i = 0; i < count; ++i) {
+        slices[i].job = &jobs[i];
+        push(&batch.deques[i % threads], &slices[i]);
+    }
+
+    run_workers(workers, threads);
+
+    for (size_t i = 0; i < threads; ++i) {
+        if (stats != NULL)
+            stats[i] = workers[i].stats;
+        pthread_mutex_destroy(&batch.deques[i].lock);
+    }
+    pthread_cond_destroy(&batch.changed);
+    pthread_mutex_destroy(&batch.lock);
+    free(workers);
+    free(batch.deques);
+    free(slices);
+    return threads;
+}
@@ -0,0 +1,221 @@
+#include "../include/breakpoint.h"
+#include "../include/decode.h"
+#include "../include/instructions.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct patch {
+    int32_t index;
+    /* the op as it was decoded, fused or translated */
+    struct decoded_op original;
+};
+
+struct breakpoints {
+    struct cpu *cpu;
+    bool enabled;
+
+    /* sorted instruction indices */
+    int32_t *indices;
+    size_t count;
+    size_t capacity;
+
+    /* ops changed while the breakpoints are enabled, sorted by index */
+    struct patch *patches;
+    size_t patch_count;
+};
+
+static int exec_breakpoint(struct cpu *cpu, const struct decoded_op *op)
+{
+    (void) op;
+    cpu->status = CPU_BREAKPOINT;
+    return 0;
+}
+
+/* returns the position of the index in breakpoints->indices or behind it */
+static size_t search(const struct breakpoints *breakpoints, int32_t index)
+{
+    size_t low = 0;
+    size_t high = breakpoints->count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (breakpoints->indices[middle] < index)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+bool breakpoint_at(const struct breakpoints *breakpoints, int32_t index)
+{
+    assert(breakpoints != NULL);
+
+    size_t position = search(breakpoints, index);
+    return position < breakpoints->count &&
+           breakpoints->indices[position] == index;
+}
+
+static void apply(struct breakpoints *breakpoints, bool enabled)
+{
+    struct decoded_op *program = breakpoints->cpu->program;
+    for (size_t i = 0; i < breakpoints->patch_count; ++i) {
+        const struct patch *patch = breakpoints->patches + i;
+        struct decoded_op *op = program + patch->index;
+        *op = patch->original;
+        if (!enabled)
+            continue;
+
+        if (breakpoint_at(breakpoints, patch->index))
+            op->execute = &exec_breakpoint;
+        else
+            op->execute = decoded_instructions[op->opcode];
+        op->length = 1;
+    }
+    breakpoints->enabled = enabled;
+    ++breakpoints->cpu->program_changes;
+}
+
+/*
+ * returns true if the sequence of a fused or translated op has
+ * a breakpoint
+ */
+static bool covers_breakpoint(const struct breakpoints *breakpoints,
+                              const struct decoded_op *program, int32_t size,
+                              int32_t index)
+{
+    int32_t next = index;
+    for (int32_t i = 1; i < program[index].length; ++i) {
+        next = program[next].next;
+        if ((uint32_t) next >= (uint32_t) size)
+            return false;
+        if (breakpoint_at(breakpoints, next))
+            return true;
+    }
+    return false;
+}
+
+/* collects the ops which have to be changed for the current breakpoints */
+static int collect(struct breakpoints *breakpoints)
+{
+    bool enabled = breakpoints->enabled;
+    if (enabled)
+        apply(breakpoints, false);
+
+    const struct decoded_op *program = breakpoints->cpu->program;
+    int32_t size = breakpoints->cpu->program_size;
+    size_t count = 0;
+    struct patch *patches = NULL;
+    size_t capacity = 0;
+    for (int32_t i = 0; i < size; ++i) {
+        if (!breakpoint_at(breakpoints, i) &&
+            (program[i].length <= 1 ||
+             !covers_breakpoint(breakpoints, program, size, i)))
+            continue;
+
+        if (count == capacity) {
+            capacity = capacity > 0 ? 2 * capacity : 16;
+            struct patch *grown = realloc(patches,
+                                          capacity * sizeof(struct patch));
+            if (grown == NULL) {
+                free(patches);
+                if (enabled)
+                    apply(breakpoints, true);
+                return -1;
+            }
+            patches = grown;
+        }
+        patches[count].index = i;
+        patches[count].original = program[i];
+        ++count;
+    }
+
+    free(breakpoints->patches);
+    breakpoints->patches = patches;
+    breakpoints->patch_count = count;
+    if (enabled)
+        apply(breakpoints, true);
+    return 0;
+}
+
+struct breakpoints *breakpoints_create(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    struct breakpoints *breakpoints = calloc(1, sizeof(struct breakpoints));
+    if (breakpoints == NULL)
+        return NULL;
+    breakpoints->cpu = cpu;
+    return breakpoints;
+}
+
+int breakpoint_insert(struct breakpoints *breakpoints, int32_t index)
+{
+    assert(breakpoints != NULL);
+
+    if (index < 0 || index >= breakpoints->cpu->program_size)
+        return -1;
+    size_t position = search(breakpoints, index);
+    if (position < breakpoints->count &&
+        breakpoints->indices[position] == index)
+        return 0;
+
+    if (breakpoints->count == breakpoints->capacity) {
+        size_t capacity = breakpoints->capacity > 0
+                          ? 2 * breakpoints->capacity : 16;
+        int32_t *indices = realloc(breakpoints->indices,
+                                   capacity * sizeof(int32_t));
+        if (indices == NULL)
+            return -1;
+        breakpoints->indices = indices;
+        breakpoints->capacity = capacity;
+    }
+    memmove(breakpoints->indices + position + 1,
+            breakpoints->indices + position,
+            (breakpoints->count - position) * sizeof(int32_t));
+    breakpoints->indices[position] = index;
+    ++breakpoints->count;
+
+    if (collect(breakpoints) != 0) {
+        breakpoint_remove(breakpoints, index);
+        return -1;
+    }
+    return 0;
+}
+
+int breakpoint_remove(struct breakpoints *breakpoints, int32_t index)
+{
+    assert(breakpoints != NULL);
+
+    size_t position = search(breakpoints, index);
+    if (position == breakpoints->count ||
+        breakpoints->indices[position] != index)
+        return -1;
+
+    --breakpoints->count;
+    memmove(breakpoints->indices + position,
+            breakpoints->indices + position + 1,
+            (breakpoints->count - position) * sizeof(int32_t));
+    /* without memory the previous ops stay patched, which is still correct */
+    collect(breakpoints);
+    return 0;
+}
+
+void breakpoints_enable(struct breakpoints *breakpoints, bool enabled)
+{
+    assert(breakpoints != NULL);
+
+    if (breakpoints->enabled != enabled)
+        apply(breakpoints, enabled);
+}
+
+void breakpoints_destroy(struct breakpoints *breakpoints)
+{
+    if (breakpoints == NULL)
+        return;
+
+    apply(breakpoints, false);
+    free(breakpoints->patches);
+    free(breakpoints->indices);
+    free(breakpoints);
+}
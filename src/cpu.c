@@ -1,72 +1,166 @@
+#define _DEFAULT_SOURCE
+
 #include "../include/cpu.h"
 #include "../include/instructions.h"
+#include "../include/decode.h"
+#include "../include/jit.h"
+#include "../include/guard.h"
+#include "../include/io.h"
+#include "../include/snapshot.h"
+#include "../include/translate.h"
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 const size_t BLOCK_4KB = 4096;
 
-static int32_t *memory_increase(int32_t *memory, size_t size, size_t increase)
+/* ranges of the stack at least this big are released by cpu_reset() */
+#define RELEASE_SIZE (256 * 1024)
+
+static bool is_little_endian(void)
 {
-    int32_t *temp_p = realloc(memory, size + increase);
-    if (temp_p == NULL) {
-        free(memory);
-        return NULL;
-    }
-    memset(temp_p + size / sizeof(int32_t), 0, increase);
-    return temp_p;
+    const uint32_t probe = 1;
+    return *(const unsigned char *) &probe == 1;
 }
 
-int32_t *cpu_create_memory(FILE *program, size_t stack_capacity,
-                           int32_t **stack_bottom)
+/*
+ * Lays out `length` bytes of the program followed by the stack into one
+ * zeroed allocation, the program is not copied if `bytes` is NULL. The
+ * program part takes the smallest count of 4 KiB blocks bigger than
+ * the program, the stack bottom is the last cell of the last block.
+ */
+static int32_t *create_layout(const unsigned char *bytes, size_t length,
+                              size_t stack_capacity, int32_t **stack_bottom)
 {
-    assert(program != NULL);
-    assert(stack_bottom != NULL);
+    /* this checks if program size can be divided by 4 (int32_t size) */
+    if (length % sizeof(int32_t) != 0)
+        return NULL;
+
+    if (stack_capacity > (SIZE_MAX - length) / sizeof(int32_t) - BLOCK_4KB)
+        return NULL;
+    size_t total_length = length + stack_capacity * sizeof(int32_t);
+    total_length = (total_length + BLOCK_4KB - 1) / BLOCK_4KB * BLOCK_4KB;
 
-    size_t size = BLOCK_4KB;
+    size_t size = (length / BLOCK_4KB + 1) * BLOCK_4KB;
+    if (total_length > size)
+        size = total_length;
 
-    /* calloc to set nulls */
+    /* calloc to set nulls (big blocks come zeroed from the kernel) */
     int32_t *memory = calloc(size, 1);
     if (memory == NULL)
         return NULL;
 
-    int32_t c = fgetc(program);
-    size_t cur_size = 0;
-    int32_t number = 0;
-
-    while (c != EOF) {
-        for (size_t i = 0; i < 4; ++i) {
-            cur_size += 1;
-
-            if (cur_size >= size) {
-                memory = memory_increase(memory, size, BLOCK_4KB);
-                if (memory == NULL)
-                    return NULL;
-                size += BLOCK_4KB;
-            }
-            /* this checks if program size can be divided by 4 (int32_t size) */
-            if (c == EOF) {
-                free(memory);
-                return NULL;
-            }
-            number = number | (c << (i * 8));
-            c = fgetc(program);
+    if (bytes == NULL) {
+        /* nothing to copy */
+    } else if (is_little_endian()) {
+        memcpy(memory, bytes, length);
+    } else {
+        for (size_t i = 0; i < length / 4; ++i) {
+            const unsigned char *word = bytes + i * 4;
+            memory[i] = (int32_t) ((uint32_t) word[0] |
+                                   (uint32_t) word[1] << 8 |
+                                   (uint32_t) word[2] << 16 |
+                                   (uint32_t) word[3] << 24);
         }
-        *(memory + (cur_size - 4) / 4) = number;
-        number = 0;
     }
 
-    size_t total_length = cur_size + stack_capacity * 4;
-    size_t stack_blocks_count = (total_length / BLOCK_4KB) - (size / BLOCK_4KB);
-    stack_blocks_count += (total_length % BLOCK_4KB) ? 1 : 0;
+    *stack_bottom = memory + size / 4 - 1;
+    return memory;
+}
 
-    if (stack_blocks_count > 0) {
-        memory = memory_increase(memory, size, stack_blocks_count * BLOCK_4KB);
-        if (memory == NULL)
+/* reads the rest of a stream which can't be mapped (e.g. a pipe) */
+static int32_t *create_from_stream(FILE *program, size_t stack_capacity,
+                                   int32_t **stack_bottom)
+{
+    size_t capacity = BLOCK_4KB;
+    size_t length = 0;
+    unsigned char *bytes = malloc(capacity);
+    if (bytes == NULL)
+        return NULL;
+
+    size_t count;
+    while ((count = fread(bytes + length, 1, capacity - length, program)) > 0) {
+        length += count;
+        if (length < capacity)
+            continue;
+
+        unsigned char *temp_p = realloc(bytes, capacity * 2);
+        if (temp_p == NULL) {
+            free(bytes);
             return NULL;
-        size += stack_blocks_count * BLOCK_4KB;
+        }
+        bytes = temp_p;
+        capacity *= 2;
     }
-    *stack_bottom = memory + size / 4 - 1;
+
+    int32_t *memory = NULL;
+    if (!ferror(program))
+        memory = create_layout(bytes, length, stack_capacity, stack_bottom);
+    free(bytes);
+    return memory;
+}
+
+int32_t *cpu_create_memory_from_bytes(const void *bytes, size_t length,
+                                      size_t stack_capacity,
+                                      int32_t **stack_bottom)
+{
+    assert(bytes != NULL || length == 0);
+    assert(stack_bottom != NULL);
+
+    return create_layout(length > 0 ? bytes : NULL, length, stack_capacity,
+                         stack_bottom);
+}
+
+int32_t *cpu_create_memory_from_words(const int32_t *words, size_t count,
+                                      size_t stack_capacity,
+                                      int32_t **stack_bottom)
+{
+    assert(words != NULL || count == 0);
+    assert(stack_bottom != NULL);
+
+    if (count > SIZE_MAX / sizeof(int32_t))
+        return NULL;
+    /* words are in the host byte order, they are copied after the layout */
+    int32_t *memory = create_layout(NULL, count * sizeof(int32_t),
+                                    stack_capacity, stack_bottom);
+    if (memory != NULL && count > 0)
+        memcpy(memory, words, count * sizeof(int32_t));
+    return memory;
+}
+
+int32_t *cpu_create_memory(FILE *program, size_t stack_capacity,
+                           int32_t **stack_bottom)
+{
+    assert(program != NULL);
+    assert(stack_bottom != NULL);
+
+    struct stat info;
+    off_t offset = ftello(program);
+    if (fstat(fileno(program), &info) != 0 || !S_ISREG(info.st_mode) ||
+        offset < 0 || offset > info.st_size)
+        return create_from_stream(program, stack_capacity, stack_bottom);
+
+    size_t length = info.st_size - offset;
+    if (length == 0)
+        return create_layout(NULL, 0, stack_capacity, stack_bottom);
+
+    /* the mapping starts at 0, mmap offset has to be aligned to pages */
+    void *mapping = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE,
+                         fileno(program), 0);
+    if (mapping == MAP_FAILED)
+        return create_from_stream(program, stack_capacity, stack_bottom);
+
+    int32_t *memory = create_layout((const unsigned char *) mapping + offset,
+                                    length, stack_capacity, stack_bottom);
+    munmap(mapping, info.st_size);
+
+    /* leave the stream at the end, as if it was read */
+    fseeko(program, 0, SEEK_END);
     return memory;
 }
 
@@ -82,15 +176,80 @@ struct cpu *cpu_create(int32_t *memory, int32_t *stack_bottom,
 
     cpu->memory = memory;
     cpu->status = CPU_OK;
+    cpu->io = &cpu_io_stdio;
 
     cpu->has_stack = (stack_capacity > 0) ? 1 : 0;
     cpu->stack_bottom = stack_bottom;
     cpu->stack_top = stack_bottom;
     cpu->stack_roof = stack_bottom - stack_capacity + 1;
 
+    cpu->program_size = cpu->stack_roof - memory;
+    cpu->stack_pages = memory + cpu->program_size / CPU_PAGE_CELLS
+                                * CPU_PAGE_CELLS;
+    cpu->stack_dirty = calloc(snapshot_page_count(cpu) + 1, 1);
+    cpu->program = cpu_decode(memory, cpu->program_size);
+    if (cpu->program == NULL || cpu->stack_dirty == NULL) {
+        free(cpu->program);
+        free(cpu->stack_dirty);
+        free(cpu);
+        return NULL;
+    }
+    cpu_fuse(cpu->program, cpu->program_size);
+    cpu->verified = cpu_verify(cpu->program, cpu->program_size);
+    /* without the translation the program only runs slower */
+    cpu->translation = cpu_translate(cpu->program, cpu->program_size);
+
     return cpu;
 }
 
+struct cpu *cpu_clone(const struct cpu *prototype)
+{
+    assert(prototype != NULL);
+    assert(!prototype->shares_program);
+
+    struct cpu *cpu = calloc(1, sizeof(struct cpu));
+    if (cpu == NULL)
+        return NULL;
+
+    /*
+     * the stack keeps its offset within 4 KiB blocks (see cpu_snapshot()),
+     * one cell is added, so a stack of capacity 0 has a valid roof too
+     */
+    size_t stack_capacity = prototype->stack_bottom - prototype->stack_roof + 1;
+    size_t offset = prototype->stack_roof - prototype->stack_pages;
+    int32_t *stack = calloc(offset + stack_capacity + 1, 4);
+    cpu->stack_dirty = calloc(snapshot_page_count(prototype) + 1, 1);
+    if (stack == NULL || cpu->stack_dirty == NULL) {
+        free(stack);
+        free(cpu->stack_dirty);
+        free(cpu);
+        return NULL;
+    }
+
+    cpu->memory = prototype->memory;
+    cpu->program = prototype->program;
+    cpu->program_size = prototype->program_size;
+    cpu->translation = prototype->translation;
+    cpu->shares_program = 1;
+    cpu->verified = prototype->verified;
+    cpu->status = CPU_OK;
+    cpu->io = &cpu_io_stdio;
+
+    cpu->has_stack = prototype->has_stack;
+    cpu->stack_pages = stack;
+    cpu->stack_roof = stack + offset;
+    cpu->stack_bottom = cpu->stack_roof + stack_capacity - 1;
+    cpu->stack_top = cpu->stack_bottom;
+
+    return cpu;
+}
+
+void cpu_set_io(struct cpu *cpu, struct cpu_io *io)
+{
+    assert(cpu != NULL);
+    cpu->io = io != NULL ? io : &cpu_io_stdio;
+}
+
 int32_t cpu_get_register(struct cpu *cpu, enum cpu_register reg)
 {
     assert(cpu != NULL);
@@ -136,27 +295,149 @@ void cpu_destroy(struct cpu *cpu)
 {
     assert(cpu != NULL);
 
+    cpu->io->flush(cpu->io);
+
     cpu_reset_aux(cpu);
-    free(cpu->memory);
+    snapshot_release(cpu);
+    free(cpu->stack_dirty);
+    cpu->stack_dirty = NULL;
+    /* the guard owns the stack once it was moved between guard pages */
+    if (cpu->shares_program && cpu->guard == NULL)
+        free(cpu->stack_pages);
+    if (!cpu->shares_program) {
+        free(cpu->memory);
+        free(cpu->program);
+        translation_destroy(cpu->translation);
+    }
     cpu->memory = NULL;
+    cpu->program = NULL;
+    cpu->translation = NULL;
+    cpu->shares_program = 0;
+    cpu->verified = 0;
+    cpu->program_size = 0;
+    free(cpu->threaded_code);
+    cpu->threaded_code = NULL;
+    jit_destroy(cpu->jit);
+    cpu->jit = NULL;
+    guard_destroy(cpu->guard);
+    cpu->guard = NULL;
 
     cpu->stack_top = NULL;
     cpu->stack_bottom = NULL;
     cpu->stack_roof = NULL;
+    cpu->stack_pages = NULL;
     cpu->status = 0;
     cpu->has_stack = 0;
 }
 
+/*
+ * Zeroes cells first ... end - 1. Whole pages of big ranges are given back
+ * to the kernel instead, they are mapped again (zeroed) when touched.
+ * The memory is always private and anonymous (malloc, calloc or mmap).
+ */
+static void clear_cells(int32_t *first, int32_t *end)
+{
+    size_t length = (end - first) * sizeof(int32_t);
+    long page = sysconf(_SC_PAGESIZE);
+    if (length < RELEASE_SIZE || page <= 0) {
+        memset(first, 0, length);
+        return;
+    }
+
+    uintptr_t start = ((uintptr_t) first + page - 1) / page * page;
+    uintptr_t stop = (uintptr_t) end / page * page;
+    if (madvise((void *) start, stop - start, MADV_DONTNEED) != 0) {
+        memset(first, 0, length);
+        return;
+    }
+    memset(first, 0, start - (uintptr_t) first);
+    memset((void *) stop, 0, (uintptr_t) end - stop);
+}
+
 void cpu_reset(struct cpu *cpu)
 {
     assert(cpu != NULL);
 
+    /*
+     * cells in front of the stack top are always zero (pop clears them),
+     * so only the filled part is cleared and never touched pages stay so
+     */
+    if (cpu->stack_size > 0) {
+        clear_cells(cpu->stack_top, cpu->stack_bottom + 1);
+        size_t first = (cpu->stack_top - cpu->stack_pages) / CPU_PAGE_CELLS;
+        size_t last = (cpu->stack_bottom - cpu->stack_pages) / CPU_PAGE_CELLS;
+        memset(cpu->stack_dirty + first, 1, last - first + 1);
+    }
+
     cpu_reset_aux(cpu);
     cpu->status = CPU_OK;
-    memset(cpu->stack_roof, 0, (cpu->stack_bottom - cpu->stack_roof) * 4);
     cpu->stack_top = cpu->stack_bottom;
 }
 
+void cpu_resume(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    if (cpu->status == CPU_WAITING_INPUT)
+        cpu->status = CPU_OK;
+}
+
+void cpu_restart(struct cpu *cpu, struct cpu_io *io)
+{
+    assert(cpu != NULL);
+
+    cpu->io->flush(cpu->io);
+    cpu_reset(cpu);
+    cpu_set_io(cpu, io);
+}
+
+int32_t cpu_get_opcode(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    uint32_t index = (uint32_t) cpu->instruction_index;
+    if (index >= (uint32_t) cpu->program_size)
+        return -1;
+    int32_t opcode = cpu->program[index].opcode;
+    return (opcode >= 0 && opcode <= 18) ? opcode : -1;
+}
+
+/*
+ * Executes the op, at most `budget` instructions of it. Fused ops are used
+ * only if the whole sequence fits into the budget, otherwise only the first
+ * instruction is executed. Returns the same as decoded_handler.
+ */
+static inline int execute_op(struct cpu *cpu, const struct decoded_op *op,
+                             size_t budget)
+{
+    if (budget < FUSED_MAX_LENGTH)
+        return execute_single(cpu, op);
+    cpu->budget = budget;
+    return op->execute(cpu, op);
+}
+
+/*
+ * Executes the decoded op at cpu->instruction_index (see execute_op()), cpu
+ * status must be OK.
+ */
+static inline int dispatch(struct cpu *cpu, size_t budget)
+{
+    /* negative index is converted to a big unsigned number */
+    uint32_t index = (uint32_t) cpu->instruction_index;
+    if (index >= (uint32_t) cpu->program_size) {
+        cpu->status = CPU_INVALID_ADDRESS;
+        return 0;
+    }
+    return execute_op(cpu, cpu->program + index, budget);
+}
+
+/* same as dispatch() without the bound check, the program must be verified */
+static inline int dispatch_verified(struct cpu *cpu, size_t budget)
+{
+    return execute_op(cpu, cpu->program + (uint32_t) cpu->instruction_index,
+                      budget);
+}
+
 int cpu_step(struct cpu *cpu)
 {
     assert(cpu != NULL);
@@ -164,17 +445,28 @@ int cpu_step(struct cpu *cpu)
     if (cpu->status != CPU_OK)
         return 0;
 
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    if (instruction_address >= cpu->stack_roof || cpu->instruction_index < 0) {
-        cpu->status = CPU_INVALID_ADDRESS;
+    if (!dispatch(cpu, 1)) {
+        cpu->io->flush(cpu->io);
         return 0;
     }
-    int32_t instruction = *instruction_address;
-    if (instruction < 0 || instruction > 18) {
-        cpu->status = CPU_ILLEGAL_INSTRUCTION;
-        return 0;
+    return 1;
+}
+
+/* cpu_run() of a verified program, the same loop without the bound check */
+static long long run_verified(struct cpu *cpu, size_t steps)
+{
+    size_t executed = 0;
+    while (executed < steps) {
+        int result = dispatch_verified(cpu, steps - executed);
+        if (result <= 0) {
+            cpu->io->flush(cpu->io);
+            executed += 1 - result;
+            return cpu->status == CPU_HALTED ? (long long) executed
+                                             : -(long long) executed;
+        }
+        executed += result;
     }
-    return instructions[instruction](cpu);
+    return steps;
 }
 
 long long cpu_run(struct cpu *cpu, size_t steps)
@@ -183,10 +475,19 @@ long long cpu_run(struct cpu *cpu, size_t steps)
 
     if (cpu->status != CPU_OK)
         return 0;
-
-    for (size_t i = 1; i <= steps; ++i) {
-        if (!cpu_step(cpu))
-            return cpu->status == CPU_HALTED ? i : -i;
+    if (cpu->verified)
+        return run_verified(cpu, steps);
+
+    size_t executed = 0;
+    while (executed < steps) {
+        int result = dispatch(cpu, steps - executed);
+        if (result <= 0) {
+            cpu->io->flush(cpu->io);
+            executed += 1 - result;
+            return cpu->status == CPU_HALTED ? (long long) executed
+                                             : -(long long) executed;
+        }
+        executed += result;
     }
     return steps;
 }
@@ -0,0 +1,348 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/cpu32.h"
+#include "../include/cpu.h"
+#include "../include/io.h"
+#include "../include/scheduler.h"
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+
+/* count of instructions run between checks of the clock */
+#define DEADLINE_CHUNK 4096
+
+struct cpu32_vm {
+    /* must be the first member, struct cpu_io * is cast to cpu32_vm * */
+    struct cpu_io io;
+    struct cpu32_io callbacks;
+    struct cpu *cpu;
+
+    /* queue backend set by cpu32_set_queue_io(), NULL if none */
+    struct cpu_io *queue;
+    /* scheduler the vm was added to, NULL if none */
+    struct cpu32_scheduler *scheduler;
+    struct scheduler_task task;
+};
+
+struct cpu32_scheduler {
+    struct scheduler scheduler;
+};
+
+static int callback_read_number(struct cpu_io *io, int32_t *number)
+{
+    struct cpu32_vm *vm = (struct cpu32_vm *) io;
+    return vm->callbacks.read_number(vm->callbacks.context, number);
+}
+
+static int callback_read_byte(struct cpu_io *io)
+{
+    struct cpu32_vm *vm = (struct cpu32_vm *) io;
+    return vm->callbacks.read_byte(vm->callbacks.context);
+}
+
+static void callback_write_number(struct cpu_io *io, int32_t number)
+{
+    struct cpu32_vm *vm = (struct cpu32_vm *) io;
+    vm->callbacks.write_number(vm->callbacks.context, number);
+}
+
+static void callback_write_byte(struct cpu_io *io, unsigned char byte)
+{
+    struct cpu32_vm *vm = (struct cpu32_vm *) io;
+    vm->callbacks.write_byte(vm->callbacks.context, byte);
+}
+
+static void callback_flush(struct cpu_io *io)
+{
+    struct cpu32_vm *vm = (struct cpu32_vm *) io;
+    if (vm->callbacks.flush != NULL)
+        vm->callbacks.flush(vm->callbacks.context);
+}
+
+/* takes the ownership of the cpu, destroys it in case of error */
+static struct cpu32_vm *wrap(struct cpu *cpu)
+{
+    if (cpu == NULL)
+        return NULL;
+
+    struct cpu32_vm *vm = calloc(1, sizeof(struct cpu32_vm));
+    if (vm == NULL) {
+        cpu_destroy(cpu);
+        free(cpu);
+        return NULL;
+    }
+    vm->io.read_number = &callback_read_number;
+    vm->io.read_byte = &callback_read_byte;
+    vm->io.write_number = &callback_write_number;
+    vm->io.write_byte = &callback_write_byte;
+    vm->io.flush = &callback_flush;
+    vm->cpu = cpu;
+    return vm;
+}
+
+int cpu32_api_version(void)
+{
+    return CPU32_API_VERSION;
+}
+
+uint64_t cpu32_now(void)
+{
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (uint64_t) time.tv_sec * 1000000000u + time.tv_nsec;
+}
+
+struct cpu32_vm *cpu32_create(const void *program, size_t length,
+                              size_t stack_capacity)
+{
+    assert(program != NULL || length == 0);
+
+    int32_t *stack_bottom;
+    int32_t *memory = cpu_create_memory_from_bytes(program, length,
+                                                   stack_capacity,
+                                                   &stack_bottom);
+    if (memory == NULL)
+        return NULL;
+
+    struct cpu *cpu = cpu_create(memory, stack_bottom, stack_capacity);
+    if (cpu == NULL)
+        free(memory);
+    return wrap(cpu);
+}
+
+struct cpu32_vm *cpu32_clone(const struct cpu32_vm *prototype)
+{
+    assert(prototype != NULL);
+
+    return wrap(cpu_clone(prototype->cpu));
+}
+
+void cpu32_destroy(struct cpu32_vm *vm)
+{
+    if (vm == NULL)
+        return;
+
+    if (vm->scheduler != NULL)
+        cpu32_scheduler_remove(vm->scheduler, vm);
+    /* the output is flushed through the vm, it is freed last */
+    cpu_destroy(vm->cpu);
+    free(vm->cpu);
+    io_destroy_queue(vm->queue);
+    free(vm);
+}
+
+/* flushes the current I/O and drops the queues */
+static void drop_io(struct cpu32_vm *vm)
+{
+    vm->cpu->io->flush(vm->cpu->io);
+    if (vm->queue == NULL)
+        return;
+    cpu_set_io(vm->cpu, NULL);
+    io_destroy_queue(vm->queue);
+    vm->queue = NULL;
+}
+
+void cpu32_set_io(struct cpu32_vm *vm, const struct cpu32_io *io)
+{
+    assert(vm != NULL);
+
+    drop_io(vm);
+    if (io == NULL) {
+        cpu_set_io(vm->cpu, NULL);
+        return;
+    }
+    assert(io->read_number != NULL && io->read_byte != NULL);
+    assert(io->write_number != NULL && io->write_byte != NULL);
+
+    vm->callbacks = *io;
+    cpu_set_io(vm->cpu, &vm->io);
+}
+
+int cpu32_set_queue_io(struct cpu32_vm *vm)
+{
+    assert(vm != NULL);
+
+    struct cpu_io *queue = io_create_queue();
+    if (queue == NULL)
+        return -1;
+    drop_io(vm);
+    vm->queue = queue;
+    cpu_set_io(vm->cpu, queue);
+    return 0;
+}
+
+int cpu32_push_input(struct cpu32_vm *vm, const void *bytes, size_t length)
+{
+    assert(vm != NULL);
+
+    if (vm->queue == NULL)
+        return -1;
+    return io_queue_push(vm->queue, bytes, length);
+}
+
+void cpu32_close_input(struct cpu32_vm *vm)
+{
+    assert(vm != NULL);
+
+    if (vm->queue != NULL)
+        io_queue_close(vm->queue);
+}
+
+size_t cpu32_take_output(struct cpu32_vm *vm, void *buffer, size_t size)
+{
+    assert(vm != NULL);
+    assert(buffer != NULL || size == 0);
+
+    if (vm->queue == NULL)
+        return 0;
+    const unsigned char *bytes;
+    size_t length = io_queue_output(vm->queue, &bytes);
+    if (length > size)
+        length = size;
+    memcpy(buffer, bytes, length);
+    io_queue_consume(vm->queue, length);
+    return length;
+}
+
+void cpu32_reset(struct cpu32_vm *vm)
+{
+    assert(vm != NULL);
+
+    cpu_restart(vm->cpu, vm->cpu->io);
+}
+
+void cpu32_resume(struct cpu32_vm *vm)
+{
+    assert(vm != NULL);
+
+    cpu_resume(vm->cpu);
+}
+
+long long cpu32_run(struct cpu32_vm *vm, size_t steps)
+{
+    assert(vm != NULL);
+
+    return cpu_run(vm->cpu, steps);
+}
+
+long long cpu32_run_until(struct cpu32_vm *vm, uint64_t deadline)
+{
+    assert(vm != NULL);
+
+    long long total = 0;
+    while (cpu_get_status(vm->cpu) == CPU_OK) {
+        long long executed = cpu_run(vm->cpu, DEADLINE_CHUNK);
+        if (executed < 0)
+            return -(total - executed);
+        total += executed;
+        if (cpu32_now() >= deadline)
+            break;
+    }
+    return total;
+}
+
+enum cpu32_status cpu32_get_status(const struct cpu32_vm *vm)
+{
+    assert(vm != NULL);
+
+    return (enum cpu32_status) cpu_get_status(vm->cpu);
+}
+
+int32_t cpu32_get_register(const struct cpu32_vm *vm, enum cpu32_register reg)
+{
+    assert(vm != NULL);
+
+    return cpu_get_register(vm->cpu, (enum cpu_register) reg);
+}
+
+void cpu32_set_register(struct cpu32_vm *vm, enum cpu32_register reg,
+                        int32_t value)
+{
+    assert(vm != NULL);
+
+    cpu_set_register(vm->cpu, (enum cpu_register) reg, value);
+}
+
+size_t cpu32_get_stack_size(const struct cpu32_vm *vm)
+{
+    assert(vm != NULL);
+
+    return cpu_get_stack_size(vm->cpu);
+}
+
+struct cpu32_scheduler *cpu32_scheduler_create(void)
+{
+    struct cpu32_scheduler *scheduler = malloc(sizeof(struct cpu32_scheduler));
+    if (scheduler == NULL)
+        return NULL;
+    scheduler_init(&scheduler->scheduler, cpu_run);
+    return scheduler;
+}
+
+void cpu32_scheduler_destroy(struct cpu32_scheduler *scheduler)
+{
+    free(scheduler);
+}
+
+void cpu32_scheduler_add(struct cpu32_scheduler *scheduler,
+                         struct cpu32_vm *vm, size_t budget)
+{
+    assert(scheduler != NULL);
+    assert(vm != NULL);
+    assert(budget > 0);
+
+    if (vm->scheduler != NULL)
+        cpu32_scheduler_remove(vm->scheduler, vm);
+    vm->task.cpu = vm->cpu;
+    vm->task.budget = budget;
+    vm->scheduler = scheduler;
+    scheduler_add(&scheduler->scheduler, &vm->task);
+}
+
+void cpu32_scheduler_wake(struct cpu32_scheduler *scheduler,
+                          struct cpu32_vm *vm)
+{
+    assert(scheduler != NULL);
+    assert(vm != NULL && vm->scheduler == scheduler);
+
+    scheduler_wake(&scheduler->scheduler, &vm->task);
+}
+
+void cpu32_scheduler_remove(struct cpu32_scheduler *scheduler,
+                            struct cpu32_vm *vm)
+{
+    assert(scheduler != NULL);
+    assert(vm != NULL);
+
+    if (vm->scheduler != scheduler)
+        return;
+    scheduler_remove(&scheduler->scheduler, &vm->task);
+    vm->scheduler = NULL;
+}
+
+size_t cpu32_scheduler_runnable(const struct cpu32_scheduler *scheduler)
+{
+    assert(scheduler != NULL);
+
+    return scheduler_runnable(&scheduler->scheduler);
+}
+
+struct cpu32_vm *cpu32_scheduler_step(struct cpu32_scheduler *scheduler)
+{
+    assert(scheduler != NULL);
+
+    struct scheduler_task *task = scheduler_step(&scheduler->scheduler);
+    if (task == NULL)
+        return NULL;
+    return (struct cpu32_vm *) ((char *) task
+                                - offsetof(struct cpu32_vm, task));
+}
+
+long long cpu32_scheduler_executed(const struct cpu32_vm *vm)
+{
+    assert(vm != NULL);
+
+    return vm->task.executed;
+}
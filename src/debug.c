@@ -0,0 +1,319 @@
+#include "../include/debug.h"
+#include "../include/breakpoint.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+struct watch {
+    bool active;
+    /* a register if cell is negative */
+    enum cpu_register reg;
+    int32_t cell;
+    /* value in the state the debugger compares with */
+    int32_t value;
+};
+
+struct debugger {
+    struct cpu *cpu;
+    struct replay *replay;
+    struct breakpoints *breakpoints;
+
+    struct watch *watches;
+    int watch_count;
+    int watch_capacity;
+    /* count of active watches */
+    int watching;
+    /* watchpoint which stopped the last movement, -1 if none */
+    int hit;
+};
+
+static int32_t watch_value(const struct cpu *cpu, const struct watch *watch)
+{
+    if (watch->cell < 0)
+        return cpu->arithmetic_regs[watch->reg];
+    return *(cpu->stack_bottom - watch->cell);
+}
+
+/*
+ * Stores the current watched values, returns the first watchpoint whose
+ * value changed, -1 if none.
+ */
+static int update_watches(struct debugger *debugger)
+{
+    int changed = -1;
+    for (int i = 0; i < debugger->watch_count; ++i) {
+        struct watch *watch = debugger->watches + i;
+        if (!watch->active)
+            continue;
+        int32_t value = watch_value(debugger->cpu, watch);
+        if (value != watch->value && changed < 0)
+            changed = i;
+        watch->value = value;
+    }
+    return changed;
+}
+
+static bool stopped(const struct cpu *cpu)
+{
+    return cpu->status != CPU_OK && cpu->status != CPU_WAITING_INPUT;
+}
+
+/*
+ * Executes instructions up to position `end`. With `check`, it stops after
+ * an instruction which changed a watched value or in front of a breakpoint,
+ * the breakpoint at the starting position is stepped over.
+ */
+static enum debug_event forward(struct debugger *debugger, uint64_t end,
+                                bool check)
+{
+    struct cpu *cpu = debugger->cpu;
+    struct replay *replay = debugger->replay;
+
+    update_watches(debugger);
+    bool first = true;
+    while (replay_position(replay) < end) {
+        /* the recorded run went on after the input came */
+        cpu_resume(cpu);
+        if (cpu->status != CPU_OK)
+            break;
+        uint64_t left = end - replay_position(replay);
+        size_t steps = left < SIZE_MAX ? left : SIZE_MAX;
+
+        if (!check) {
+            replay_run(replay, steps);
+            continue;
+        }
+        if (debugger->watching == 0 && !first) {
+            breakpoints_enable(debugger->breakpoints, true);
+            replay_run(replay, steps);
+            breakpoints_enable(debugger->breakpoints, false);
+            if (cpu->status == CPU_BREAKPOINT) {
+                cpu->status = CPU_OK;
+                return DEBUG_BREAKPOINT;
+            }
+            continue;
+        }
+
+        replay_run(replay, 1);
+        first = false;
+        debugger->hit = update_watches(debugger);
+        if (debugger->hit >= 0)
+            return DEBUG_WATCHPOINT;
+        if (cpu->status == CPU_OK &&
+            breakpoint_at(debugger->breakpoints, cpu->instruction_index))
+            return DEBUG_BREAKPOINT;
+    }
+    return stopped(cpu) ? DEBUG_STOPPED : DEBUG_STEPPED;
+}
+
+struct debugger *debugger_create(struct cpu *cpu, struct replay *replay)
+{
+    assert(cpu != NULL);
+    assert(replay != NULL);
+
+    struct debugger *debugger = calloc(1, sizeof(struct debugger));
+    if (debugger == NULL)
+        return NULL;
+    debugger->breakpoints = breakpoints_create(cpu);
+    if (debugger->breakpoints == NULL) {
+        free(debugger);
+        return NULL;
+    }
+    debugger->cpu = cpu;
+    debugger->replay = replay;
+    debugger->hit = -1;
+    return debugger;
+}
+
+void debugger_destroy(struct debugger *debugger)
+{
+    if (debugger == NULL)
+        return;
+
+    breakpoints_destroy(debugger->breakpoints);
+    free(debugger->watches);
+    free(debugger);
+}
+
+int debugger_break(struct debugger *debugger, int32_t index)
+{
+    assert(debugger != NULL);
+    return breakpoint_insert(debugger->breakpoints, index);
+}
+
+int debugger_delete(struct debugger *debugger, int32_t index)
+{
+    assert(debugger != NULL);
+    return breakpoint_remove(debugger->breakpoints, index);
+}
+
+static int add_watch(struct debugger *debugger, enum cpu_register reg,
+                     int32_t cell)
+{
+    if (debugger->watch_count == debugger->watch_capacity) {
+        int capacity = debugger->watch_capacity > 0
+                       ? 2 * debugger->watch_capacity : 8;
+        struct watch *watches = realloc(debugger->watches,
+                                        capacity * sizeof(struct watch));
+        if (watches == NULL)
+            return -1;
+        debugger->watches = watches;
+        debugger->watch_capacity = capacity;
+    }
+
+    struct watch *watch = debugger->watches + debugger->watch_count;
+    watch->active = true;
+    watch->reg = reg;
+    watch->cell = cell;
+    watch->value = watch_value(debugger->cpu, watch);
+    ++debugger->watching;
+    return debugger->watch_count++;
+}
+
+int debugger_watch_register(struct debugger *debugger, enum cpu_register reg)
+{
+    assert(debugger != NULL);
+
+    if (reg < REGISTER_A || reg > REGISTER_D)
+        return -1;
+    return add_watch(debugger, reg, -1);
+}
+
+int debugger_watch_cell(struct debugger *debugger, int32_t cell)
+{
+    assert(debugger != NULL);
+
+    const struct cpu *cpu = debugger->cpu;
+    if (cell < 0 || !cpu->has_stack ||
+        cell > cpu->stack_bottom - cpu->stack_roof)
+        return -1;
+    return add_watch(debugger, REGISTER_A, cell);
+}
+
+int debugger_unwatch(struct debugger *debugger, int watch)
+{
+    assert(debugger != NULL);
+
+    if (watch < 0 || watch >= debugger->watch_count ||
+        !debugger->watches[watch].active)
+        return -1;
+    debugger->watches[watch].active = false;
+    --debugger->watching;
+    return 0;
+}
+
+int debugger_hit(const struct debugger *debugger)
+{
+    assert(debugger != NULL);
+    return debugger->hit;
+}
+
+enum debug_event debugger_step(struct debugger *debugger, uint64_t count)
+{
+    assert(debugger != NULL);
+
+    debugger->hit = -1;
+    uint64_t position = replay_position(debugger->replay);
+    uint64_t end = count < UINT64_MAX - position ? position + count
+                                                 : UINT64_MAX;
+    return forward(debugger, end, false);
+}
+
+enum debug_event debugger_continue(struct debugger *debugger)
+{
+    assert(debugger != NULL);
+
+    debugger->hit = -1;
+    return forward(debugger, UINT64_MAX, true);
+}
+
+enum debug_event debugger_reverse_step(struct debugger *debugger,
+                                       uint64_t count)
+{
+    assert(debugger != NULL);
+
+    debugger->hit = -1;
+    uint64_t position = replay_position(debugger->replay);
+    uint64_t step = count < position ? position - count : 0;
+    if (replay_seek(debugger->replay, step) != 0)
+        return DEBUG_ERROR;
+    return step == 0 ? DEBUG_START : DEBUG_STEPPED;
+}
+
+enum debug_event debugger_reverse_continue(struct debugger *debugger)
+{
+    assert(debugger != NULL);
+
+    struct cpu *cpu = debugger->cpu;
+    struct replay *replay = debugger->replay;
+    uint64_t target = replay_position(replay);
+    uint64_t end = target;
+    while (end > 0) {
+        uint64_t start = replay_checkpoint(replay, end - 1);
+        if (replay_seek(replay, start) != 0)
+            return DEBUG_ERROR;
+
+        /* the last event in front of the target in this interval */
+        enum debug_event last = DEBUG_STEPPED;
+        uint64_t last_position = 0;
+        int last_hit = -1;
+        if (cpu->status == CPU_OK &&
+            breakpoint_at(debugger->breakpoints, cpu->instruction_index)) {
+            last = DEBUG_BREAKPOINT;
+            last_position = start;
+        }
+        for (;;) {
+            enum debug_event event = forward(debugger, end, true);
+            uint64_t position = replay_position(replay);
+            if (event == DEBUG_BREAKPOINT && position < target) {
+                last = event;
+                last_position = position;
+                last_hit = -1;
+            } else if (event == DEBUG_WATCHPOINT) {
+                /* in front of the instruction which changed the value */
+                last = event;
+                last_position = position - 1;
+                last_hit = debugger->hit;
+                /* the breakpoint behind the instruction is the later event */
+                if (cpu->status == CPU_OK && position < target &&
+                    breakpoint_at(debugger->breakpoints,
+                                  cpu->instruction_index)) {
+                    last = DEBUG_BREAKPOINT;
+                    last_position = position;
+                    last_hit = -1;
+                }
+            } else if (event != DEBUG_BREAKPOINT) {
+                break;
+            }
+        }
+
+        if (last != DEBUG_STEPPED) {
+            if (replay_seek(replay, last_position) != 0)
+                return DEBUG_ERROR;
+            debugger->hit = last_hit;
+            return last;
+        }
+        end = start;
+    }
+
+    debugger->hit = -1;
+    if (replay_seek(replay, 0) != 0)
+        return DEBUG_ERROR;
+    return DEBUG_START;
+}
+
+enum debug_event debugger_goto(struct debugger *debugger, uint64_t step)
+{
+    assert(debugger != NULL);
+
+    debugger->hit = -1;
+    return replay_seek(debugger->replay, step) == 0 ? DEBUG_STEPPED
+                                                    : DEBUG_STOPPED;
+}
+
+uint64_t debugger_position(const struct debugger *debugger)
+{
+    assert(debugger != NULL);
+    return replay_position(debugger->replay);
+}
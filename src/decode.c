@@ -0,0 +1,224 @@
+#include "../include/decode.h"
+#include "../include/instructions.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+
+const int32_t instruction_lengths[19] = {
+    1, 1, 2, 2, 2, 2, 2, 2, 2, 3,
+    3, 3, 2, 2, 2, 2, 3, 2, 2
+};
+
+const char *const instruction_names[19] = {
+    "nop", "halt", "add", "sub", "mul", "div", "inc", "dec", "loop", "movr",
+    "load", "store", "in", "get", "out", "put", "swap", "push", "pop"
+};
+
+static bool is_reg(int32_t reg)
+{
+    return reg >= REGISTER_A && reg <= REGISTER_D;
+}
+
+void decode_instruction(const int32_t *memory, int32_t size, int32_t index,
+                        struct decoded_op *op)
+{
+    int32_t opcode = memory[index];
+    op->opcode = opcode;
+    op->reg1 = 0;
+    op->reg2 = 0;
+    op->number = 0;
+    op->next = index;
+    op->length = 1;
+
+    if (opcode < 0 || opcode > 18) {
+        op->execute = &exec_illegal_instruction;
+        return;
+    }
+
+    int32_t length = instruction_lengths[opcode];
+    op->next = index + length;
+    if (length > size - index) {
+        op->execute = &exec_dynamic;
+        return;
+    }
+
+    switch (opcode) {
+    case 0:
+    case 1:
+        break;
+    case 8:
+        op->number = memory[index + 1];
+        break;
+    case 16:
+        op->reg1 = memory[index + 1];
+        op->reg2 = memory[index + 2];
+        if (!is_reg(op->reg1) || !is_reg(op->reg2)) {
+            op->execute = &exec_illegal_operand;
+            return;
+        }
+        break;
+    default:
+        op->reg1 = memory[index + 1];
+        if (!is_reg(op->reg1)) {
+            op->execute = &exec_illegal_operand;
+            return;
+        }
+        if (length == 3)
+            op->number = memory[index + 2];
+        break;
+    }
+    op->execute = decoded_instructions[opcode];
+}
+
+struct decoded_op *cpu_decode(const int32_t *memory, int32_t size)
+{
+    assert(memory != NULL);
+    assert(size >= 0);
+
+    struct decoded_op *program = malloc((size > 0 ? size : 1)
+                                        * sizeof(struct decoded_op));
+    if (program == NULL)
+        return NULL;
+
+    for (int32_t i = 0; i < size; ++i)
+        decode_instruction(memory, size, i, program + i);
+
+    return program;
+}
+
+/* returns the op following `op` if it is a valid (not fused) instruction */
+static const struct decoded_op *following(const struct decoded_op *program,
+                                          int32_t size,
+                                          const struct decoded_op *op,
+                                          int32_t opcode)
+{
+    if (op->next >= size)
+        return NULL;
+    const struct decoded_op *next = program + op->next;
+    if (next->opcode != opcode || next->length != 1 ||
+        next->execute != decoded_instructions[opcode])
+        return NULL;
+    return next;
+}
+
+static void fuse_at(struct decoded_op *program, int32_t size,
+                    struct decoded_op *op)
+{
+    const struct decoded_op *second;
+    const struct decoded_op *third;
+
+    switch (op->opcode) {
+    case 2:
+        if ((second = following(program, size, op, 7)) != NULL &&
+            (third = following(program, size, second, 8)) != NULL) {
+            op->execute = &exec_add_dec_loop;
+            op->length = 3;
+        }
+        break;
+    case 7:
+        if (following(program, size, op, 8) != NULL) {
+            op->execute = &exec_dec_loop;
+            op->length = 2;
+        }
+        break;
+    case 9:
+        if ((second = following(program, size, op, 15)) != NULL &&
+            second->reg1 == op->reg1 &&
+            op->number >= 0 && op->number <= 255) {
+            op->execute = &exec_movr_put;
+            op->length = 2;
+        } else if ((second = following(program, size, op, 14)) != NULL &&
+                   second->reg1 == op->reg1) {
+            op->execute = &exec_movr_out;
+            op->length = 2;
+        } else if (following(program, size, op, 9) != NULL) {
+            op->execute = &exec_movr_movr;
+            op->length = 2;
+        }
+        break;
+    case 17:
+        if (following(program, size, op, 18) != NULL) {
+            op->execute = &exec_push_pop;
+            op->length = 2;
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+void cpu_fuse(struct decoded_op *program, int32_t size)
+{
+    assert(program != NULL);
+
+    for (int32_t i = 0; i < size; ++i) {
+        struct decoded_op *op = program + i;
+        if (op->opcode >= 0 && op->opcode <= 18 &&
+            op->execute == decoded_instructions[op->opcode])
+            fuse_at(program, size, op);
+    }
+}
+
+/* marks of words in cpu_verify() */
+enum {
+    UNREACHED,
+    INSTRUCTION,
+    OPERAND
+};
+
+int cpu_verify(const struct decoded_op *program, int32_t size)
+{
+    assert(program != NULL || size == 0);
+
+    if (size <= 0)
+        return 0;
+    unsigned char *marks = calloc(size, 1);
+    /* every index is pushed at most once, when it is marked */
+    int32_t *pending = malloc(size * sizeof(int32_t));
+    int verified = marks != NULL && pending != NULL;
+
+    int32_t count = 0;
+    if (verified) {
+        marks[0] = INSTRUCTION;
+        pending[count++] = 0;
+    }
+    while (verified && count > 0) {
+        const struct decoded_op *op = program + pending[--count];
+        if (!decoded_is_valid(op)) {
+            verified = 0;
+            break;
+        }
+
+        int32_t index = op - program;
+        for (int32_t i = index + 1; i < op->next; ++i) {
+            if (marks[i] == INSTRUCTION) {
+                verified = 0;
+                break;
+            }
+            marks[i] = OPERAND;
+        }
+
+        /* halt has no successor, loop has two */
+        int32_t successors[2];
+        int successor_count = 0;
+        if (op->opcode != 1)
+            successors[successor_count++] = op->next;
+        if (op->opcode == 8)
+            successors[successor_count++] = op->number;
+
+        for (int i = 0; verified && i < successor_count; ++i) {
+            /* negative index is converted to a big unsigned number */
+            uint32_t next = (uint32_t) successors[i];
+            if (next >= (uint32_t) size || marks[next] == OPERAND) {
+                verified = 0;
+            } else if (marks[next] == UNREACHED) {
+                marks[next] = INSTRUCTION;
+                pending[count++] = next;
+            }
+        }
+    }
+
+    free(marks);
+    free(pending);
+    return verified;
+}
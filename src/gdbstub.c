@@ -0,0 +1,601 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/gdbstub.h"
+#include "../include/breakpoint.h"
+#include "../include/snapshot.h"
+#include "../include/io.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/* signal numbers of the protocol */
+#define SIGNAL_INT 0x02
+#define SIGNAL_ILL 0x04
+#define SIGNAL_TRAP 0x05
+#define SIGNAL_FPE 0x08
+#define SIGNAL_SEGV 0x0b
+#define SIGNAL_IO 0x17
+
+/* count of registers in target.xml, pc follows A-D, sp is the last one */
+#define REGISTER_COUNT 6
+#define REGISTER_PC 4
+
+static const char target_xml[] =
+    "<?xml version=\"1.0\"?>\n"
+    "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+    "<target version=\"1.0\">\n"
+    "  <feature name=\"org.cpu32.core\">\n"
+    "    <reg name=\"a\" bitsize=\"32\" type=\"int32\" regnum=\"0\"/>\n"
+    "    <reg name=\"b\" bitsize=\"32\" type=\"int32\"/>\n"
+    "    <reg name=\"c\" bitsize=\"32\" type=\"int32\"/>\n"
+    "    <reg name=\"d\" bitsize=\"32\" type=\"int32\"/>\n"
+    "    <reg name=\"pc\" bitsize=\"32\" type=\"code_ptr\"/>\n"
+    "    <reg name=\"sp\" bitsize=\"32\" type=\"data_ptr\"/>\n"
+    "  </feature>\n"
+    "</target>\n";
+
+struct stub {
+    struct cpu *cpu;
+    struct breakpoints *breakpoints;
+    int in_fd;
+    int out_fd;
+
+    unsigned char input[GDBSTUB_PACKET_SIZE];
+    size_t input_length;
+    size_t input_offset;
+
+    /* payload of the last received packet, zero terminated */
+    char packet[GDBSTUB_PACKET_SIZE + 1];
+    /* the last reply, sent again when the debugger asks for it (`-`) */
+    char reply[GDBSTUB_PACKET_SIZE + 4];
+    size_t reply_length;
+};
+
+static const char hex_digits[] = "0123456789abcdef";
+
+static int hex_value(int c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+/* returns the next byte from the debugger, -1 if the connection closed */
+static int next_byte(struct stub *stub)
+{
+    if (stub->input_offset == stub->input_length) {
+        ssize_t result;
+        do {
+            result = read(stub->in_fd, stub->input, sizeof(stub->input));
+        } while (result < 0 && errno == EINTR);
+        if (result <= 0)
+            return -1;
+        stub->input_length = result;
+        stub->input_offset = 0;
+    }
+    return stub->input[stub->input_offset++];
+}
+
+static int write_all(int fd, const char *bytes, size_t length)
+{
+    while (length > 0) {
+        /* a closed socket must not kill the process by SIGPIPE */
+        ssize_t result = send(fd, bytes, length, MSG_NOSIGNAL);
+        if (result < 0 && errno == ENOTSOCK)
+            result = write(fd, bytes, length);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            return -1;
+        bytes += result;
+        length -= result;
+    }
+    return 0;
+}
+
+static int send_reply(struct stub *stub, const char *payload)
+{
+    size_t length = strlen(payload);
+    if (length > GDBSTUB_PACKET_SIZE - 4)
+        length = GDBSTUB_PACKET_SIZE - 4;
+
+    unsigned char checksum = 0;
+    stub->reply[0] = '$';
+    for (size_t i = 0; i < length; ++i) {
+        stub->reply[i + 1] = payload[i];
+        checksum += (unsigned char) payload[i];
+    }
+    stub->reply[length + 1] = '#';
+    stub->reply[length + 2] = hex_digits[checksum >> 4];
+    stub->reply[length + 3] = hex_digits[checksum & 0xf];
+    stub->reply_length = length + 4;
+    return write_all(stub->out_fd, stub->reply, stub->reply_length);
+}
+
+/*
+ * Receives the next packet into stub->packet and acknowledges it.
+ * Returns 0, -1 if the connection closed.
+ */
+static int receive_packet(struct stub *stub)
+{
+    for (;;) {
+        int c = next_byte(stub);
+        if (c < 0)
+            return -1;
+        if (c == '-' && stub->reply_length > 0 &&
+            write_all(stub->out_fd, stub->reply, stub->reply_length) != 0)
+            return -1;
+        if (c != '$')
+            continue;
+
+        size_t length = 0;
+        unsigned char checksum = 0;
+        while ((c = next_byte(stub)) >= 0 && c != '#') {
+            if (length < GDBSTUB_PACKET_SIZE)
+                stub->packet[length++] = (char) c;
+            checksum += (unsigned char) c;
+        }
+        int high = c < 0 ? -1 : hex_value(next_byte(stub));
+        int low = high < 0 ? -1 : hex_value(next_byte(stub));
+        if (c < 0)
+            return -1;
+        stub->packet[length] = '\0';
+
+        bool valid = low >= 0 && (high << 4 | low) == checksum &&
+                     length < GDBSTUB_PACKET_SIZE;
+        if (write_all(stub->out_fd, valid ? "+" : "-", 1) != 0)
+            return -1;
+        if (valid)
+            return 0;
+    }
+}
+
+/* returns true if the debugger sent an interrupt while the cpu was running */
+static bool interrupted(struct stub *stub)
+{
+    struct pollfd descriptor = {.fd = stub->in_fd, .events = POLLIN};
+    while (stub->input_offset < stub->input_length ||
+           poll(&descriptor, 1, 0) > 0) {
+        int c = next_byte(stub);
+        if (c < 0 || c == 0x03)
+            return true;
+        /* a packet is not expected before the stop reply, keep it */
+        if (c == '$') {
+            --stub->input_offset;
+            return false;
+        }
+    }
+    return false;
+}
+
+static void put_hex32(char *out, uint32_t value)
+{
+    /* little-endian, as the target stores words */
+    for (int i = 0; i < 4; ++i) {
+        unsigned char byte = (unsigned char) (value >> (8 * i));
+        out[2 * i] = hex_digits[byte >> 4];
+        out[2 * i + 1] = hex_digits[byte & 0xf];
+    }
+    out[8] = '\0';
+}
+
+static bool get_hex32(const char *in, uint32_t *value)
+{
+    *value = 0;
+    for (int i = 0; i < 4; ++i) {
+        int high = hex_value(in[2 * i]);
+        int low = high < 0 ? -1 : hex_value(in[2 * i + 1]);
+        if (low < 0)
+            return false;
+        *value |= (uint32_t) (high << 4 | low) << (8 * i);
+    }
+    return true;
+}
+
+/* parses a big-endian hex number (addresses, lengths), stops behind it */
+static bool get_number(const char **in, uint32_t *value)
+{
+    const char *p = *in;
+    *value = 0;
+    while (hex_value(*p) >= 0) {
+        if (*value > UINT32_MAX >> 4)
+            return false;
+        *value = *value << 4 | hex_value(*p++);
+    }
+    if (p == *in)
+        return false;
+    *in = p;
+    return true;
+}
+
+/* count of bytes of the memory from its start to the stack bottom */
+static size_t memory_size(const struct cpu *cpu)
+{
+    return (cpu->stack_bottom - cpu->memory + 1) * sizeof(int32_t);
+}
+
+static uint32_t read_register(const struct cpu *cpu, int reg)
+{
+    if (reg < REGISTER_PC)
+        return (uint32_t) cpu->arithmetic_regs[reg];
+    if (reg == REGISTER_PC)
+        return (uint32_t) cpu->instruction_index * 4;
+    const int32_t *top = cpu->stack_size > 0 ? cpu->stack_top
+                                             : cpu->stack_bottom + 1;
+    return (uint32_t) ((top - cpu->memory) * sizeof(int32_t));
+}
+
+static bool write_register(struct cpu *cpu, int reg, uint32_t value)
+{
+    if (reg < REGISTER_PC) {
+        cpu->arithmetic_regs[reg] = (int32_t) value;
+        return true;
+    }
+    if (reg != REGISTER_PC || value % 4 != 0)
+        return false;
+    cpu->instruction_index = (int32_t) (value / 4);
+    /* cpu_run() must check the bounds of an index it did not set itself */
+    cpu->verified = 0;
+    return true;
+}
+
+static void read_registers(struct stub *stub, char *reply)
+{
+    for (int i = 0; i < REGISTER_COUNT; ++i)
+        put_hex32(reply + 8 * i, read_register(stub->cpu, i));
+}
+
+static bool write_registers(struct stub *stub, const char *data)
+{
+    if (strlen(data) < 8 * REGISTER_COUNT)
+        return false;
+    uint32_t values[REGISTER_COUNT];
+    for (int i = 0; i < REGISTER_COUNT; ++i)
+        if (!get_hex32(data + 8 * i, values + i))
+            return false;
+    /* sp can't be written, the debugger sends back the value it read */
+    for (int i = 0; i <= REGISTER_PC; ++i)
+        if (!write_register(stub->cpu, i, values[i]))
+            return false;
+    return true;
+}
+
+/* m ADDRESS,LENGTH */
+static bool read_memory(struct stub *stub, const char *arguments, char *reply)
+{
+    uint32_t address, length;
+    if (!get_number(&arguments, &address) || *arguments++ != ',' ||
+        !get_number(&arguments, &length) ||
+        length > (GDBSTUB_PACKET_SIZE - 4) / 2 ||
+        address > memory_size(stub->cpu) ||
+        length > memory_size(stub->cpu) - address)
+        return false;
+
+    for (uint32_t i = 0; i < length; ++i) {
+        /* cells are stored as native int32_t, the target is little-endian */
+        uint32_t byte_address = address + i;
+        uint32_t cell = (uint32_t) stub->cpu->memory[byte_address / 4];
+        unsigned char byte = (unsigned char) (cell >> (8 * (byte_address % 4)));
+        reply[2 * i] = hex_digits[byte >> 4];
+        reply[2 * i + 1] = hex_digits[byte & 0xf];
+    }
+    reply[2 * length] = '\0';
+    return true;
+}
+
+/* M ADDRESS,LENGTH:DATA, only into the filled part of the stack */
+static bool write_memory(struct stub *stub, const char *arguments)
+{
+    struct cpu *cpu = stub->cpu;
+    uint32_t address, length;
+    if (!get_number(&arguments, &address) || *arguments++ != ',' ||
+        !get_number(&arguments, &length) || *arguments++ != ':' ||
+        strlen(arguments) != 2 * (size_t) length || cpu->stack_size == 0)
+        return false;
+
+    size_t first = (cpu->stack_top - cpu->memory) * sizeof(int32_t);
+    if (address < first || address > memory_size(cpu) ||
+        length > memory_size(cpu) - address)
+        return false;
+
+    for (uint32_t i = 0; i < length; ++i) {
+        int high = hex_value(arguments[2 * i]);
+        int low = high < 0 ? -1 : hex_value(arguments[2 * i + 1]);
+        if (low < 0)
+            return false;
+        int32_t *cell = cpu->memory + (address + i) / 4;
+        unsigned shift = 8 * ((address + i) % 4);
+        uint32_t value = (uint32_t) *cell & ~((uint32_t) 0xff << shift);
+        *cell = (int32_t) (value | (uint32_t) (high << 4 | low) << shift);
+        snapshot_mark(cpu, cell);
+    }
+    return true;
+}
+
+/* Z0,ADDRESS,KIND and z0,ADDRESS,KIND */
+static bool change_breakpoint(struct stub *stub, const char *arguments,
+                              bool insert)
+{
+    uint32_t address;
+    if (arguments[0] != '0' || arguments[1] != ',')
+        return false;
+    arguments += 2;
+    if (!get_number(&arguments, &address) || address % 4 != 0 ||
+        address / 4 > INT32_MAX)
+        return false;
+
+    int32_t index = (int32_t) (address / 4);
+    if (insert)
+        return breakpoint_insert(stub->breakpoints, index) == 0;
+    breakpoint_remove(stub->breakpoints, index);
+    return true;
+}
+
+/* qXfer:features:read:target.xml:OFFSET,LENGTH */
+static bool read_features(const char *arguments, char *reply)
+{
+    const char *annex = "target.xml:";
+    if (strncmp(arguments, annex, strlen(annex)) != 0)
+        return false;
+    arguments += strlen(annex);
+
+    uint32_t offset, length;
+    if (!get_number(&arguments, &offset) || *arguments++ != ',' ||
+        !get_number(&arguments, &length))
+        return false;
+
+    size_t size = sizeof(target_xml) - 1;
+    if (offset > size)
+        offset = size;
+    if (length > GDBSTUB_PACKET_SIZE - 8)
+        length = GDBSTUB_PACKET_SIZE - 8;
+    size_t left = size - offset;
+    size_t count = left < length ? left : length;
+    reply[0] = count == left ? 'l' : 'm';
+    memcpy(reply + 1, target_xml + offset, count);
+    reply[count + 1] = '\0';
+    return true;
+}
+
+/* writes the stop reply for the state of the cpu */
+static void stop_reply(const struct stub *stub, int signal, char *reply)
+{
+    switch (stub->cpu->status) {
+    case CPU_HALTED:
+        strcpy(reply, "W00");
+        return;
+    case CPU_ILLEGAL_INSTRUCTION:
+    case CPU_ILLEGAL_OPERAND:
+        signal = SIGNAL_ILL;
+        break;
+    case CPU_INVALID_ADDRESS:
+    case CPU_INVALID_STACK_OPERATION:
+        signal = SIGNAL_SEGV;
+        break;
+    case CPU_DIV_BY_ZERO:
+        signal = SIGNAL_FPE;
+        break;
+    case CPU_IO_ERROR:
+        signal = SIGNAL_IO;
+        break;
+    default:
+        break;
+    }
+    sprintf(reply, "S%02x", signal);
+}
+
+/* executes one instruction, also if it has a breakpoint */
+static void step(struct stub *stub)
+{
+    breakpoints_enable(stub->breakpoints, false);
+    cpu_step(stub->cpu);
+}
+
+/* runs until a breakpoint, a stop of the program or an interrupt */
+static void run(struct stub *stub, char *reply)
+{
+    struct cpu *cpu = stub->cpu;
+    /* the instruction at the current breakpoint is executed first */
+    step(stub);
+    breakpoints_enable(stub->breakpoints, true);
+    while (cpu->status == CPU_OK) {
+        cpu_run(cpu, GDBSTUB_CHUNK);
+        if (cpu->status == CPU_OK && interrupted(stub)) {
+            breakpoints_enable(stub->breakpoints, false);
+            stop_reply(stub, SIGNAL_INT, reply);
+            return;
+        }
+    }
+    breakpoints_enable(stub->breakpoints, false);
+
+    if (cpu->status == CPU_BREAKPOINT) {
+        cpu->status = CPU_OK;
+        strcpy(reply, "T05swbreak:;");
+        return;
+    }
+    stop_reply(stub, SIGNAL_TRAP, reply);
+}
+
+/*
+ * Handles the packet in stub->packet, the reply is written to `reply`.
+ * Returns 1 to go on, 0 if the session ends, -1 if the program was killed.
+ */
+static int handle(struct stub *stub, char *reply)
+{
+    struct cpu *cpu = stub->cpu;
+    const char *packet = stub->packet;
+    const char *arguments = packet + 1;
+    reply[0] = '\0';
+
+    switch (packet[0]) {
+    case '?':
+        stop_reply(stub, SIGNAL_TRAP, reply);
+        break;
+    case 'g':
+        read_registers(stub, reply);
+        break;
+    case 'G':
+        strcpy(reply, write_registers(stub, arguments) ? "OK" : "E01");
+        break;
+    case 'p': {
+        uint32_t reg;
+        if (get_number(&arguments, &reg) && reg < REGISTER_COUNT)
+            put_hex32(reply, read_register(cpu, reg));
+        else
+            strcpy(reply, "E01");
+        break;
+    }
+    case 'P': {
+        uint32_t reg, value;
+        bool written = get_number(&arguments, &reg) && *arguments++ == '=' &&
+                       reg < REGISTER_COUNT && get_hex32(arguments, &value) &&
+                       write_register(cpu, reg, value);
+        strcpy(reply, written ? "OK" : "E01");
+        break;
+    }
+    case 'm':
+        if (!read_memory(stub, arguments, reply))
+            strcpy(reply, "E01");
+        break;
+    case 'M':
+        strcpy(reply, write_memory(stub, arguments) ? "OK" : "E01");
+        break;
+    case 'Z':
+    case 'z':
+        /* other kinds of breakpoints get the empty reply (unsupported) */
+        if (arguments[0] == '0')
+            strcpy(reply, change_breakpoint(stub, arguments, packet[0] == 'Z')
+                          ? "OK" : "E01");
+        break;
+    case 'c':
+    case 's': {
+        uint32_t address;
+        if (*arguments && (!get_number(&arguments, &address) ||
+                           !write_register(cpu, REGISTER_PC, address))) {
+            strcpy(reply, "E01");
+            break;
+        }
+        if (cpu->status != CPU_OK) {
+            stop_reply(stub, SIGNAL_TRAP, reply);
+        } else if (packet[0] == 's') {
+            step(stub);
+            stop_reply(stub, SIGNAL_TRAP, reply);
+        } else {
+            run(stub, reply);
+        }
+        if (cpu->status == CPU_HALTED)
+            return send_reply(stub, reply) == 0 ? 0 : -1;
+        break;
+    }
+    case 'D':
+        send_reply(stub, "OK");
+        return 0;
+    case 'k':
+        return -1;
+    case 'H':
+    case 'T':
+        strcpy(reply, "OK");
+        break;
+    case 'q':
+        if (strncmp(packet, "qSupported", 10) == 0)
+            sprintf(reply, "PacketSize=%x;qXfer:features:read+;swbreak+",
+                    GDBSTUB_PACKET_SIZE);
+        else if (strncmp(packet, "qXfer:features:read:", 20) == 0 &&
+                 !read_features(packet + 20, reply))
+            strcpy(reply, "E01");
+        else if (strcmp(packet, "qAttached") == 0)
+            strcpy(reply, "1");
+        else if (strcmp(packet, "qC") == 0)
+            strcpy(reply, "QC1");
+        else if (strcmp(packet, "qfThreadInfo") == 0)
+            strcpy(reply, "m1");
+        else if (strcmp(packet, "qsThreadInfo") == 0)
+            strcpy(reply, "l");
+        break;
+    default:
+        /* the empty reply tells the debugger the packet is not supported */
+        break;
+    }
+    return send_reply(stub, reply) == 0 ? 1 : -1;
+}
+
+int gdbstub_listen(const char *path)
+{
+    assert(path != NULL);
+
+    struct sockaddr_un address = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(address.sun_path))
+        return -1;
+    strcpy(address.sun_path, path);
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0)
+        return -1;
+    unlink(path);
+    if (bind(listener, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(listener, 1) != 0) {
+        close(listener);
+        return -1;
+    }
+    return listener;
+}
+
+int gdbstub_accept(int listener, const char *path)
+{
+    assert(path != NULL);
+
+    int connection;
+    do {
+        connection = accept(listener, NULL, NULL);
+    } while (connection < 0 && errno == EINTR);
+    close(listener);
+    unlink(path);
+    return connection;
+}
+
+int gdbstub_serve(struct cpu *cpu, int in_fd, int out_fd)
+{
+    assert(cpu != NULL);
+
+    struct stub *stub = calloc(1, sizeof(struct stub));
+    if (stub == NULL)
+        return -1;
+    stub->breakpoints = breakpoints_create(cpu);
+    char *reply = malloc(GDBSTUB_PACKET_SIZE);
+    if (stub->breakpoints == NULL || reply == NULL) {
+        breakpoints_destroy(stub->breakpoints);
+        free(reply);
+        free(stub);
+        return -1;
+    }
+    stub->cpu = cpu;
+    stub->in_fd = in_fd;
+    stub->out_fd = out_fd;
+
+    int result = 1;
+    while (result > 0) {
+        /* a closed connection detaches the debugger */
+        if (receive_packet(stub) != 0)
+            result = 0;
+        else
+            result = handle(stub, reply);
+    }
+    /* the output written while stopped is not held back */
+    cpu->io->flush(cpu->io);
+
+    breakpoints_destroy(stub->breakpoints);
+    free(reply);
+    free(stub);
+    return result;
+}
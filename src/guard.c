@@ -0,0 +1,277 @@
+#define _DEFAULT_SOURCE
+
+#include "../include/guard.h"
+#include "../include/cpu.h"
+#include "../include/instructions.h"
+#include "../include/decode.h"
+#include "../include/snapshot.h"
+#include "../include/io.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__GNUC__) && defined(__linux__)
+
+#include <signal.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* keeps the compiler from moving memory accesses across the faulting one */
+#define BARRIER() __asm__ volatile ("" ::: "memory")
+
+struct guard {
+    unsigned char *mapping;
+    size_t length;
+    /* size of each of the two guard pages */
+    size_t guard_size;
+    /* op handlers of the program, push and pop replaced by guarded ones */
+    decoded_handler *handlers;
+    /* cpu->program_changes the handlers were copied at */
+    uint32_t program_changes;
+};
+
+/* running cpu_run_guarded() of this thread */
+struct guard_frame {
+    sigjmp_buf env;
+    const struct guard *guard;
+};
+
+static __thread struct guard_frame *active_frame;
+
+static struct sigaction previous_action;
+static pthread_once_t handler_once = PTHREAD_ONCE_INIT;
+static int handler_installed;
+
+static int in_guard_page(const struct guard *guard, const void *address)
+{
+    const unsigned char *byte = address;
+    const unsigned char *end = guard->mapping + guard->length;
+    return (byte >= guard->mapping && byte < guard->mapping + guard->guard_size)
+           || (byte >= end - guard->guard_size && byte < end);
+}
+
+static void on_fault(int signal, siginfo_t *info, void *context)
+{
+    struct guard_frame *frame = active_frame;
+    if (frame != NULL && in_guard_page(frame->guard, info->si_addr))
+        siglongjmp(frame->env, 1);
+
+    /* not a guard page, handle the fault as if there was no handler */
+    if (previous_action.sa_flags & SA_SIGINFO) {
+        previous_action.sa_sigaction(signal, info, context);
+    } else if (previous_action.sa_handler != SIG_DFL &&
+               previous_action.sa_handler != SIG_IGN) {
+        previous_action.sa_handler(signal);
+    } else {
+        /* the faulting instruction is executed again with the default */
+        struct sigaction fallback;
+        memset(&fallback, 0, sizeof(fallback));
+        fallback.sa_handler = SIG_DFL;
+        sigaction(SIGSEGV, &fallback, NULL);
+    }
+}
+
+static void install_handler(void)
+{
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = &on_fault;
+    /* the handler jumps out, SIGSEGV must not stay blocked */
+    action.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&action.sa_mask);
+    handler_installed = sigaction(SIGSEGV, &action, &previous_action) == 0;
+}
+
+/*
+ * push R without the bound check, a full stack writes in front of the roof.
+ * The barrier keeps the cpu unchanged until the write succeeded.
+ */
+static int guarded_push(struct cpu *cpu, const struct decoded_op *op)
+{
+    int32_t *top = cpu->stack_top - (cpu->stack_size != 0);
+    *top = cpu->arithmetic_regs[op->reg1];
+    BARRIER();
+
+    cpu->stack_top = top;
+    snapshot_mark(cpu, top);
+    ++cpu->stack_size;
+    cpu->instruction_index = op->next;
+    return 1;
+}
+
+/* pop R without the check, an empty stack reads behind the bottom */
+static int guarded_pop(struct cpu *cpu, const struct decoded_op *op)
+{
+    int32_t *top = cpu->stack_top + (cpu->stack_size == 0);
+    int32_t value = *top;
+    BARRIER();
+
+    cpu->arithmetic_regs[op->reg1] = value;
+    *top = 0;
+    snapshot_mark(cpu, top);
+    cpu->stack_top += cpu->stack_size > 1;
+    --cpu->stack_size;
+    cpu->instruction_index = op->next;
+    return 1;
+}
+
+/* copies the handlers of the ops as they are now */
+static void copy_handlers(struct guard *guard, const struct cpu *cpu)
+{
+    for (int32_t i = 0; i < cpu->program_size; ++i) {
+        decoded_handler handler = cpu->program[i].execute;
+        if (handler == &exec_push)
+            handler = &guarded_push;
+        else if (handler == &exec_pop)
+            handler = &guarded_pop;
+        guard->handlers[i] = handler;
+    }
+    guard->program_changes = cpu->program_changes;
+}
+
+struct guard *guard_create(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    long page = sysconf(_SC_PAGESIZE);
+    size_t capacity = cpu->stack_bottom - cpu->stack_roof + 1;
+    ptrdiff_t phase = cpu->stack_roof - cpu->stack_pages;
+    if (page <= 0 || !cpu->has_stack ||
+        (capacity * sizeof(int32_t)) % page != 0 ||
+        (size_t) phase * sizeof(int32_t) > (size_t) page)
+        return NULL;
+
+    pthread_once(&handler_once, &install_handler);
+    if (!handler_installed)
+        return NULL;
+
+    struct guard *guard = calloc(1, sizeof(struct guard));
+    if (guard == NULL)
+        return NULL;
+    guard->handlers = malloc((cpu->program_size > 0 ? cpu->program_size : 1)
+                             * sizeof(decoded_handler));
+    guard->guard_size = page;
+    guard->length = capacity * sizeof(int32_t) + 2 * guard->guard_size;
+    /* pages are committed when touched, big stacks cost only what is used */
+    guard->mapping = mmap(NULL, guard->length, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (guard->handlers == NULL || guard->mapping == MAP_FAILED ||
+        mprotect(guard->mapping + guard->guard_size,
+                 capacity * sizeof(int32_t), PROT_READ | PROT_WRITE) != 0) {
+        if (guard->mapping != MAP_FAILED)
+            munmap(guard->mapping, guard->length);
+        free(guard->handlers);
+        free(guard);
+        return NULL;
+    }
+
+    copy_handlers(guard, cpu);
+
+    /* cells in front of the stack top are zero, like the new mapping */
+    int32_t *roof = (int32_t *) (guard->mapping + guard->guard_size);
+    ptrdiff_t top = cpu->stack_top - cpu->stack_roof;
+    memcpy(roof + top, cpu->stack_top,
+           (cpu->stack_bottom - cpu->stack_top + 1) * sizeof(int32_t));
+    /* a clone has the stack allocated on its own, it is not needed anymore */
+    if (cpu->shares_program)
+        free(cpu->stack_pages);
+
+    cpu->stack_top = roof + top;
+    cpu->stack_roof = roof;
+    cpu->stack_bottom = roof + capacity - 1;
+    /* blocks keep their offset (see cpu_snapshot()), it lies in the guard */
+    cpu->stack_pages = roof - phase;
+    return guard;
+}
+
+void guard_destroy(struct guard *guard)
+{
+    if (guard == NULL)
+        return;
+
+    munmap(guard->mapping, guard->length);
+    free(guard->handlers);
+    free(guard);
+}
+
+long long cpu_run_guarded(struct cpu *cpu, size_t steps)
+{
+    assert(cpu != NULL);
+
+    if (cpu->status != CPU_OK)
+        return 0;
+
+    if (cpu->guard == NULL) {
+        cpu->guard = guard_create(cpu);
+        if (cpu->guard == NULL)
+            return cpu_run(cpu, steps);
+    } else if (cpu->guard->program_changes != cpu->program_changes) {
+        /* ops were patched since the handlers were copied */
+        copy_handlers(cpu->guard, cpu);
+    }
+
+    struct guard_frame frame;
+    frame.guard = cpu->guard;
+    /* volatile, it is read after the jump from the signal handler */
+    volatile size_t executed = 0;
+
+    if (sigsetjmp(frame.env, 0) != 0) {
+        /* push or pop hit a guard page, nothing was changed by it */
+        active_frame = NULL;
+        cpu->status = CPU_INVALID_STACK_OPERATION;
+        cpu->io->flush(cpu->io);
+        return -(long long) (executed + 1);
+    }
+    active_frame = &frame;
+
+    const decoded_handler *handlers = cpu->guard->handlers;
+    const uint32_t size = (uint32_t) cpu->program_size;
+    while (executed < steps) {
+        /* negative index is converted to a big unsigned number */
+        uint32_t index = (uint32_t) cpu->instruction_index;
+        int result = 0;
+        if (index >= size) {
+            cpu->status = CPU_INVALID_ADDRESS;
+        } else if (steps - executed >= FUSED_MAX_LENGTH) {
+            cpu->budget = steps - executed;
+            result = handlers[index](cpu, cpu->program + index);
+        } else {
+            /* fused ops are used only if the whole sequence fits */
+            result = execute_single(cpu, cpu->program + index);
+        }
+
+        if (result <= 0) {
+            active_frame = NULL;
+            cpu->io->flush(cpu->io);
+            size_t total = executed + 1 - result;
+            return cpu->status == CPU_HALTED ? (long long) total
+                                             : -(long long) total;
+        }
+        executed += result;
+    }
+    active_frame = NULL;
+    return steps;
+}
+
+#else
+
+struct guard *guard_create(struct cpu *cpu)
+{
+    (void) cpu;
+    return NULL;
+}
+
+void guard_destroy(struct guard *guard)
+{
+    (void) guard;
+}
+
+long long cpu_run_guarded(struct cpu *cpu, size_t steps)
+{
+    return cpu_run(cpu, steps);
+}
+
+#endif  // __GNUC__ && __linux__
@@ -1,312 +1,363 @@
 #include "../include/instructions.h"
+#include "../include/io.h"
+#include "../include/snapshot.h"
 #include <assert.h>
 #include <stdio.h>
-#include <inttypes.h>
 #include <limits.h>
 #include <stdbool.h>
-
-static bool check_reg(struct cpu *cpu, enum cpu_register reg)
+#include <stdint.h>
+
+/*
+ * Returns STACK_TOP + register D + number, or NULL (and sets cpu status)
+ * if the address is beyond the filled part of the stack. The offset is
+ * computed in 64 bits, so it can't overflow.
+ *
+ * The filled part is STACK_TOP ... STACK_TOP + stack_size - 1 (an empty
+ * stack, also the missing one, has no valid offset), so one unsigned
+ * comparison also rejects negative offsets.
+ */
+static int32_t *stack_address(struct cpu *cpu, int32_t number)
 {
-    if (reg < REGISTER_A || reg > REGISTER_D) {
-        cpu->status = CPU_ILLEGAL_OPERAND;
-        return false;
+    int64_t offset = (int64_t) cpu->arithmetic_regs[REGISTER_D] + number;
+    if ((uint64_t) offset >= (uint64_t) cpu->stack_size) {
+        cpu->status = CPU_INVALID_STACK_OPERATION;
+        return NULL;
     }
-    return true;
+    return cpu->stack_top + offset;
 }
 
-static bool check_stack(struct cpu *cpu, int32_t *pointer, int32_t number)
+/*
+ * Returns the word at index as the instruction fetch sees it. Words behind
+ * the program are read from the stack, which may be allocated separately
+ * (see cpu_clone()), words outside of the memory are read as 0.
+ */
+static int32_t fetch_word(const struct cpu *cpu, int64_t index)
 {
-    if (!cpu->has_stack || cpu->stack_size == 0 ||
-        pointer > cpu->stack_bottom ||
-        cpu->arithmetic_regs[REGISTER_D] + number < 0) {
-        cpu->status = CPU_INVALID_STACK_OPERATION;
-        return false;
-    }
-    return true;
+    if (index < 0)
+        return 0;
+    if (index < cpu->program_size)
+        return cpu->memory[index];
+
+    int64_t offset = index - cpu->program_size;
+    if (offset > cpu->stack_bottom - cpu->stack_roof)
+        return 0;
+    return cpu->stack_roof[offset];
+}
+
+/*
+ * Decodes the instruction at cpu->instruction_index as `opcode`, whatever
+ * the word there is, and executes it. Operands are always taken from
+ * the memory, even if they are located in the stack.
+ */
+static int execute_as(struct cpu *cpu, int32_t opcode)
+{
+    int32_t words[INSTRUCTION_MAX_LENGTH];
+    words[0] = opcode;
+    for (int i = 1; i < INSTRUCTION_MAX_LENGTH; ++i)
+        words[i] = fetch_word(cpu, (int64_t) cpu->instruction_index + i);
+
+    struct decoded_op op;
+    decode_instruction(words, INSTRUCTION_MAX_LENGTH, 0, &op);
+    op.next += cpu->instruction_index;
+    return op.execute(cpu, &op);
+}
+
+/* decodes the instruction at cpu->instruction_index and executes it */
+static int execute_current(struct cpu *cpu)
+{
+    return execute_as(cpu, fetch_word(cpu, cpu->instruction_index));
 }
 
 int nop(struct cpu *cpu)
 {
     assert(cpu != NULL);
-
-    cpu->instruction_index++;
-    return 1;
+    return execute_as(cpu, 0);
 }
 
 int halt(struct cpu *cpu)
 {
     assert(cpu != NULL);
-
-    cpu->status = CPU_HALTED;
-    cpu->instruction_index++;
-    return 0;
+    return execute_as(cpu, 1);
 }
 
 int add(struct cpu *cpu)
 {
     assert(cpu != NULL);
-
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
-        return 0;
-
-    cpu->arithmetic_regs[REGISTER_A] += cpu->arithmetic_regs[reg];
-    cpu->instruction_index += 2;
-    return 1;
+    return execute_as(cpu, 2);
 }
 
 int sub(struct cpu *cpu)
 {
     assert(cpu != NULL);
-
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
-        return 0;
-
-    cpu->arithmetic_regs[REGISTER_A] -= cpu->arithmetic_regs[reg];
-    cpu->instruction_index += 2;
-    return 1;
+    return execute_as(cpu, 3);
 }
 
 int mul(struct cpu *cpu)
 {
     assert(cpu != NULL);
-
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
-        return 0;
-
-    cpu->arithmetic_regs[REGISTER_A] *= cpu->arithmetic_regs[reg];
-    cpu->instruction_index += 2;
-    return 1;
+    return execute_as(cpu, 4);
 }
 
 int div0(struct cpu *cpu)
 {
     assert(cpu != NULL);
+    return execute_as(cpu, 5);
+}
 
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
-        return 0;
+int inc(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    return execute_as(cpu, 6);
+}
 
-    if (cpu->arithmetic_regs[reg] == 0) {
-        cpu->status = CPU_DIV_BY_ZERO;
-        return 0;
-    }
-    cpu->arithmetic_regs[REGISTER_A] /= cpu->arithmetic_regs[reg];
-    cpu->instruction_index += 2;
-    return 1;
+int dec(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    return execute_as(cpu, 7);
 }
 
-int inc(struct cpu *cpu)
+int loop(struct cpu *cpu)
 {
     assert(cpu != NULL);
+    return execute_as(cpu, 8);
+}
 
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
-        return 0;
+int movr(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    return execute_as(cpu, 9);
+}
 
-    ++cpu->arithmetic_regs[reg];
-    cpu->instruction_index += 2;
-    return 1;
+int load(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    return execute_as(cpu, 10);
 }
 
-int dec(struct cpu *cpu)
+int store(struct cpu *cpu)
 {
     assert(cpu != NULL);
+    return execute_as(cpu, 11);
+}
 
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
-        return 0;
+int in(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    return execute_as(cpu, 12);
+}
 
-    --cpu->arithmetic_regs[reg];
-    cpu->instruction_index += 2;
-    return 1;
+int get(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    return execute_as(cpu, 13);
 }
 
-int loop(struct cpu *cpu)
+int out(struct cpu *cpu)
 {
     assert(cpu != NULL);
+    return execute_as(cpu, 14);
+}
 
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t index = *(instruction_address + 1);
+int put(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    return execute_as(cpu, 15);
+}
 
-    if (cpu->arithmetic_regs[REGISTER_C]) {
-        cpu->instruction_index = index;
-        return 1;
-    }
-    cpu->instruction_index += 2;
-    return 1;
+int swap(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    return execute_as(cpu, 16);
 }
 
-int movr(struct cpu *cpu)
+int push(struct cpu *cpu)
 {
     assert(cpu != NULL);
+    return execute_as(cpu, 17);
+}
 
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t number = *(instruction_address + 2);
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
-        return 0;
+int pop(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+    return execute_as(cpu, 18);
+}
 
-    cpu->arithmetic_regs[reg] = number;
-    cpu->instruction_index += 3;
+int exec_nop(struct cpu *cpu, const struct decoded_op *op)
+{
+    cpu->instruction_index = op->next;
     return 1;
 }
 
-int load(struct cpu *cpu)
+int exec_halt(struct cpu *cpu, const struct decoded_op *op)
 {
-    assert(cpu != NULL);
+    cpu->status = CPU_HALTED;
+    cpu->instruction_index = op->next;
+    return 0;
+}
 
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t number = *(instruction_address + 2);
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
-        return 0;
+int exec_add(struct cpu *cpu, const struct decoded_op *op)
+{
+    cpu->arithmetic_regs[REGISTER_A] += cpu->arithmetic_regs[op->reg1];
+    cpu->instruction_index = op->next;
+    return 1;
+}
 
-    int32_t *pointer = cpu->stack_top + cpu->arithmetic_regs[REGISTER_D] + number;
+int exec_sub(struct cpu *cpu, const struct decoded_op *op)
+{
+    cpu->arithmetic_regs[REGISTER_A] -= cpu->arithmetic_regs[op->reg1];
+    cpu->instruction_index = op->next;
+    return 1;
+}
 
-    if (!check_stack(cpu, pointer, number))
+int exec_mul(struct cpu *cpu, const struct decoded_op *op)
+{
+    cpu->arithmetic_regs[REGISTER_A] *= cpu->arithmetic_regs[op->reg1];
+    cpu->instruction_index = op->next;
+    return 1;
+}
+
+int exec_div(struct cpu *cpu, const struct decoded_op *op)
+{
+    int32_t divisor = cpu->arithmetic_regs[op->reg1];
+    if (divisor == 0) {
+        cpu->status = CPU_DIV_BY_ZERO;
         return 0;
+    }
+    /* INT32_MIN / -1 doesn't fit, it wraps around like the other operations */
+    if (divisor == -1)
+        cpu->arithmetic_regs[REGISTER_A] =
+            (int32_t) (0u - (uint32_t) cpu->arithmetic_regs[REGISTER_A]);
+    else
+        cpu->arithmetic_regs[REGISTER_A] /= divisor;
+    cpu->instruction_index = op->next;
+    return 1;
+}
 
-    cpu->arithmetic_regs[reg] = *pointer;
-    cpu->instruction_index += 3;
+int exec_inc(struct cpu *cpu, const struct decoded_op *op)
+{
+    ++cpu->arithmetic_regs[op->reg1];
+    cpu->instruction_index = op->next;
     return 1;
 }
 
-int store(struct cpu *cpu)
+int exec_dec(struct cpu *cpu, const struct decoded_op *op)
 {
-    assert(cpu != NULL);
+    --cpu->arithmetic_regs[op->reg1];
+    cpu->instruction_index = op->next;
+    return 1;
+}
 
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t number = *(instruction_address + 2);
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
-        return 0;
+int exec_loop(struct cpu *cpu, const struct decoded_op *op)
+{
+    if (cpu->arithmetic_regs[REGISTER_C]) {
+        cpu->instruction_index = op->number;
+        return 1;
+    }
+    cpu->instruction_index = op->next;
+    return 1;
+}
 
-    int32_t *pointer = cpu->stack_top + cpu->arithmetic_regs[REGISTER_D] + number;
+int exec_movr(struct cpu *cpu, const struct decoded_op *op)
+{
+    cpu->arithmetic_regs[op->reg1] = op->number;
+    cpu->instruction_index = op->next;
+    return 1;
+}
 
-    if (!check_stack(cpu, pointer, number))
+int exec_load(struct cpu *cpu, const struct decoded_op *op)
+{
+    int32_t *pointer = stack_address(cpu, op->number);
+    if (pointer == NULL)
         return 0;
 
-    *pointer = cpu->arithmetic_regs[reg];
-    cpu->instruction_index += 3;
+    cpu->arithmetic_regs[op->reg1] = *pointer;
+    cpu->instruction_index = op->next;
     return 1;
 }
 
-int in(struct cpu *cpu)
+int exec_store(struct cpu *cpu, const struct decoded_op *op)
 {
-    assert(cpu != NULL);
-
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
+    int32_t *pointer = stack_address(cpu, op->number);
+    if (pointer == NULL)
         return 0;
 
+    *pointer = cpu->arithmetic_regs[op->reg1];
+    snapshot_mark(cpu, pointer);
+    cpu->instruction_index = op->next;
+    return 1;
+}
+
+int exec_in(struct cpu *cpu, const struct decoded_op *op)
+{
     int32_t number;
-    switch (scanf("%"SCNd32, &number)) {
+    switch (cpu->io->read_number(cpu->io, &number)) {
     case 0:
         cpu->status = CPU_IO_ERROR;
         return 0;
+    case CPU_IO_WAIT:
+        cpu->status = CPU_WAITING_INPUT;
+        return 0;
     case EOF:
         cpu->arithmetic_regs[REGISTER_C] = 0;
-        cpu->arithmetic_regs[reg] = -1;
+        cpu->arithmetic_regs[op->reg1] = -1;
         break;
     default:
-        cpu->arithmetic_regs[reg] = number;
+        cpu->arithmetic_regs[op->reg1] = number;
         break;
     }
 
-    cpu->instruction_index += 2;
+    cpu->instruction_index = op->next;
     return 1;
 }
 
-int get(struct cpu *cpu)
+int exec_get(struct cpu *cpu, const struct decoded_op *op)
 {
-    assert(cpu != NULL);
-
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
+    int ch = cpu->io->read_byte(cpu->io);
+    if (ch == CPU_IO_WAIT) {
+        cpu->status = CPU_WAITING_INPUT;
         return 0;
-
-    int ch = getchar();
+    }
     if (ch == EOF) {
         cpu->arithmetic_regs[REGISTER_C] = 0;
-        cpu->arithmetic_regs[reg] = -1;
+        cpu->arithmetic_regs[op->reg1] = -1;
     } else {
-        cpu->arithmetic_regs[reg] = ch;
+        cpu->arithmetic_regs[op->reg1] = ch;
     }
 
-    cpu->instruction_index += 2;
+    cpu->instruction_index = op->next;
     return 1;
 }
 
-int out(struct cpu *cpu)
+int exec_out(struct cpu *cpu, const struct decoded_op *op)
 {
-    assert(cpu != NULL);
-
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
-        return 0;
-
-    printf("%" SCNd32, cpu->arithmetic_regs[reg]);
-    cpu->instruction_index += 2;
+    cpu->io->write_number(cpu->io, cpu->arithmetic_regs[op->reg1]);
+    cpu->instruction_index = op->next;
     return 1;
 }
 
-int put(struct cpu *cpu)
+int exec_put(struct cpu *cpu, const struct decoded_op *op)
 {
-    assert(cpu != NULL);
-
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
-        return 0;
-
-    int32_t number = cpu->arithmetic_regs[reg];
+    int32_t number = cpu->arithmetic_regs[op->reg1];
     if (number < 0 || number > UCHAR_MAX) {
         cpu->status = CPU_ILLEGAL_OPERAND;
         return 0;
     }
-    putchar(number);
-    cpu->instruction_index += 2;
+    cpu->io->write_byte(cpu->io, number);
+    cpu->instruction_index = op->next;
     return 1;
 }
 
-int swap(struct cpu *cpu)
+int exec_swap(struct cpu *cpu, const struct decoded_op *op)
 {
-    assert(cpu != NULL);
-
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t reg1 = *(instruction_address + 1);
-    int32_t reg2 = *(instruction_address + 2);
-    if (!check_reg(cpu, reg1) || !check_reg(cpu, reg2))
-        return 0;
-
-    int32_t temp = cpu->arithmetic_regs[reg1];
-    cpu->arithmetic_regs[reg1] = cpu->arithmetic_regs[reg2];
-    cpu->arithmetic_regs[reg2] = temp;
-    cpu->instruction_index += 3;
+    int32_t temp = cpu->arithmetic_regs[op->reg1];
+    cpu->arithmetic_regs[op->reg1] = cpu->arithmetic_regs[op->reg2];
+    cpu->arithmetic_regs[op->reg2] = temp;
+    cpu->instruction_index = op->next;
     return 1;
 }
 
-int push(struct cpu *cpu)
+int exec_push(struct cpu *cpu, const struct decoded_op *op)
 {
-    assert(cpu != NULL);
-
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
-        return 0;
-
     // better to use cpu->stack_bottom - cpu->stack_size because
     // cpu_stack_top's value for stack_size = 0 and 1 is the same
     if (cpu->stack_bottom - cpu->stack_size < cpu->stack_roof) {
@@ -317,39 +368,120 @@ int push(struct cpu *cpu)
     if (cpu->stack_size != 0)
         --cpu->stack_top;
 
-    *(cpu->stack_top) = cpu->arithmetic_regs[reg];
+    *(cpu->stack_top) = cpu->arithmetic_regs[op->reg1];
+    snapshot_mark(cpu, cpu->stack_top);
     ++cpu->stack_size;
-    cpu->instruction_index += 2;
+    cpu->instruction_index = op->next;
     return 1;
 }
 
-int pop(struct cpu *cpu)
+int exec_pop(struct cpu *cpu, const struct decoded_op *op)
 {
-    assert(cpu != NULL);
-
-    int32_t *instruction_address = cpu->memory + cpu->instruction_index;
-    int32_t reg = *(instruction_address + 1);
-    if (!check_reg(cpu, reg))
-        return 0;
-
     if (cpu->stack_size == 0) {
         cpu->status = CPU_INVALID_STACK_OPERATION;
         return 0;
     }
 
-    cpu->arithmetic_regs[reg] = *(cpu->stack_top);
+    cpu->arithmetic_regs[op->reg1] = *(cpu->stack_top);
     *(cpu->stack_top) = 0;
+    snapshot_mark(cpu, cpu->stack_top);
     if (cpu->stack_size > 1)
         ++cpu->stack_top;
 
     --cpu->stack_size;
-    cpu->instruction_index += 2;
+    cpu->instruction_index = op->next;
     return 1;
 }
 
+int exec_illegal_instruction(struct cpu *cpu, const struct decoded_op *op)
+{
+    (void) op;
+    cpu->status = CPU_ILLEGAL_INSTRUCTION;
+    return 0;
+}
+
+int exec_illegal_operand(struct cpu *cpu, const struct decoded_op *op)
+{
+    (void) op;
+    cpu->status = CPU_ILLEGAL_OPERAND;
+    return 0;
+}
+
+int exec_dynamic(struct cpu *cpu, const struct decoded_op *op)
+{
+    (void) op;
+    return execute_current(cpu);
+}
+
+int exec_add_dec_loop(struct cpu *cpu, const struct decoded_op *op)
+{
+    const struct decoded_op *dec = cpu->program + op->next;
+    const struct decoded_op *loop = cpu->program + dec->next;
+
+    cpu->arithmetic_regs[REGISTER_A] += cpu->arithmetic_regs[op->reg1];
+    --cpu->arithmetic_regs[dec->reg1];
+    cpu->instruction_index = cpu->arithmetic_regs[REGISTER_C]
+                             ? loop->number : loop->next;
+    return 3;
+}
+
+int exec_dec_loop(struct cpu *cpu, const struct decoded_op *op)
+{
+    const struct decoded_op *loop = cpu->program + op->next;
+
+    --cpu->arithmetic_regs[op->reg1];
+    cpu->instruction_index = cpu->arithmetic_regs[REGISTER_C]
+                             ? loop->number : loop->next;
+    return 2;
+}
+
+int exec_movr_put(struct cpu *cpu, const struct decoded_op *op)
+{
+    /* NUM was checked by cpu_fuse() to be printable by put */
+    cpu->arithmetic_regs[op->reg1] = op->number;
+    cpu->io->write_byte(cpu->io, op->number);
+    cpu->instruction_index = cpu->program[op->next].next;
+    return 2;
+}
+
+int exec_movr_out(struct cpu *cpu, const struct decoded_op *op)
+{
+    cpu->arithmetic_regs[op->reg1] = op->number;
+    cpu->io->write_number(cpu->io, op->number);
+    cpu->instruction_index = cpu->program[op->next].next;
+    return 2;
+}
+
+int exec_movr_movr(struct cpu *cpu, const struct decoded_op *op)
+{
+    const struct decoded_op *second = cpu->program + op->next;
+
+    cpu->arithmetic_regs[op->reg1] = op->number;
+    cpu->arithmetic_regs[second->reg1] = second->number;
+    cpu->instruction_index = second->next;
+    return 2;
+}
+
+int exec_push_pop(struct cpu *cpu, const struct decoded_op *op)
+{
+    if (!exec_push(cpu, op))
+        return 0;
+
+    /* pop can't fail after a successful push */
+    exec_pop(cpu, cpu->program + op->next);
+    return 2;
+}
+
 int (*instructions[19]) (struct cpu *) = {
     &nop, &halt, &add, &sub, &mul,
     &div0, &inc, &dec, &loop, &movr,
     &load, &store, &in, &get, &out,
     &put, &swap, &push, &pop
 };
+
+decoded_handler decoded_instructions[19] = {
+    &exec_nop, &exec_halt, &exec_add, &exec_sub, &exec_mul,
+    &exec_div, &exec_inc, &exec_dec, &exec_loop, &exec_movr,
+    &exec_load, &exec_store, &exec_in, &exec_get, &exec_out,
+    &exec_put, &exec_swap, &exec_push, &exec_pop
+};
@@ -0,0 +1,471 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/io.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <assert.h>
+
+static int stdio_read_number(struct cpu_io *io, int32_t *number)
+{
+    (void) io;
+    return scanf("%" SCNd32, number);
+}
+
+static int stdio_read_byte(struct cpu_io *io)
+{
+    (void) io;
+    return getchar();
+}
+
+static void stdio_write_number(struct cpu_io *io, int32_t number)
+{
+    (void) io;
+    printf("%" PRId32, number);
+}
+
+static void stdio_write_byte(struct cpu_io *io, unsigned char byte)
+{
+    (void) io;
+    putchar(byte);
+}
+
+static void stdio_flush(struct cpu_io *io)
+{
+    (void) io;
+    fflush(stdout);
+}
+
+struct cpu_io cpu_io_stdio = {
+    .read_number = &stdio_read_number,
+    .read_byte = &stdio_read_byte,
+    .write_number = &stdio_write_number,
+    .write_byte = &stdio_write_byte,
+    .flush = &stdio_flush
+};
+
+struct buffered_io {
+    /* must be the first member, struct cpu_io * is cast to buffered_io * */
+    struct cpu_io io;
+
+    int input_fd;
+    int output_fd;
+    bool input_eof;
+
+    size_t input_position;
+    size_t input_length;
+    size_t output_length;
+
+    unsigned char input[IO_BUFFER_SIZE];
+    unsigned char output[IO_BUFFER_SIZE];
+};
+
+static void buffered_flush(struct cpu_io *io)
+{
+    struct buffered_io *buffered = (struct buffered_io *) io;
+
+    size_t written = 0;
+    while (written < buffered->output_length) {
+        ssize_t result = write(buffered->output_fd, buffered->output + written,
+                               buffered->output_length - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        /* output errors are ignored, same as with printf() */
+        if (result <= 0)
+            break;
+        written += result;
+    }
+    buffered->output_length = 0;
+}
+
+/* returns false at the end of input */
+static bool refill(struct buffered_io *buffered)
+{
+    if (buffered->input_eof)
+        return false;
+
+    /* the output may be a prompt for the input we are about to wait for */
+    buffered_flush(&buffered->io);
+
+    ssize_t result;
+    do {
+        result = read(buffered->input_fd, buffered->input, IO_BUFFER_SIZE);
+    } while (result < 0 && errno == EINTR);
+
+    if (result <= 0) {
+        buffered->input_eof = true;
+        return false;
+    }
+    buffered->input_position = 0;
+    buffered->input_length = result;
+    return true;
+}
+
+static inline int peek(struct buffered_io *buffered)
+{
+    if (buffered->input_position == buffered->input_length &&
+        !refill(buffered))
+        return EOF;
+    return buffered->input[buffered->input_position];
+}
+
+static int buffered_read_byte(struct cpu_io *io)
+{
+    struct buffered_io *buffered = (struct buffered_io *) io;
+
+    int byte = peek(buffered);
+    if (byte != EOF)
+        ++buffered->input_position;
+    return byte;
+}
+
+static bool is_space(int c)
+{
+    return c == ' ' || c == '\t' || c == '\n' ||
+           c == '\v' || c == '\f' || c == '\r';
+}
+
+/*
+ * Follows glibc's scanf("%d"): the number is parsed as long (saturated
+ * on overflow) and truncated to 32 bits, an invalid character is left
+ * on the input, a consumed sign is not.
+ */
+static int buffered_read_number(struct cpu_io *io, int32_t *number)
+{
+    struct buffered_io *buffered = (struct buffered_io *) io;
+
+    int c;
+    while (is_space(c = peek(buffered)))
+        ++buffered->input_position;
+    if (c == EOF)
+        return EOF;
+
+    bool negative = false;
+    if (c == '-' || c == '+') {
+        negative = c == '-';
+        ++buffered->input_position;
+        c = peek(buffered);
+    }
+    if (c < '0' || c > '9')
+        return 0;
+
+    /* magnitude of LONG_MIN, LONG_MAX is one less */
+    const unsigned long limit = (unsigned long) LONG_MAX + negative;
+    unsigned long value = 0;
+    bool overflow = false;
+
+    while (c >= '0' && c <= '9') {
+        unsigned digit = c - '0';
+        if (value > (limit - digit) / 10)
+            overflow = true;
+        else
+            value = value * 10 + digit;
+        ++buffered->input_position;
+        c = peek(buffered);
+    }
+    if (overflow)
+        value = limit;
+
+    unsigned long result = negative ? 0UL - value : value;
+    *number = (int32_t) (uint32_t) result;
+    return 1;
+}
+
+static inline void put_byte(struct buffered_io *buffered, unsigned char byte)
+{
+    if (buffered->output_length == IO_BUFFER_SIZE)
+        buffered_flush(&buffered->io);
+    buffered->output[buffered->output_length++] = byte;
+}
+
+static void buffered_write_byte(struct cpu_io *io, unsigned char byte)
+{
+    put_byte((struct buffered_io *) io, byte);
+}
+
+/* "-2147483648" is the longest one */
+#define NUMBER_LENGTH 11
+
+/* writes the number in decimal backwards, returns the count of characters */
+static int format_reversed(int32_t number, char *digits)
+{
+    int count = 0;
+
+    uint32_t value = number < 0 ? 0u - (uint32_t) number : (uint32_t) number;
+    do {
+        digits[count++] = '0' + value % 10;
+        value /= 10;
+    } while (value != 0);
+    if (number < 0)
+        digits[count++] = '-';
+    return count;
+}
+
+static void buffered_write_number(struct cpu_io *io, int32_t number)
+{
+    struct buffered_io *buffered = (struct buffered_io *) io;
+
+    char digits[NUMBER_LENGTH];
+    int count = format_reversed(number, digits);
+
+    if (IO_BUFFER_SIZE - buffered->output_length < (size_t) count)
+        buffered_flush(io);
+    while (count > 0)
+        buffered->output[buffered->output_length++] = digits[--count];
+}
+
+/* the output buffer has to be empty */
+static void attach(struct buffered_io *buffered, int input_fd, int output_fd)
+{
+    buffered->input_fd = input_fd;
+    buffered->output_fd = output_fd;
+    buffered->input_eof = false;
+    buffered->input_position = 0;
+    buffered->input_length = 0;
+}
+
+struct cpu_io *io_create_buffered(int input_fd, int output_fd)
+{
+    struct buffered_io *buffered = malloc(sizeof(struct buffered_io));
+    if (buffered == NULL)
+        return NULL;
+
+    buffered->io.read_number = &buffered_read_number;
+    buffered->io.read_byte = &buffered_read_byte;
+    buffered->io.write_number = &buffered_write_number;
+    buffered->io.write_byte = &buffered_write_byte;
+    buffered->io.flush = &buffered_flush;
+
+    buffered->output_length = 0;
+    attach(buffered, input_fd, output_fd);
+    return &buffered->io;
+}
+
+void io_rebind_buffered(struct cpu_io *io, int input_fd, int output_fd)
+{
+    assert(io != NULL);
+
+    buffered_flush(io);
+    attach((struct buffered_io *) io, input_fd, output_fd);
+}
+
+void io_destroy_buffered(struct cpu_io *io)
+{
+    assert(io != NULL);
+
+    buffered_flush(io);
+    free(io);
+}
+
+struct queue_io {
+    /* must be the first member, struct cpu_io * is cast to queue_io * */
+    struct cpu_io io;
+
+    /* no more input will be pushed */
+    bool closed;
+
+    unsigned char *input;
+    size_t input_position;
+    size_t input_length;
+    size_t input_capacity;
+
+    unsigned char *output;
+    size_t output_length;
+    size_t output_capacity;
+};
+
+/* makes room for `needed` bytes, returns false in case of error */
+static bool reserve(unsigned char **buffer, size_t *capacity, size_t needed)
+{
+    if (needed <= *capacity)
+        return true;
+
+    size_t new_capacity = *capacity > 0 ? *capacity : 256;
+    while (new_capacity < needed) {
+        if (new_capacity > SIZE_MAX / 2)
+            return false;
+        new_capacity *= 2;
+    }
+    unsigned char *temp_p = realloc(*buffer, new_capacity);
+    if (temp_p == NULL)
+        return false;
+    *buffer = temp_p;
+    *capacity = new_capacity;
+    return true;
+}
+
+static int queue_read_byte(struct cpu_io *io)
+{
+    struct queue_io *queue = (struct queue_io *) io;
+
+    if (queue->input_position < queue->input_length)
+        return queue->input[queue->input_position++];
+    return queue->closed ? EOF : CPU_IO_WAIT;
+}
+
+/*
+ * Parses the number as buffered_read_number() does, but only once it is
+ * complete: a number (or the sign, or the spaces) reaching the end of
+ * the pushed input may continue in the next push, nothing is consumed
+ * and CPU_IO_WAIT is returned until then.
+ */
+static int queue_read_number(struct cpu_io *io, int32_t *number)
+{
+    struct queue_io *queue = (struct queue_io *) io;
+    const unsigned char *input = queue->input;
+    const size_t length = queue->input_length;
+
+    size_t i = queue->input_position;
+    while (i < length && is_space(input[i]))
+        ++i;
+    bool sign = i < length && (input[i] == '-' || input[i] == '+');
+    bool negative = sign && input[i] == '-';
+    i += sign;
+    size_t start = i;
+    while (i < length && input[i] >= '0' && input[i] <= '9')
+        ++i;
+
+    if (i == length && !queue->closed)
+        return CPU_IO_WAIT;
+
+    if (i == start) {
+        /* the spaces and the sign are consumed, the rest is not */
+        queue->input_position = i;
+        return i == length && !sign ? EOF : 0;
+    }
+    queue->input_position = i;
+
+    /* magnitude of LONG_MIN, LONG_MAX is one less */
+    const unsigned long limit = (unsigned long) LONG_MAX + negative;
+    unsigned long value = 0;
+    for (size_t digit = start; digit < i; ++digit) {
+        unsigned add = input[digit] - '0';
+        if (value > (limit - add) / 10) {
+            value = limit;
+            break;
+        }
+        value = value * 10 + add;
+    }
+
+    unsigned long result = negative ? 0UL - value : value;
+    *number = (int32_t) (uint32_t) result;
+    return 1;
+}
+
+static void queue_write(struct queue_io *queue, const char *bytes,
+                        size_t length)
+{
+    /* output errors are ignored, same as with printf() */
+    if (!reserve(&queue->output, &queue->output_capacity,
+                 queue->output_length + length))
+        return;
+    memcpy(queue->output + queue->output_length, bytes, length);
+    queue->output_length += length;
+}
+
+static void queue_write_byte(struct cpu_io *io, unsigned char byte)
+{
+    queue_write((struct queue_io *) io, (const char *) &byte, 1);
+}
+
+static void queue_write_number(struct cpu_io *io, int32_t number)
+{
+    char digits[NUMBER_LENGTH];
+    char text[NUMBER_LENGTH];
+    int count = format_reversed(number, digits);
+    for (int i = 0; i < count; ++i)
+        text[i] = digits[count - 1 - i];
+    queue_write((struct queue_io *) io, text, count);
+}
+
+static void queue_flush(struct cpu_io *io)
+{
+    /* the output stays queued until the host takes it */
+    (void) io;
+}
+
+struct cpu_io *io_create_queue(void)
+{
+    struct queue_io *queue = calloc(1, sizeof(struct queue_io));
+    if (queue == NULL)
+        return NULL;
+
+    queue->io.read_number = &queue_read_number;
+    queue->io.read_byte = &queue_read_byte;
+    queue->io.write_number = &queue_write_number;
+    queue->io.write_byte = &queue_write_byte;
+    queue->io.flush = &queue_flush;
+    return &queue->io;
+}
+
+void io_destroy_queue(struct cpu_io *io)
+{
+    assert(io != NULL);
+
+    struct queue_io *queue = (struct queue_io *) io;
+    free(queue->input);
+    free(queue->output);
+    free(queue);
+}
+
+int io_queue_push(struct cpu_io *io, const void *bytes, size_t length)
+{
+    assert(io != NULL);
+    assert(bytes != NULL || length == 0);
+
+    struct queue_io *queue = (struct queue_io *) io;
+    assert(!queue->closed);
+
+    if (length == 0)
+        return 0;
+
+    /* the consumed input is dropped first */
+    size_t unread = queue->input_length - queue->input_position;
+    if (queue->input_position > 0) {
+        memmove(queue->input, queue->input + queue->input_position, unread);
+        queue->input_position = 0;
+        queue->input_length = unread;
+    }
+
+    if (length > SIZE_MAX - unread ||
+        !reserve(&queue->input, &queue->input_capacity, unread + length))
+        return -1;
+    memcpy(queue->input + unread, bytes, length);
+    queue->input_length += length;
+    return 0;
+}
+
+void io_queue_close(struct cpu_io *io)
+{
+    assert(io != NULL);
+
+    ((struct queue_io *) io)->closed = true;
+}
+
+size_t io_queue_output(struct cpu_io *io, const unsigned char **bytes)
+{
+    assert(io != NULL);
+    assert(bytes != NULL);
+
+    struct queue_io *queue = (struct queue_io *) io;
+    *bytes = queue->output;
+    return queue->output_length;
+}
+
+void io_queue_consume(struct cpu_io *io, size_t length)
+{
+    assert(io != NULL);
+
+    struct queue_io *queue = (struct queue_io *) io;
+    assert(length <= queue->output_length);
+
+    if (length == 0)
+        return;
+    queue->output_length -= length;
+    memmove(queue->output, queue->output + length, queue->output_length);
+}
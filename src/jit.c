@@ -0,0 +1,455 @@
+#define _DEFAULT_SOURCE
+
+#include "../include/jit.h"
+#include "../include/cpu.h"
+#include "../include/instructions.h"
+#include "../include/decode.h"
+#include "../include/io.h"
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+/* state passed to the native code (in rdi) */
+struct jit_context {
+    int32_t regs[4];
+    int32_t index;
+};
+
+/*
+ * Native block, `remaining` is the count of instructions which may still
+ * be executed. Returns the new remaining count, instruction_index
+ * to continue with is stored in context->index.
+ */
+typedef int64_t (*jit_block)(struct jit_context *context, int64_t remaining);
+
+struct jit_entry {
+    jit_block code;
+    /* instructions executed by one pass through the block */
+    int32_t length;
+    uint32_t hits;
+    bool failed;
+};
+
+struct jit {
+    uint8_t *buffer;
+    size_t used;
+    struct jit_entry *entries;
+    int32_t size;
+};
+
+/* longest block, longer blocks exit to the interpreter and continue there */
+#define MAX_BLOCK_LENGTH 1024
+
+/*
+ * Register allocation: guest registers A, B, C, D live in r8d - r11d,
+ * rdi holds the context, rsi the remaining count, eax and edx are
+ * scratch registers (required by idiv).
+ */
+enum {
+    RAX = 0,
+    RSI = 6,
+    RDI = 7,
+    R8 = 8
+};
+
+struct emitter {
+    uint8_t *start;
+    uint8_t *position;
+    uint8_t *end;
+    bool overflow;
+};
+
+static void emit8(struct emitter *e, uint8_t byte)
+{
+    if (e->position >= e->end) {
+        e->overflow = true;
+        return;
+    }
+    *e->position++ = byte;
+}
+
+static void emit32(struct emitter *e, int32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        emit8(e, ((uint32_t) value >> (i * 8)) & 0xff);
+}
+
+static uint8_t guest(int32_t reg)
+{
+    return R8 + reg;
+}
+
+/* REX prefix for a register in ModRM.reg and a register in ModRM.rm */
+static void emit_rex(struct emitter *e, bool wide, uint8_t reg, uint8_t rm)
+{
+    uint8_t rex = 0x40 | (wide ? 0x08 : 0) | ((reg >> 3) << 2) | (rm >> 3);
+    if (rex != 0x40)
+        emit8(e, rex);
+}
+
+/* `opcode r/m32, r32` with both operands in registers */
+static void emit_rr(struct emitter *e, uint8_t opcode, uint8_t rm, uint8_t reg)
+{
+    emit_rex(e, false, reg, rm);
+    emit8(e, opcode);
+    emit8(e, 0xc0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* `F7 /extension` or `FF /extension` group instruction on a register */
+static void emit_group(struct emitter *e, uint8_t opcode, uint8_t extension,
+                       uint8_t rm)
+{
+    emit_rex(e, false, 0, rm);
+    emit8(e, opcode);
+    emit8(e, 0xc0 | (extension << 3) | (rm & 7));
+}
+
+/* mov r32, [rdi + offset] (load) or mov [rdi + offset], r32 (store) */
+static void emit_context(struct emitter *e, uint8_t opcode, uint8_t reg,
+                         int8_t offset)
+{
+    emit_rex(e, false, reg, RDI);
+    emit8(e, opcode);
+    emit8(e, 0x40 | ((reg & 7) << 3) | RDI);
+    emit8(e, offset);
+}
+
+/* sub rsi, imm32 (extension 5) or cmp rsi, imm32 (extension 7) */
+static void emit_remaining(struct emitter *e, uint8_t extension, int32_t value)
+{
+    emit8(e, 0x48);
+    emit8(e, 0x81);
+    emit8(e, 0xc0 | (extension << 3) | RSI);
+    emit32(e, value);
+}
+
+/* conditional (0F 8x) jump with rel32 to be patched, returns patch location */
+static uint8_t *emit_jcc(struct emitter *e, uint8_t condition)
+{
+    emit8(e, 0x0f);
+    emit8(e, 0x80 | condition);
+    uint8_t *patch = e->position;
+    emit32(e, 0);
+    return patch;
+}
+
+static void patch_here(struct emitter *e, uint8_t *patch)
+{
+    if (e->overflow)
+        return;
+    int32_t relative = e->position - (patch + 4);
+    memcpy(patch, &relative, sizeof(relative));
+}
+
+enum {
+    CONDITION_EQUAL = 0x4,
+    CONDITION_NOT_EQUAL = 0x5,
+    CONDITION_GREATER_EQUAL = 0xd
+};
+
+/* leaves the block, continuing by `index` after `done` more instructions */
+static void emit_exit(struct emitter *e, int32_t index, int32_t done)
+{
+    if (done > 0)
+        emit_remaining(e, 5, done);
+
+    /* mov dword [rdi + 16], index */
+    emit8(e, 0xc7);
+    emit8(e, 0x40 | RDI);
+    emit8(e, offsetof(struct jit_context, index));
+    emit32(e, index);
+
+    for (int32_t reg = REGISTER_A; reg <= REGISTER_D; ++reg)
+        emit_context(e, 0x89, guest(reg), reg * sizeof(int32_t));
+
+    /* mov rax, rsi; ret */
+    emit8(e, 0x48);
+    emit8(e, 0x89);
+    emit8(e, 0xc0 | (RSI << 3) | RAX);
+    emit8(e, 0xc3);
+}
+
+static void emit_div(struct emitter *e, const struct decoded_op *op,
+                     int32_t index, int32_t done)
+{
+    uint8_t divisor = guest(op->reg1);
+
+    /* test divisor, divisor; jnz; division by zero is left to interpreter */
+    emit_rr(e, 0x85, divisor, divisor);
+    uint8_t *not_zero = emit_jcc(e, CONDITION_NOT_EQUAL);
+    emit_exit(e, index, done);
+    patch_here(e, not_zero);
+
+    /* cmp divisor, -1; jne; neg A (INT32_MIN / -1 wraps around) */
+    emit_rex(e, false, 0, divisor);
+    emit8(e, 0x83);
+    emit8(e, 0xc0 | (7 << 3) | (divisor & 7));
+    emit8(e, 0xff);
+    uint8_t *not_minus_one = emit_jcc(e, CONDITION_NOT_EQUAL);
+    emit_group(e, 0xf7, 3, guest(REGISTER_A));
+    emit8(e, 0xe9);
+    uint8_t *done_patch = e->position;
+    emit32(e, 0);
+    patch_here(e, not_minus_one);
+
+    /* mov eax, A; cdq; idiv divisor; mov A, eax */
+    emit_rr(e, 0x89, RAX, guest(REGISTER_A));
+    emit8(e, 0x99);
+    emit_group(e, 0xf7, 7, divisor);
+    emit_rr(e, 0x89, guest(REGISTER_A), RAX);
+    patch_here(e, done_patch);
+}
+
+static bool compilable(const struct decoded_op *op)
+{
+    /* fused ops are compiled instruction by instruction */
+    if (!decoded_is_valid(op))
+        return false;
+
+    switch (op->opcode) {
+    case 0:     // nop
+    case 2:     // add
+    case 3:     // sub
+    case 4:     // mul
+    case 5:     // div
+    case 6:     // inc
+    case 7:     // dec
+    case 8:     // loop
+    case 9:     // movr
+    case 16:    // swap
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* emits the block starting at `start`, returns its length, 0 if empty */
+static int32_t emit_block(struct emitter *e, const struct decoded_op *program,
+                          int32_t size, int32_t start)
+{
+    for (int32_t reg = REGISTER_A; reg <= REGISTER_D; ++reg)
+        emit_context(e, 0x8b, guest(reg), reg * sizeof(int32_t));
+    uint8_t *top = e->position;
+
+    int32_t index = start;
+    int32_t done = 0;
+
+    while (index >= 0 && index < size && done < MAX_BLOCK_LENGTH &&
+           compilable(program + index)) {
+        const struct decoded_op *op = program + index;
+
+        switch (op->opcode) {
+        case 2:
+            emit_rr(e, 0x01, guest(REGISTER_A), guest(op->reg1));
+            break;
+        case 3:
+            emit_rr(e, 0x29, guest(REGISTER_A), guest(op->reg1));
+            break;
+        case 4:
+            /* imul A, reg (0F AF /r, destination in ModRM.reg) */
+            emit_rex(e, false, guest(REGISTER_A), guest(op->reg1));
+            emit8(e, 0x0f);
+            emit8(e, 0xaf);
+            emit8(e, 0xc0 | ((guest(REGISTER_A) & 7) << 3)
+                     | (guest(op->reg1) & 7));
+            break;
+        case 5:
+            emit_div(e, op, index, done);
+            break;
+        case 6:
+            emit_group(e, 0xff, 0, guest(op->reg1));
+            break;
+        case 7:
+            emit_group(e, 0xff, 1, guest(op->reg1));
+            break;
+        case 9:
+            /* mov reg, imm32 */
+            emit_rex(e, false, 0, guest(op->reg1));
+            emit8(e, 0xb8 | (guest(op->reg1) & 7));
+            emit32(e, op->number);
+            break;
+        case 16:
+            emit_rr(e, 0x87, guest(op->reg1), guest(op->reg2));
+            break;
+        case 8: {
+            int32_t length = done + 1;
+            emit_remaining(e, 5, length);
+
+            /* test C, C; jz not_taken */
+            emit_rr(e, 0x85, guest(REGISTER_C), guest(REGISTER_C));
+            uint8_t *not_taken = emit_jcc(e, CONDITION_EQUAL);
+
+            if (op->number == start) {
+                /* cmp rsi, length; jge top */
+                emit_remaining(e, 7, length);
+                emit8(e, 0x0f);
+                emit8(e, 0x80 | CONDITION_GREATER_EQUAL);
+                emit32(e, top - (e->position + 4));
+            }
+            emit_exit(e, op->number, 0);
+            patch_here(e, not_taken);
+            emit_exit(e, op->next, 0);
+            return length;
+        }
+        default:
+            break;
+        }
+        ++done;
+        index = op->next;
+    }
+
+    if (done > 0)
+        emit_exit(e, index, done);
+    return done;
+}
+
+static void compile(struct jit *jit, const struct decoded_op *program,
+                    int32_t start)
+{
+    struct jit_entry *entry = jit->entries + start;
+    entry->failed = true;
+
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_WRITE) != 0)
+        return;
+
+    struct emitter e = {
+        .start = jit->buffer + jit->used,
+        .position = jit->buffer + jit->used,
+        .end = jit->buffer + JIT_BUFFER_SIZE,
+        .overflow = false
+    };
+    int32_t length = emit_block(&e, program, jit->size, start);
+
+    if (mprotect(jit->buffer, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC) != 0 ||
+        e.overflow || length == 0)
+        return;
+
+    entry->code = (jit_block) (void *) e.start;
+    entry->length = length;
+    entry->failed = false;
+    jit->used = e.position - jit->buffer;
+}
+
+struct jit *jit_create(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    struct jit *jit = calloc(1, sizeof(struct jit));
+    if (jit == NULL)
+        return NULL;
+
+    jit->size = cpu->program_size;
+    jit->entries = calloc(jit->size > 0 ? jit->size : 1,
+                          sizeof(struct jit_entry));
+    if (jit->entries == NULL) {
+        free(jit);
+        return NULL;
+    }
+
+    jit->buffer = mmap(NULL, JIT_BUFFER_SIZE, PROT_READ | PROT_EXEC,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (jit->buffer == MAP_FAILED) {
+        free(jit->entries);
+        free(jit);
+        return NULL;
+    }
+    return jit;
+}
+
+void jit_destroy(struct jit *jit)
+{
+    if (jit == NULL)
+        return;
+
+    munmap(jit->buffer, JIT_BUFFER_SIZE);
+    free(jit->entries);
+    free(jit);
+}
+
+long long cpu_run_jit(struct cpu *cpu, size_t steps)
+{
+    assert(cpu != NULL);
+
+    if (cpu->status != CPU_OK)
+        return 0;
+
+    if (cpu->jit == NULL) {
+        cpu->jit = jit_create(cpu);
+        if (cpu->jit == NULL)
+            return cpu_run(cpu, steps);
+    }
+    struct jit *jit = cpu->jit;
+    const struct decoded_op *program = cpu->program;
+    const uint32_t size = (uint32_t) cpu->program_size;
+
+    size_t executed = 0;
+    while (executed < steps) {
+        uint32_t index = (uint32_t) cpu->instruction_index;
+        if (index >= size) {
+            cpu->status = CPU_INVALID_ADDRESS;
+            cpu->io->flush(cpu->io);
+            return -(long long) (executed + 1);
+        }
+
+        struct jit_entry *entry = jit->entries + index;
+        size_t left = steps - executed;
+        if (entry->code != NULL && left >= (size_t) entry->length) {
+            int64_t budget = left > INT64_MAX ? INT64_MAX : (int64_t) left;
+            struct jit_context context;
+            memcpy(context.regs, cpu->arithmetic_regs, sizeof(context.regs));
+            int64_t remaining = entry->code(&context, budget);
+            memcpy(cpu->arithmetic_regs, context.regs, sizeof(context.regs));
+            cpu->instruction_index = context.index;
+            executed += budget - remaining;
+
+            /* the block exited right away (e.g. div by zero), interpret it */
+            if (remaining != budget)
+                continue;
+        }
+
+        const struct decoded_op *op = program + cpu->instruction_index;
+        ++executed;
+        if (!execute_single(cpu, op)) {
+            cpu->io->flush(cpu->io);
+            return cpu->status == CPU_HALTED ? (long long) executed
+                                             : -(long long) executed;
+        }
+
+        /* count taken loops, their targets are the hot block entries */
+        if (op->opcode == 8 && cpu->instruction_index == op->number &&
+            (uint32_t) op->number < size && decoded_is_valid(op)) {
+            struct jit_entry *target = jit->entries + op->number;
+            if (target->code == NULL && !target->failed &&
+                ++target->hits >= JIT_THRESHOLD)
+                compile(jit, program, op->number);
+        }
+    }
+    return executed;
+}
+
+#else
+
+struct jit *jit_create(struct cpu *cpu)
+{
+    (void) cpu;
+    return NULL;
+}
+
+void jit_destroy(struct jit *jit)
+{
+    (void) jit;
+}
+
+long long cpu_run_jit(struct cpu *cpu, size_t steps)
+{
+    return cpu_run(cpu, steps);
+}
+
+#endif  // __x86_64__ && __linux__
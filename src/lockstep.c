@@ -0,0 +1,483 @@
+#include "../include/lockstep.h"
+#include "../include/instructions.h"
+#include "../include/decode.h"
+#include "../include/io.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+/* smaller groups are finished by cpu_run(), the vectors would be idle */
+#define LOCKSTEP_MIN_LANES 4
+
+/* count of instructions run by one lockstep_run() of lockstep_batch() */
+#define LOCKSTEP_CHUNK (1024 * 1024)
+
+/* the hot loop is compiled for AVX2 too, the better one is picked at load */
+#if defined(__GNUC__) && defined(__x86_64__) && defined(__linux__)
+#define VECTOR_CLONES __attribute__((target_clones("avx2", "default")))
+#else
+#define VECTOR_CLONES
+#endif
+
+/* cpus at the same instruction index, lanes [0, lanes) are in use */
+struct group {
+    size_t lanes;
+    /* position of the cpu of each lane in the arrays of lockstep_run() */
+    size_t ids[LOCKSTEP_LANES];
+    int32_t regs[4][LOCKSTEP_LANES];
+    int32_t index;
+    /* count of instructions executed by every lane of the group */
+    size_t executed;
+};
+
+struct lockstep {
+    struct cpu **cpus;
+    long long *executed;
+    size_t steps;
+    const struct decoded_op *program;
+    uint32_t size;
+
+    /* groups waiting to run, there can't be more groups than lanes */
+    struct group *pending;
+    size_t pending_count;
+};
+
+static void store_lane(struct lockstep *state, const struct group *group,
+                       size_t lane)
+{
+    struct cpu *cpu = state->cpus[group->ids[lane]];
+    for (int reg = 0; reg < 4; ++reg)
+        cpu->arithmetic_regs[reg] = group->regs[reg][lane];
+    cpu->instruction_index = group->index;
+}
+
+static void load_lane(struct lockstep *state, struct group *group,
+                      size_t lane)
+{
+    const struct cpu *cpu = state->cpus[group->ids[lane]];
+    for (int reg = 0; reg < 4; ++reg)
+        group->regs[reg][lane] = cpu->arithmetic_regs[reg];
+}
+
+/* the lane was stopped by its current instruction, the cpu is up to date */
+static void stop_lane(struct lockstep *state, const struct group *group,
+                      size_t lane)
+{
+    struct cpu *cpu = state->cpus[group->ids[lane]];
+    cpu->io->flush(cpu->io);
+    long long total = group->executed + 1;
+    state->executed[group->ids[lane]] = cpu->status == CPU_HALTED ? total
+                                                                  : -total;
+}
+
+/* runs the rest of the steps of the lane by cpu_run() */
+static void finish_lane(struct lockstep *state, const struct group *group,
+                        size_t lane)
+{
+    struct cpu *cpu = state->cpus[group->ids[lane]];
+    store_lane(state, group, lane);
+
+    long long result = 0;
+    if (group->executed < state->steps)
+        result = cpu_run(cpu, state->steps - group->executed);
+    long long total = group->executed + (result < 0 ? -result : result);
+    state->executed[group->ids[lane]] = result < 0 ? -total : total;
+}
+
+/*
+ * Moves lanes with `moved` set to a new pending group continuing at `index`
+ * (if `index` is not negative, the lanes are dropped otherwise), the other
+ * lanes are compacted to the front.
+ */
+static void split(struct lockstep *state, struct group *group,
+                  const unsigned char *moved, int64_t index)
+{
+    struct group *other = NULL;
+    if (index >= 0) {
+        other = &state->pending[state->pending_count++];
+        other->lanes = 0;
+        other->index = (int32_t) index;
+        other->executed = group->executed;
+    }
+
+    size_t kept = 0;
+    for (size_t lane = 0; lane < group->lanes; ++lane) {
+        struct group *target = moved[lane] ? other : group;
+        if (target == NULL)
+            continue;
+        size_t to = target == group ? kept++ : target->lanes++;
+        target->ids[to] = group->ids[lane];
+        for (int reg = 0; reg < 4; ++reg)
+            target->regs[reg][to] = group->regs[reg][lane];
+    }
+    group->lanes = kept;
+}
+
+/*
+ * Executes the instruction lane by lane with its handler, lanes which stop
+ * are dropped, lanes which continue elsewhere than the first one form
+ * a new group.
+ */
+static void step_lanes(struct lockstep *state, struct group *group,
+                       const struct decoded_op *op)
+{
+    unsigned char stopped[LOCKSTEP_LANES] = { 0 };
+    unsigned char elsewhere[LOCKSTEP_LANES];
+    int64_t next = -1;
+    bool diverged = false;
+
+    for (size_t lane = 0; lane < group->lanes; ++lane) {
+        struct cpu *cpu = state->cpus[group->ids[lane]];
+        store_lane(state, group, lane);
+        stopped[lane] = !execute_single(cpu, op);
+        if (stopped[lane]) {
+            stop_lane(state, group, lane);
+            continue;
+        }
+        load_lane(state, group, lane);
+        if (next < 0)
+            next = cpu->instruction_index;
+        else if (cpu->instruction_index != next)
+            diverged = true;
+    }
+
+    split(state, group, stopped, -1);
+    group->index = (int32_t) next;
+    ++group->executed;
+    /* rare (ops fetched at run time), every other index gets a group */
+    while (diverged) {
+        diverged = false;
+        int64_t index = -1;
+        size_t lane = 0;
+        for (; lane < group->lanes; ++lane) {
+            int32_t at = state->cpus[group->ids[lane]]->instruction_index;
+            elsewhere[lane] = at != next && (index < 0 || at == index);
+            if (elsewhere[lane])
+                index = at;
+            else if (at != next)
+                diverged = true;
+        }
+        if (index >= 0)
+            split(state, group, elsewhere, index);
+    }
+}
+
+static void divide(struct lockstep *state, struct group *group,
+                   const struct decoded_op *op)
+{
+    int32_t *a = group->regs[REGISTER_A];
+    const int32_t *divisor = group->regs[op->reg1];
+    unsigned char stopped[LOCKSTEP_LANES] = { 0 };
+    bool any = false;
+
+    for (size_t lane = 0; lane < group->lanes; ++lane) {
+        stopped[lane] = divisor[lane] == 0;
+        if (stopped[lane]) {
+            any = true;
+            store_lane(state, group, lane);
+            state->cpus[group->ids[lane]]->status = CPU_DIV_BY_ZERO;
+            stop_lane(state, group, lane);
+        } else if (divisor[lane] == -1) {
+            /* INT32_MIN / -1 wraps around, see exec_div() */
+            a[lane] = (int32_t) (0u - (uint32_t) a[lane]);
+        } else {
+            a[lane] /= divisor[lane];
+        }
+    }
+    if (any)
+        split(state, group, stopped, -1);
+    group->index = op->next;
+    ++group->executed;
+}
+
+/* `loop`, lanes which don't follow the majority form a new group */
+static void branch(struct lockstep *state, struct group *group,
+                   const struct decoded_op *op)
+{
+    const int32_t *c = group->regs[REGISTER_C];
+    unsigned char taken[LOCKSTEP_LANES];
+    size_t count = 0;
+
+    for (size_t lane = 0; lane < LOCKSTEP_LANES; ++lane) {
+        taken[lane] = c[lane] != 0;
+        count += lane < group->lanes && taken[lane];
+    }
+
+    ++group->executed;
+    if (count == group->lanes) {
+        group->index = op->number;
+        return;
+    }
+    if (count == 0) {
+        group->index = op->next;
+        return;
+    }
+
+    bool stay = 2 * count >= group->lanes;
+    if (!stay) {
+        for (size_t lane = 0; lane < group->lanes; ++lane)
+            taken[lane] = !taken[lane];
+    }
+    /* `taken` now marks the lanes following the majority */
+    unsigned char moved[LOCKSTEP_LANES];
+    for (size_t lane = 0; lane < group->lanes; ++lane)
+        moved[lane] = !taken[lane];
+    split(state, group, moved, stay ? op->next : op->number);
+    group->index = stay ? op->number : op->next;
+}
+
+/*
+ * Register instructions run for all LOCKSTEP_LANES lanes, lanes not in use
+ * compute garbage which is never stored, so the loops have a constant
+ * count and are vectorized. The source register is copied first, then
+ * the compiler knows it doesn't overlap the destination (it may be the same
+ * register) and needs no checks. Unsigned arithmetic wraps around like
+ * the scalar instructions do.
+ */
+VECTOR_CLONES
+static void run_group(struct lockstep *state, struct group *group)
+{
+    while (group->lanes > 0) {
+        if (group->lanes < LOCKSTEP_MIN_LANES ||
+            group->executed >= state->steps) {
+            for (size_t lane = 0; lane < group->lanes; ++lane)
+                finish_lane(state, group, lane);
+            return;
+        }
+
+        if ((uint32_t) group->index >= state->size) {
+            for (size_t lane = 0; lane < group->lanes; ++lane) {
+                store_lane(state, group, lane);
+                state->cpus[group->ids[lane]]->status = CPU_INVALID_ADDRESS;
+                stop_lane(state, group, lane);
+            }
+            return;
+        }
+
+        const struct decoded_op *op = state->program + group->index;
+        if (!decoded_is_valid(op)) {
+            step_lanes(state, group, op);
+            continue;
+        }
+
+        uint32_t *a = (uint32_t *) group->regs[REGISTER_A];
+        uint32_t *r = (uint32_t *) group->regs[op->reg1];
+        uint32_t *s = (uint32_t *) group->regs[op->reg2];
+        uint32_t number = (uint32_t) op->number;
+        uint32_t source[LOCKSTEP_LANES];
+
+        switch (op->opcode) {
+        case 0:
+            break;
+        case 1:
+            for (size_t lane = 0; lane < group->lanes; ++lane) {
+                store_lane(state, group, lane);
+                struct cpu *cpu = state->cpus[group->ids[lane]];
+                cpu->status = CPU_HALTED;
+                cpu->instruction_index = op->next;
+                stop_lane(state, group, lane);
+            }
+            return;
+        case 2:
+            memcpy(source, r, sizeof(source));
+            for (size_t lane = 0; lane < LOCKSTEP_LANES; ++lane)
+                a[lane] += source[lane];
+            break;
+        case 3:
+            memcpy(source, r, sizeof(source));
+            for (size_t lane = 0; lane < LOCKSTEP_LANES; ++lane)
+                a[lane] -= source[lane];
+            break;
+        case 4:
+            memcpy(source, r, sizeof(source));
+            for (size_t lane = 0; lane < LOCKSTEP_LANES; ++lane)
+                a[lane] *= source[lane];
+            break;
+        case 5:
+            divide(state, group, op);
+            continue;
+        case 6:
+            for (size_t lane = 0; lane < LOCKSTEP_LANES; ++lane)
+                ++r[lane];
+            break;
+        case 7:
+            for (size_t lane = 0; lane < LOCKSTEP_LANES; ++lane)
+                --r[lane];
+            break;
+        case 8:
+            branch(state, group, op);
+            continue;
+        case 9:
+            for (size_t lane = 0; lane < LOCKSTEP_LANES; ++lane)
+                r[lane] = number;
+            break;
+        case 16:
+            if (r != s) {
+                memcpy(source, r, sizeof(source));
+                memcpy(r, s, sizeof(source));
+                memcpy(s, source, sizeof(source));
+            }
+            break;
+        default:
+            /* stack and I/O of each lane */
+            step_lanes(state, group, op);
+            continue;
+        }
+        group->index = op->next;
+        ++group->executed;
+    }
+}
+
+void lockstep_run(struct cpu **cpus, size_t count, size_t steps,
+                  long long *executed)
+{
+    assert(cpus != NULL || count == 0);
+    assert(executed != NULL || count == 0);
+    assert(count <= LOCKSTEP_LANES);
+
+    if (count == 0)
+        return;
+
+    struct lockstep state = {
+        .cpus = cpus,
+        .executed = executed,
+        .steps = steps,
+        .program = cpus[0]->program,
+        .size = (uint32_t) cpus[0]->program_size,
+        .pending = malloc(LOCKSTEP_LANES * sizeof(struct group)),
+        .pending_count = 0
+    };
+
+    /* cpus of one program at the same index start in one group */
+    unsigned char grouped[LOCKSTEP_LANES] = { 0 };
+    for (size_t i = 0; i < count; ++i) {
+        if (cpus[i]->status != CPU_OK) {
+            executed[i] = 0;
+            grouped[i] = 1;
+        }
+    }
+    for (size_t first = 0; first < count; ++first) {
+        if (grouped[first])
+            continue;
+        if (state.pending == NULL || cpus[first]->program != state.program) {
+            executed[first] = cpu_run(cpus[first], steps);
+            continue;
+        }
+
+        struct group *group = &state.pending[state.pending_count++];
+        group->lanes = 0;
+        group->index = cpus[first]->instruction_index;
+        group->executed = 0;
+        for (size_t i = first; i < count; ++i) {
+            if (grouped[i] || cpus[i]->program != state.program ||
+                cpus[i]->instruction_index != group->index)
+                continue;
+            grouped[i] = 1;
+            group->ids[group->lanes] = i;
+            load_lane(&state, group, group->lanes++);
+        }
+    }
+
+    while (state.pending_count > 0) {
+        struct group group = state.pending[--state.pending_count];
+        run_group(&state, &group);
+    }
+    free(state.pending);
+}
+
+/* cpu and I/O of each lane, reused by the following jobs */
+struct lane {
+    struct cpu *cpu;
+    struct cpu_io *io;
+};
+
+static void release_lane(struct lane *lane)
+{
+    if (lane->cpu != NULL) {
+        cpu_destroy(lane->cpu);
+        free(lane->cpu);
+    }
+    if (lane->io != NULL)
+        io_destroy_buffered(lane->io);
+    lane->cpu = NULL;
+    lane->io = NULL;
+}
+
+static bool prepare_lane(struct lane *lane, const struct batch_job *job,
+                         const struct cpu *program)
+{
+    if (lane->cpu != NULL && program == job->program) {
+        io_rebind_buffered(lane->io, job->input_fd, job->output_fd);
+        cpu_restart(lane->cpu, lane->io);
+        return true;
+    }
+
+    release_lane(lane);
+    lane->cpu = cpu_clone(job->program);
+    lane->io = io_create_buffered(job->input_fd, job->output_fd);
+    if (lane->cpu == NULL || lane->io == NULL) {
+        release_lane(lane);
+        return false;
+    }
+    cpu_set_io(lane->cpu, lane->io);
+    return true;
+}
+
+void lockstep_batch(struct batch_job *jobs, size_t count)
+{
+    assert(jobs != NULL || count == 0);
+
+    struct lane lanes[LOCKSTEP_LANES] = { { NULL, NULL } };
+    const struct cpu *program = NULL;
+
+    size_t first = 0;
+    while (first < count) {
+        /* the following jobs running the same program */
+        size_t end = first + 1;
+        while (end < count && end - first < LOCKSTEP_LANES &&
+               jobs[end].program == jobs[first].program)
+            ++end;
+
+        struct cpu *cpus[LOCKSTEP_LANES];
+        struct batch_job *running[LOCKSTEP_LANES];
+        long long totals[LOCKSTEP_LANES];
+        size_t used = 0;
+        for (size_t i = first; i < end; ++i) {
+            jobs[i].executed = -1;
+            jobs[i].status = CPU_OK;
+            if (!prepare_lane(&lanes[used], &jobs[i], program))
+                continue;
+            cpus[used] = lanes[used].cpu;
+            running[used] = &jobs[i];
+            totals[used++] = 0;
+        }
+        program = jobs[first].program;
+        /* lanes which failed to prepare have no cpu, nothing to reuse */
+        for (size_t i = used; i < LOCKSTEP_LANES; ++i)
+            release_lane(&lanes[i]);
+
+        bool running_any = used > 0;
+        while (running_any) {
+            long long executed[LOCKSTEP_LANES];
+            lockstep_run(cpus, used, LOCKSTEP_CHUNK, executed);
+            running_any = false;
+            for (size_t i = 0; i < used; ++i) {
+                totals[i] += executed[i] < 0 ? -executed[i] : executed[i];
+                running_any |= cpu_get_status(cpus[i]) == CPU_OK;
+            }
+        }
+
+        for (size_t i = 0; i < used; ++i) {
+            /* the output has to be written before the job is reported */
+            lanes[i].io->flush(lanes[i].io);
+            running[i]->status = cpu_get_status(cpus[i]);
+            running[i]->executed = totals[i];
+        }
+        first = end;
+    }
+
+    for (size_t i = 0; i < LOCKSTEP_LANES; ++i)
+        release_lane(&lanes[i]);
+}
@@ -1,15 +1,60 @@
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
+#include <stdbool.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "../include/cpu.h"
+#include "../include/decode.h"
+#include "../include/io.h"
+#include "../include/batch.h"
+#include "../include/lockstep.h"
+#include "../include/profile.h"
+#include "../include/trace.h"
+#include "../include/replay.h"
+#include "../include/debug.h"
+#include "../include/gdbstub.h"
+#include "../include/asm.h"
 
 enum run_mode {
     RUN,
-    TRACE
+    TRACE,
+    THREADED,
+    JIT,
+    GUARDED,
+    NGRAMS,
+    PROFILE,
+    TRACE_WRITE,
+    RECORD,
+    REPLAY,
+    DEBUG,
+    GDB
 };
 
+/* count of the most frequent n-grams printed by `ngrams` mode */
+#define NGRAMS_TOP 10
+
+/* file the JSON profile is written to, unless CPU32_PROFILE_JSON is set */
+#define PROFILE_JSON "cpu32_profile.json"
+
+/* file the binary trace is written to, unless CPU32_TRACE is set */
+#define TRACE_FILE "cpu32.trace"
+
+/* file the input is recorded to and replayed, unless CPU32_REPLAY is set */
+#define REPLAY_FILE "cpu32.replay"
+
+/* instructions between checkpoints of `debug`, doubled as the run grows */
+#define DEBUG_INTERVAL (64 * 1024)
+
+/* count of jobs of `batch` and `lockstep` whose input and output are open */
+#define BATCH_WINDOW 256
+
+typedef long long (*run_engine)(struct cpu *cpu, size_t steps);
+
 static void print_status(enum cpu_status status)
 {
     switch (status)
@@ -38,17 +83,23 @@ static void print_status(enum cpu_status status)
     case CPU_IO_ERROR:
         puts("cpu status: CPU_IO_ERROR");
         break;
+    case CPU_WAITING_INPUT:
+        puts("cpu status: WAITING_INPUT");
+        break;
+    case CPU_BREAKPOINT:
+        puts("cpu status: BREAKPOINT");
+        break;
     default:
         puts("undefined cpu status");
         break;
     }
 }
 
-static int run(struct cpu *cpu)
+static int run(struct cpu *cpu, run_engine engine)
 {
     long long executed = 5000;
     while (executed == 5000 && cpu_get_status(cpu) == CPU_OK) {
-        executed = cpu_run(cpu, executed);
+        executed = engine(cpu, executed);
     }
     enum cpu_status status = cpu_get_status(cpu);
     cpu_destroy(cpu);
@@ -57,17 +108,33 @@ static int run(struct cpu *cpu)
     return status == CPU_HALTED ? 0 : -1;
 }
 
-static void print_cpu_info(struct cpu *cpu)
+static void print_state(const struct trace_state *state)
 {
     printf(
         "A: %d, B: %d, C: %d, D: %d\n",
-        cpu_get_register(cpu, REGISTER_A),
-        cpu_get_register(cpu, REGISTER_B),
-        cpu_get_register(cpu, REGISTER_C),
-        cpu_get_register(cpu, REGISTER_D)
+        state->arithmetic_regs[REGISTER_A],
+        state->arithmetic_regs[REGISTER_B],
+        state->arithmetic_regs[REGISTER_C],
+        state->arithmetic_regs[REGISTER_D]
     );
-    printf("stack size: %d\n", cpu_get_stack_size(cpu));
-    print_status(cpu_get_status(cpu));
+    printf("stack size: %d\n", state->stack_size);
+    print_status(state->status);
+}
+
+static void print_cpu_info(struct cpu *cpu)
+{
+    struct trace_state state = {
+        .instruction_index = cpu->instruction_index,
+        .arithmetic_regs = {
+            cpu_get_register(cpu, REGISTER_A),
+            cpu_get_register(cpu, REGISTER_B),
+            cpu_get_register(cpu, REGISTER_C),
+            cpu_get_register(cpu, REGISTER_D)
+        },
+        .stack_size = cpu_get_stack_size(cpu),
+        .status = cpu_get_status(cpu)
+    };
+    print_state(&state);
 }
 
 static int trace(struct cpu *cpu)
@@ -84,9 +151,88 @@ static int trace(struct cpu *cpu)
     return status == CPU_HALTED ? 0 : -1;
 }
 
+static unsigned long long bigrams[19][19];
+static unsigned long long trigrams[19][19][19];
+
+/* prints the NGRAMS_TOP most frequent n-grams from counts of length 19^n */
+static void print_ngrams(const unsigned long long *counts, int n)
+{
+    size_t total = 1;
+    for (int i = 0; i < n; ++i)
+        total *= 19;
+
+    printf("top %d opcode %s:\n", NGRAMS_TOP, n == 2 ? "bigrams" : "trigrams");
+    unsigned long long previous = ~0ULL;
+    size_t previous_index = 0;
+
+    for (int top = 0; top < NGRAMS_TOP; ++top) {
+        /* select the next highest count (ties in index order) */
+        size_t best = total;
+        for (size_t i = 0; i < total; ++i) {
+            if (counts[i] == 0 || counts[i] > previous ||
+                (counts[i] == previous && i <= previous_index))
+                continue;
+            if (best == total || counts[i] > counts[best])
+                best = i;
+        }
+        if (best == total)
+            break;
+
+        printf("%12llu ", counts[best]);
+        for (int i = n - 1; i >= 0; --i) {
+            size_t opcode = best;
+            for (int j = 0; j < i; ++j)
+                opcode /= 19;
+            printf(" %s", instruction_names[opcode % 19]);
+        }
+        putchar('\n');
+        previous = counts[best];
+        previous_index = best;
+    }
+}
+
+/*
+ * Runs the program and counts sequences of 2 and 3 executed instructions,
+ * used to choose instruction sequences for fusion (see cpu_fuse()).
+ */
+static int ngrams(struct cpu *cpu)
+{
+    int32_t first = -1;
+    int32_t second = -1;
+
+    while (cpu_get_status(cpu) == CPU_OK) {
+        int32_t opcode = cpu_get_opcode(cpu);
+        if (!cpu_step(cpu) && cpu_get_status(cpu) != CPU_HALTED)
+            opcode = -1;
+
+        if (opcode >= 0 && second >= 0) {
+            ++bigrams[second][opcode];
+            if (first >= 0)
+                ++trigrams[first][second][opcode];
+        }
+        first = second;
+        second = opcode;
+    }
+
+    enum cpu_status status = cpu_get_status(cpu);
+    cpu_destroy(cpu);
+    free(cpu); cpu = NULL;
+    print_status(status);
+    print_ngrams(&bigrams[0][0], 2);
+    print_ngrams(&trigrams[0][0][0], 3);
+    return status == CPU_HALTED ? 0 : -1;
+}
+
 static inline void usage(void)
 {
-    puts("Usage: ./build/cpu32 (run|trace) [stack_capacity] FILE");
+    puts("Usage: ./build/cpu32 (run|trace|threaded|jit|guarded|ngrams|profile|"
+         "trace-write|record|replay|debug|gdb) [stack_capacity] FILE");
+    puts("       ./build/cpu32 trace-dump TRACE");
+    puts("       ./build/cpu32 asm SOURCE OUTPUT");
+    puts("       ./build/cpu32 disasm FILE");
+    puts("       ./build/cpu32 batch [stack_capacity] FILE INPUT...");
+    puts("       ./build/cpu32 batch [stack_capacity] --programs FILE...");
+    puts("       ./build/cpu32 lockstep [stack_capacity] FILE INPUT...");
 }
 
 static inline void file_error(const char *file)
@@ -104,8 +250,747 @@ static inline void insufficient_memory(void)
     puts("Insufficient memory for allocation.");
 }
 
+/*
+ * Runs the program like `run` and writes the binary trace (see trace.h),
+ * `trace-dump` prints it as `trace` would.
+ */
+static int trace_write(struct cpu *cpu, int fd)
+{
+    struct trace_writer *writer = trace_create(cpu, fd);
+    if (!writer) {
+        cpu_destroy(cpu);
+        free(cpu); cpu = NULL;
+        insufficient_memory();
+        return -1;
+    }
+
+    long long executed = 5000;
+    while (executed == 5000 && cpu_get_status(cpu) == CPU_OK) {
+        executed = trace_run(writer, cpu, executed);
+    }
+    int written = trace_close(writer, cpu);
+
+    enum cpu_status status = cpu_get_status(cpu);
+    cpu_destroy(cpu);
+    free(cpu); cpu = NULL;
+    print_status(status);
+    if (written != 0)
+        puts("Could not write the trace.");
+    return status == CPU_HALTED && written == 0 ? 0 : -1;
+}
+
+static int trace_dump(const char *file_name)
+{
+    FILE *file = fopen(file_name, "rb");
+    if (!file) {
+        file_error(file_name);
+        return -1;
+    }
+
+    struct trace_state state;
+    struct trace_reader *reader = trace_open(file, &state);
+    if (!reader) {
+        fclose(file);
+        printf("Not a trace: %s\n", file_name);
+        return -1;
+    }
+
+    const unsigned char *output;
+    size_t length;
+    print_state(&state);
+    while (trace_next(reader, &state, &output, &length)) {
+        fwrite(output, 1, length, stdout);
+        print_state(&state);
+    }
+
+    trace_reader_destroy(reader);
+    fclose(file);
+    return state.status == CPU_HALTED ? 0 : -1;
+}
+
+/*
+ * Runs the program like `run` and records its input (see replay.h).
+ */
+static int record(struct cpu *cpu, int fd)
+{
+    struct replay_recorder *recorder = replay_record(cpu, fd);
+    if (!recorder) {
+        cpu_destroy(cpu);
+        free(cpu); cpu = NULL;
+        insufficient_memory();
+        return -1;
+    }
+
+    long long executed = 5000;
+    while (executed == 5000 && cpu_get_status(cpu) == CPU_OK) {
+        executed = cpu_run(cpu, executed);
+    }
+    int written = replay_record_close(recorder, cpu);
+
+    enum cpu_status status = cpu_get_status(cpu);
+    cpu_destroy(cpu);
+    free(cpu); cpu = NULL;
+    print_status(status);
+    if (written != 0)
+        puts("Could not write the log.");
+    return status == CPU_HALTED && written == 0 ? 0 : -1;
+}
+
+/*
+ * Runs the program again with the recorded input, the output and status
+ * are printed as `record` printed them. If CPU32_REPLAY_STEP is set,
+ * the replay then goes back to the state after that many instructions
+ * and prints it.
+ */
+static int replay(struct cpu *cpu, int fd)
+{
+    struct replay *replay = replay_open(cpu, fd, 0, 0);
+    if (!replay) {
+        cpu_destroy(cpu);
+        free(cpu); cpu = NULL;
+        puts("Not a replay log.");
+        return -1;
+    }
+
+    long long executed = 5000;
+    while (executed == 5000 && cpu_get_status(cpu) == CPU_OK) {
+        executed = replay_run(replay, executed);
+    }
+    enum cpu_status status = cpu_get_status(cpu);
+    print_status(status);
+    if (replay_diverged(replay))
+        puts("The log belongs to another program or input.");
+
+    const char *step = getenv("CPU32_REPLAY_STEP");
+    if (step) {
+        if (replay_seek(replay, strtoull(step, NULL, 10)) == 0) {
+            printf("after %s instructions:\n", step);
+            print_cpu_info(cpu);
+        } else {
+            printf("The program stops before instruction %s.\n", step);
+        }
+    }
+
+    replay_close(replay);
+    cpu_destroy(cpu);
+    free(cpu); cpu = NULL;
+    return status == CPU_HALTED ? 0 : -1;
+}
+
+static void debug_help(void)
+{
+    puts("step [N]           execute N instructions (s)");
+    puts("continue           run to a breakpoint, watchpoint or stop (c)");
+    puts("reverse-step [N]   go N instructions back (rs)");
+    puts("reverse-continue   go back to a breakpoint, watchpoint or the start "
+         "(rc)");
+    puts("goto STEP          go to the state after STEP instructions");
+    puts("break INDEX        set a breakpoint at the instruction index (b)");
+    puts("delete INDEX       remove the breakpoint (d)");
+    puts("watch A|B|C|D      stop when the register changes (w)");
+    puts("watch CELL         stop when the stack cell changes (0 is "
+         "the bottom)");
+    puts("unwatch N          remove the watchpoint");
+    puts("info               print the state (i)");
+    puts("quit               (q)");
+}
+
+static void print_event(struct debugger *debugger, struct cpu *cpu,
+                        enum debug_event event)
+{
+    /* the output of the program is written straight to the descriptor */
+    cpu->io->flush(cpu->io);
+    switch (event) {
+    case DEBUG_BREAKPOINT:
+        puts("breakpoint");
+        break;
+    case DEBUG_WATCHPOINT:
+        printf("watchpoint %d\n", debugger_hit(debugger));
+        break;
+    case DEBUG_STOPPED:
+        puts("the program stopped");
+        break;
+    case DEBUG_START:
+        puts("at the start");
+        break;
+    case DEBUG_ERROR:
+        insufficient_memory();
+        break;
+    default:
+        break;
+    }
+    printf("step %llu, index %d\n",
+           (unsigned long long) debugger_position(debugger),
+           cpu->instruction_index);
+    print_cpu_info(cpu);
+}
+
+/*
+ * Debugs the recorded run interactively, commands are read from stdin
+ * (see debug_help()). CPU32_DEBUG_MEMORY limits the memory of checkpoints
+ * in MiB.
+ */
+static int debug(struct cpu *cpu, int fd)
+{
+    const char *memory = getenv("CPU32_DEBUG_MEMORY");
+    size_t budget = memory ? strtoull(memory, NULL, 10) * 1024 * 1024 : 0;
+    struct replay *replay = replay_open(cpu, fd, DEBUG_INTERVAL, budget);
+    if (!replay) {
+        cpu_destroy(cpu);
+        free(cpu); cpu = NULL;
+        puts("Not a replay log.");
+        return -1;
+    }
+    struct debugger *debugger = debugger_create(cpu, replay);
+    if (!debugger) {
+        replay_close(replay);
+        cpu_destroy(cpu);
+        free(cpu); cpu = NULL;
+        insufficient_memory();
+        return -1;
+    }
+
+    char line[256];
+    print_event(debugger, cpu, DEBUG_STEPPED);
+    while (fputs("(cpu32) ", stdout), fflush(stdout),
+           fgets(line, sizeof(line), stdin)) {
+        char command[32];
+        char argument[32] = "";
+        if (sscanf(line, "%31s %31s", command, argument) < 1)
+            continue;
+        char *end;
+        long long number = strtoll(argument, &end, 10);
+        bool has_number = *argument != '\0' && *end == '\0';
+        /* the count of steps is optional */
+        bool has_count = has_number || !*argument;
+        if (!*argument)
+            number = 1;
+
+        if (strcmp(command, "q") == 0 || strcmp(command, "quit") == 0) {
+            break;
+        } else if ((strcmp(command, "s") == 0 ||
+                    strcmp(command, "step") == 0) &&
+                   has_count && number >= 0) {
+            print_event(debugger, cpu, debugger_step(debugger, number));
+        } else if (strcmp(command, "c") == 0 ||
+                   strcmp(command, "continue") == 0) {
+            print_event(debugger, cpu, debugger_continue(debugger));
+        } else if ((strcmp(command, "rs") == 0 ||
+                    strcmp(command, "reverse-step") == 0) &&
+                   has_count && number >= 0) {
+            print_event(debugger, cpu, debugger_reverse_step(debugger, number));
+        } else if (strcmp(command, "rc") == 0 ||
+                   strcmp(command, "reverse-continue") == 0) {
+            print_event(debugger, cpu, debugger_reverse_continue(debugger));
+        } else if (strcmp(command, "goto") == 0 && has_number && number >= 0) {
+            print_event(debugger, cpu, debugger_goto(debugger, number));
+        } else if ((strcmp(command, "b") == 0 ||
+                    strcmp(command, "break") == 0) && has_number) {
+            if (debugger_break(debugger, number) != 0)
+                puts("The index is outside of the program.");
+        } else if ((strcmp(command, "d") == 0 ||
+                    strcmp(command, "delete") == 0) && has_number) {
+            if (debugger_delete(debugger, number) != 0)
+                puts("There is no such breakpoint.");
+        } else if ((strcmp(command, "w") == 0 ||
+                    strcmp(command, "watch") == 0) && *argument) {
+            int watch;
+            if (strlen(argument) == 1 && *argument >= 'A' && *argument <= 'D')
+                watch = debugger_watch_register(debugger, *argument - 'A');
+            else
+                watch = has_number ? debugger_watch_cell(debugger, number) : -1;
+            if (watch < 0)
+                puts("There is no such register or stack cell.");
+            else
+                printf("watchpoint %d\n", watch);
+        } else if (strcmp(command, "unwatch") == 0 && has_number) {
+            if (debugger_unwatch(debugger, number) != 0)
+                puts("There is no such watchpoint.");
+        } else if (strcmp(command, "i") == 0 || strcmp(command, "info") == 0) {
+            print_event(debugger, cpu, DEBUG_STEPPED);
+        } else {
+            debug_help();
+        }
+    }
+
+    debugger_destroy(debugger);
+    replay_close(replay);
+    cpu_destroy(cpu);
+    free(cpu); cpu = NULL;
+    return 0;
+}
+
+/*
+ * Lets a debugger control the program over the remote serial protocol
+ * (see gdbstub.h), on the Unix-domain socket named by CPU32_GDB, or on stdin
+ * and stdout without it (the program then reads nothing and writes
+ * to stderr). The rest of the program runs when the debugger detaches.
+ */
+static int gdb(struct cpu *cpu)
+{
+    const char *path = getenv("CPU32_GDB");
+    int in_fd = STDIN_FILENO;
+    int out_fd = STDOUT_FILENO;
+    int null_fd = -1;
+    if (path) {
+        int listener = gdbstub_listen(path);
+        if (listener >= 0) {
+            printf("Waiting for the debugger on %s\n", path);
+            fflush(stdout);
+        }
+        in_fd = out_fd = listener < 0 ? -1 : gdbstub_accept(listener, path);
+    } else {
+        null_fd = open("/dev/null", O_RDONLY);
+        io_rebind_buffered(cpu->io, null_fd, STDERR_FILENO);
+    }
+
+    int served = in_fd < 0 ? -1 : gdbstub_serve(cpu, in_fd, out_fd);
+    if (path && in_fd >= 0)
+        close(in_fd);
+    if (served != 0) {
+        if (null_fd >= 0)
+            close(null_fd);
+        cpu_destroy(cpu);
+        free(cpu); cpu = NULL;
+        if (in_fd < 0)
+            file_error(path);
+        return -1;
+    }
+
+    long long executed = 5000;
+    while (executed == 5000 && cpu_get_status(cpu) == CPU_OK) {
+        executed = cpu_run(cpu, executed);
+    }
+    enum cpu_status status = cpu_get_status(cpu);
+    cpu_destroy(cpu);
+    free(cpu); cpu = NULL;
+    if (null_fd >= 0)
+        close(null_fd);
+    /* stdout belongs to the protocol without the socket */
+    if (path)
+        print_status(status);
+    return status == CPU_HALTED ? 0 : -1;
+}
+
+/*
+ * Runs the program with profile_run(), prints the report after the status
+ * and writes the JSON profile to a file.
+ */
+static int profile(struct cpu *cpu, struct profile *profile)
+{
+    long long executed = 5000;
+    while (executed == 5000 && cpu_get_status(cpu) == CPU_OK) {
+        executed = profile_run(profile, cpu, executed);
+    }
+    enum cpu_status status = cpu_get_status(cpu);
+    cpu_destroy(cpu);
+    free(cpu); cpu = NULL;
+    print_status(status);
+    profile_report(profile, stdout);
+
+    const char *json_name = getenv("CPU32_PROFILE_JSON");
+    if (!json_name)
+        json_name = PROFILE_JSON;
+    FILE *json = fopen(json_name, "w");
+    if (json) {
+        profile_json(profile, json);
+        fclose(json);
+    } else {
+        file_error(json_name);
+    }
+    profile_destroy(profile);
+    return status == CPU_HALTED ? 0 : -1;
+}
+
+/* reads the whole file, returns NULL in case of error */
+static char *read_file(FILE *file, size_t *size)
+{
+    size_t capacity = 4096;
+    char *text = malloc(capacity);
+    *size = 0;
+    if (!text)
+        return NULL;
+
+    size_t count;
+    while ((count = fread(text + *size, 1, capacity - *size, file)) > 0) {
+        *size += count;
+        if (*size < capacity)
+            continue;
+        char *temp_p = realloc(text, capacity * 2);
+        if (!temp_p) {
+            free(text);
+            return NULL;
+        }
+        text = temp_p;
+        capacity *= 2;
+    }
+    if (ferror(file)) {
+        free(text);
+        return NULL;
+    }
+    return text;
+}
+
+static bool is_source(const char *file_name)
+{
+    size_t length = strlen(file_name);
+    return length >= 4 && strcmp(file_name + length - 4, ".txt") == 0;
+}
+
+/*
+ * Assembles the source (see asm.h), prints the error and returns -1
+ * on failure.
+ */
+static int assemble(FILE *file, const char *file_name,
+                    struct asm_program *program)
+{
+    size_t size;
+    char *text = read_file(file, &size);
+    if (!text) {
+        file_error(file_name);
+        return -1;
+    }
+
+    struct asm_error error;
+    int result = asm_assemble(text, size, program, &error);
+    free(text);
+    if (result != 0)
+        printf("%s:%zu: %s\n", file_name, error.line, error.message);
+    return result;
+}
+
+/*
+ * Loads and decodes the program, prints the error and returns NULL
+ * on failure. Files ending with .txt are assembled first.
+ */
+static struct cpu *load(const char *file_name, size_t stack_capacity)
+{
+    FILE *file = fopen(file_name, "rb");
+    if (!file) {
+        file_error(file_name);
+        return NULL;
+    }
+
+    int32_t *stack_bottom;
+    int32_t *memory;
+    if (is_source(file_name)) {
+        struct asm_program program;
+        int result = assemble(file, file_name, &program);
+        fclose(file);
+        if (result != 0)
+            return NULL;
+        memory = cpu_create_memory_from_words(program.words, program.length,
+                                              stack_capacity, &stack_bottom);
+        asm_program_destroy(&program);
+    } else {
+        memory = cpu_create_memory(file, stack_capacity, &stack_bottom);
+        fclose(file);
+    }
+    if (!memory) {
+        insufficient_memory();
+        return NULL;
+    }
+
+    struct cpu *cpu = cpu_create(memory, stack_bottom, stack_capacity);
+    if (!cpu) {
+        free(memory); memory = NULL;
+        insufficient_memory();
+        return NULL;
+    }
+    return cpu;
+}
+
+static bool is_number(const char *text)
+{
+    return *text != '\0' && strspn(text, "0123456789") == strlen(text);
+}
+
+static void print_batch_stats(const struct batch_worker_stats *stats,
+                              size_t workers)
+{
+    for (size_t i = 0; i < workers; ++i) {
+        double total = stats[i].total_ns > 0 ? stats[i].total_ns : 1;
+        fprintf(stderr, "worker %zu: busy %.1f%%, idle %.1f%%, %llu jobs, "
+                "%llu slices, %llu steals, %llu instructions\n", i,
+                100.0 * stats[i].busy_ns / total,
+                100.0 * stats[i].idle_ns / total, stats[i].jobs,
+                stats[i].slices, stats[i].steals, stats[i].instructions);
+    }
+}
+
+/*
+ * Opens the input and a temporary output file of each job, returns -1 (with
+ * nothing left open) on failure.
+ */
+static int open_batch_files(struct batch_job *jobs, FILE **outputs,
+                            const char **names, size_t count, bool programs)
+{
+    for (size_t i = 0; i < count; ++i) {
+        const char *input = programs ? "/dev/null" : names[i];
+        jobs[i].input_fd = open(input, O_RDONLY);
+        outputs[i] = jobs[i].input_fd < 0 ? NULL : tmpfile();
+        if (outputs[i]) {
+            jobs[i].output_fd = fileno(outputs[i]);
+            continue;
+        }
+
+        if (jobs[i].input_fd < 0) {
+            file_error(input);
+        } else {
+            close(jobs[i].input_fd);
+            file_error("(temporary output file)");
+        }
+        for (size_t j = 0; j < i; ++j) {
+            close(jobs[j].input_fd);
+            fclose(outputs[j]);
+        }
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Prints the outputs and statuses of the jobs and closes their files,
+ * returns -1 if one of them did not halt.
+ */
+static int print_batch(struct batch_job *jobs, FILE **outputs,
+                       const char **names, size_t count)
+{
+    int result = 0;
+    for (size_t i = 0; i < count; ++i) {
+        printf("==> %s <==\n", names[i]);
+
+        char buffer[4096];
+        size_t length;
+        rewind(outputs[i]);
+        while ((length = fread(buffer, 1, sizeof(buffer), outputs[i])) > 0)
+            fwrite(buffer, 1, length, stdout);
+
+        if (jobs[i].executed < 0)
+            insufficient_memory();
+        else
+            print_status(jobs[i].status);
+        if (jobs[i].executed < 0 || jobs[i].status != CPU_HALTED)
+            result = -1;
+
+        close(jobs[i].input_fd);
+        fclose(outputs[i]);
+    }
+    return result;
+}
+
+/*
+ * Runs one program with each of the inputs (or each of the programs with
+ * an empty input) on worker threads. Outputs are collected in temporary
+ * files and printed in the order of the arguments, each one as `run` would
+ * print it. Jobs run in windows of BATCH_WINDOW, so only the files of one
+ * window are open at a time. CPU32_THREADS sets the count of worker
+ * threads, if CPU32_BATCH_STATS is set, the utilization of each worker
+ * is printed to stderr. `lockstep` runs the jobs on the calling thread
+ * in lockstep (see lockstep.h) instead.
+ */
+static int batch(int argc, const char *argv[], bool lockstep)
+{
+    errno = 0;
+    int index = 2;
+    size_t stack_capacity = 1024;
+
+    if (index < argc - 1 && is_number(argv[index])) {
+        stack_capacity = strtoul(argv[index++], NULL, 10);
+        if (errno == ERANGE) {
+            stack_size();
+            return -1;
+        }
+    }
+    bool programs = index < argc && strcmp(argv[index], "--programs") == 0;
+    if (programs)
+        ++index;
+    /* a single program needs at least one input */
+    if (argc - index < (programs ? 1 : 2)) {
+        usage();
+        return -1;
+    }
+
+    size_t count = programs ? argc - index : argc - index - 1;
+    const char **names = &argv[programs ? index : index + 1];
+    struct cpu **loaded = calloc(count, sizeof(struct cpu *));
+    struct batch_job *jobs = calloc(count, sizeof(struct batch_job));
+    FILE **outputs = calloc(BATCH_WINDOW, sizeof(FILE *));
+    struct batch_worker_stats *stats = NULL;
+    struct batch_worker_stats *totals = NULL;
+    int result = -1;
+    if (!loaded || !jobs || !outputs) {
+        insufficient_memory();
+        goto cleanup;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        if (programs || i == 0) {
+            loaded[i] = load(programs ? names[i] : argv[index],
+                             stack_capacity);
+            if (!loaded[i])
+                goto cleanup;
+        }
+        jobs[i].program = programs ? loaded[i] : loaded[0];
+    }
+
+    const char *threads = getenv("CPU32_THREADS");
+    size_t workers = threads ? strtoul(threads, NULL, 10) : 0;
+    if (workers == 0)
+        workers = batch_default_threads();
+    if (!lockstep && getenv("CPU32_BATCH_STATS")) {
+        stats = calloc(workers, sizeof(struct batch_worker_stats));
+        totals = calloc(workers, sizeof(struct batch_worker_stats));
+    }
+
+    result = 0;
+    size_t used = 0;
+    for (size_t first = 0; first < count; first += BATCH_WINDOW) {
+        size_t window = count - first < BATCH_WINDOW ? count - first
+                                                     : BATCH_WINDOW;
+        if (open_batch_files(jobs + first, outputs, names + first, window,
+                             programs) != 0) {
+            result = -1;
+            break;
+        }
+
+        if (lockstep) {
+            lockstep_batch(jobs + first, window);
+        } else {
+            size_t ran = batch_run(jobs + first, window, workers, cpu_run,
+                                   stats);
+            for (size_t i = 0; stats && totals && i < ran; ++i) {
+                totals[i].total_ns += stats[i].total_ns;
+                totals[i].busy_ns += stats[i].busy_ns;
+                totals[i].idle_ns += stats[i].idle_ns;
+                totals[i].slices += stats[i].slices;
+                totals[i].steals += stats[i].steals;
+                totals[i].jobs += stats[i].jobs;
+                totals[i].instructions += stats[i].instructions;
+            }
+            used = ran > used ? ran : used;
+        }
+
+        if (print_batch(jobs + first, outputs, names + first, window) != 0)
+            result = -1;
+    }
+    if (totals)
+        print_batch_stats(totals, used);
+
+cleanup:
+    for (size_t i = 0; loaded && i < count; ++i) {
+        if (loaded[i]) {
+            cpu_destroy(loaded[i]);
+            free(loaded[i]);
+        }
+    }
+    free(stats);
+    free(totals);
+    free(loaded);
+    free(jobs);
+    free(outputs);
+    return result;
+}
+
+/* assembles the source into a binary program (little endian words) */
+static int assemble_file(const char *source_name, const char *output_name)
+{
+    FILE *source = fopen(source_name, "rb");
+    if (!source) {
+        file_error(source_name);
+        return -1;
+    }
+    struct asm_program program;
+    int result = assemble(source, source_name, &program);
+    fclose(source);
+    if (result != 0)
+        return -1;
+
+    FILE *output = fopen(output_name, "wb");
+    if (!output) {
+        asm_program_destroy(&program);
+        file_error(output_name);
+        return -1;
+    }
+    for (size_t i = 0; i < program.length; ++i) {
+        uint32_t word = (uint32_t) program.words[i];
+        for (int byte = 0; byte < 4; ++byte)
+            fputc((word >> (byte * 8)) & 0xff, output);
+    }
+    if (fclose(output) != 0) {
+        printf("Could not write file: %s\n", output_name);
+        result = -1;
+    }
+    asm_program_destroy(&program);
+    return result;
+}
+
+/* prints the binary program (or the assembled source) in the text format */
+static int disassemble_file(const char *file_name)
+{
+    FILE *file = fopen(file_name, "rb");
+    if (!file) {
+        file_error(file_name);
+        return -1;
+    }
+
+    struct asm_program program = { 0 };
+    if (is_source(file_name)) {
+        int result = assemble(file, file_name, &program);
+        fclose(file);
+        if (result != 0)
+            return -1;
+    } else {
+        size_t size;
+        unsigned char *bytes = (unsigned char *) read_file(file, &size);
+        fclose(file);
+        if (!bytes) {
+            file_error(file_name);
+            return -1;
+        }
+        if (size % 4 != 0) {
+            free(bytes);
+            printf("Size of the program is not a multiple of 4: %s\n",
+                   file_name);
+            return -1;
+        }
+        program.length = size / 4;
+        program.words = malloc(size + 1);
+        if (!program.words) {
+            free(bytes);
+            insufficient_memory();
+            return -1;
+        }
+        for (size_t i = 0; i < program.length; ++i) {
+            const unsigned char *word = bytes + i * 4;
+            program.words[i] = (int32_t) ((uint32_t) word[0] |
+                                          (uint32_t) word[1] << 8 |
+                                          (uint32_t) word[2] << 16 |
+                                          (uint32_t) word[3] << 24);
+        }
+        free(bytes);
+    }
+
+    int result = asm_disassemble(program.words, program.length, stdout);
+    asm_program_destroy(&program);
+    if (result != 0)
+        insufficient_memory();
+    return result;
+}
+
 int main(int argc, const char *argv[])
 {
+    if (argc > 1 && strcmp(argv[1], "batch") == 0)
+        return batch(argc, argv, false);
+    if (argc > 1 && strcmp(argv[1], "lockstep") == 0)
+        return batch(argc, argv, true);
+    if (argc == 3 && strcmp(argv[1], "trace-dump") == 0)
+        return trace_dump(argv[2]);
+    if (argc == 4 && strcmp(argv[1], "asm") == 0)
+        return assemble_file(argv[2], argv[3]);
+    if (argc == 3 && strcmp(argv[1], "disasm") == 0)
+        return disassemble_file(argv[2]);
+
     errno = 0;
     int file_index = 2;
     size_t stack_capacity = 1024;
@@ -132,32 +1017,126 @@ int main(int argc, const char *argv[])
         mode = RUN;
     } else if (strcmp(argv[1], "trace") == 0) {
         mode = TRACE;
+    } else if (strcmp(argv[1], "threaded") == 0) {
+        mode = THREADED;
+    } else if (strcmp(argv[1], "jit") == 0) {
+        mode = JIT;
+    } else if (strcmp(argv[1], "guarded") == 0) {
+        mode = GUARDED;
+    } else if (strcmp(argv[1], "ngrams") == 0) {
+        mode = NGRAMS;
+    } else if (strcmp(argv[1], "profile") == 0) {
+        mode = PROFILE;
+    } else if (strcmp(argv[1], "trace-write") == 0) {
+        mode = TRACE_WRITE;
+    } else if (strcmp(argv[1], "record") == 0) {
+        mode = RECORD;
+    } else if (strcmp(argv[1], "replay") == 0) {
+        mode = REPLAY;
+    } else if (strcmp(argv[1], "debug") == 0) {
+        mode = DEBUG;
+    } else if (strcmp(argv[1], "gdb") == 0) {
+        mode = GDB;
     } else {
         usage();
         return -1;
     }
 
-    const char *file_name = argv[file_index];
-    FILE *file = fopen(file_name, "rb");
-    if (!file) {
-        file_error(file_name);
+    struct cpu *cpu = load(argv[file_index], stack_capacity);
+    if (!cpu)
         return -1;
+    /* trace prints through stdio between instructions, it has to keep it */
+    struct cpu_io *io = NULL;
+    if (mode != TRACE) {
+        io = io_create_buffered(STDIN_FILENO, STDOUT_FILENO);
+        if (!io) {
+            cpu_destroy(cpu);
+            free(cpu); cpu = NULL;
+            insufficient_memory();
+            return -1;
+        }
+        cpu_set_io(cpu, io);
     }
 
-    int32_t *stack_bottom;
-    int32_t *memory = cpu_create_memory(file, stack_capacity, &stack_bottom);
-    if (!memory) {
-        fclose(file);
-        insufficient_memory();
-        return -1;
+    int result;
+    switch (mode) {
+    case TRACE:
+        result = trace(cpu);
+        break;
+    case THREADED:
+        result = run(cpu, cpu_run_threaded);
+        break;
+    case JIT:
+        result = run(cpu, cpu_run_jit);
+        break;
+    case GUARDED:
+        result = run(cpu, cpu_run_guarded);
+        break;
+    case NGRAMS:
+        result = ngrams(cpu);
+        break;
+    case GDB:
+        result = gdb(cpu);
+        break;
+    case PROFILE: {
+        struct profile *counts = profile_create(cpu);
+        if (!counts) {
+            cpu_destroy(cpu);
+            free(cpu); cpu = NULL;
+            insufficient_memory();
+            result = -1;
+            break;
+        }
+        result = profile(cpu, counts);
+        break;
     }
-    fclose(file);
-
-    struct cpu *cpu = cpu_create(memory, stack_bottom, stack_capacity);
-    if (!cpu) {
-        free(memory); memory = NULL;
-        insufficient_memory();
-        return -1;
+    case TRACE_WRITE: {
+        const char *trace_name = getenv("CPU32_TRACE");
+        if (!trace_name)
+            trace_name = TRACE_FILE;
+        int fd = open(trace_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            cpu_destroy(cpu);
+            free(cpu); cpu = NULL;
+            file_error(trace_name);
+            result = -1;
+            break;
+        }
+        result = trace_write(cpu, fd);
+        close(fd);
+        break;
+    }
+    case RECORD:
+    case REPLAY:
+    case DEBUG: {
+        const char *log_name = getenv("CPU32_REPLAY");
+        if (!log_name)
+            log_name = REPLAY_FILE;
+        int fd = mode == RECORD
+                 ? open(log_name, O_WRONLY | O_CREAT | O_TRUNC, 0644)
+                 : open(log_name, O_RDONLY);
+        if (fd < 0) {
+            cpu_destroy(cpu);
+            free(cpu); cpu = NULL;
+            file_error(log_name);
+            result = -1;
+            break;
+        }
+        if (mode == RECORD)
+            result = record(cpu, fd);
+        else if (mode == REPLAY)
+            result = replay(cpu, fd);
+        else
+            result = debug(cpu, fd);
+        close(fd);
+        break;
     }
-    return mode == RUN ? run(cpu) : trace(cpu); 
+    default:
+        result = run(cpu, cpu_run);
+        break;
+    }
+
+    if (io)
+        io_destroy_buffered(io);
+    return result;
 }
@@ -0,0 +1,261 @@
+#include "../include/profile.h"
+#include "../include/instructions.h"
+#include "../include/decode.h"
+#include "../include/io.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <inttypes.h>
+
+/* counts belonging to one instruction index */
+struct site {
+    int32_t opcode;
+    unsigned long long executed;
+    /* `loop` at this index jumped (C != 0) or fell through */
+    unsigned long long taken;
+    unsigned long long not_taken;
+    /* count of jumps of any `loop` to this index */
+    unsigned long long jumped_to;
+};
+
+struct profile {
+    unsigned long long total;
+    unsigned long long opcodes[19];
+    size_t stack_high_water;
+
+    int32_t size;
+    struct site sites[];
+};
+
+/* row of a sorted table */
+struct entry {
+    int32_t index;
+    unsigned long long count;
+};
+
+struct profile *profile_create(const struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    struct profile *profile = calloc(1, sizeof(struct profile) +
+                                     cpu->program_size * sizeof(struct site));
+    if (profile == NULL)
+        return NULL;
+
+    profile->size = cpu->program_size;
+    for (int32_t i = 0; i < profile->size; ++i)
+        profile->sites[i].opcode = cpu->program[i].opcode;
+    profile->stack_high_water = cpu->stack_size;
+    return profile;
+}
+
+static void count(struct profile *profile, struct cpu *cpu, int32_t index,
+                  int32_t counter)
+{
+    struct site *site = &profile->sites[index];
+
+    ++profile->total;
+    ++profile->opcodes[site->opcode];
+    ++site->executed;
+    if (cpu->stack_size > profile->stack_high_water)
+        profile->stack_high_water = cpu->stack_size;
+
+    if (site->opcode != 8)
+        return;
+    if (counter == 0) {
+        ++site->not_taken;
+        return;
+    }
+    ++site->taken;
+    /* a jump out of the program is reported by the next step */
+    uint32_t target = (uint32_t) cpu->instruction_index;
+    if (target < (uint32_t) profile->size)
+        ++profile->sites[target].jumped_to;
+}
+
+long long profile_run(struct profile *profile, struct cpu *cpu, size_t steps)
+{
+    assert(profile != NULL);
+    assert(cpu != NULL);
+    assert(profile->size == cpu->program_size);
+
+    if (cpu->status != CPU_OK)
+        return 0;
+
+    size_t executed = 0;
+    while (executed < steps) {
+        /* negative index is converted to a big unsigned number */
+        uint32_t index = (uint32_t) cpu->instruction_index;
+        int result = 0;
+        if (index >= (uint32_t) cpu->program_size) {
+            cpu->status = CPU_INVALID_ADDRESS;
+        } else {
+            int32_t counter = cpu->arithmetic_regs[REGISTER_C];
+            result = execute_single(cpu, cpu->program + index);
+            if (result > 0 || cpu->status == CPU_HALTED)
+                count(profile, cpu, index, counter);
+        }
+
+        ++executed;
+        if (result <= 0) {
+            cpu->io->flush(cpu->io);
+            return cpu->status == CPU_HALTED ? (long long) executed
+                                             : -(long long) executed;
+        }
+    }
+    return steps;
+}
+
+static int compare_entries(const void *first, const void *second)
+{
+    const struct entry *a = first;
+    const struct entry *b = second;
+    if (a->count != b->count)
+        return a->count < b->count ? 1 : -1;
+    return (a->index > b->index) - (a->index < b->index);
+}
+
+/*
+ * Returns entries with non-zero count, sorted by count. Counts are taken
+ * from the site field at `offset`, NULL in case of error.
+ */
+static struct entry *sorted_sites(const struct profile *profile, size_t offset,
+                                  size_t *length)
+{
+    struct entry *entries = malloc((profile->size + 1) * sizeof(struct entry));
+    if (entries == NULL)
+        return NULL;
+
+    *length = 0;
+    for (int32_t i = 0; i < profile->size; ++i) {
+        const char *site = (const char *) &profile->sites[i] + offset;
+        unsigned long long count = *(const unsigned long long *) site;
+        if (count == 0)
+            continue;
+        entries[*length].index = i;
+        entries[*length].count = count;
+        ++*length;
+    }
+    qsort(entries, *length, sizeof(struct entry), &compare_entries);
+    return entries;
+}
+
+static double percent(unsigned long long count, unsigned long long total)
+{
+    return total == 0 ? 0.0 : 100.0 * count / total;
+}
+
+void profile_report(const struct profile *profile, FILE *out)
+{
+    assert(profile != NULL);
+    assert(out != NULL);
+
+    fprintf(out, "instructions executed: %llu\n", profile->total);
+    fprintf(out, "stack high-water mark: %zu\n", profile->stack_high_water);
+
+    struct entry opcodes[19];
+    size_t length = 0;
+    for (int i = 0; i < 19; ++i) {
+        if (profile->opcodes[i] == 0)
+            continue;
+        opcodes[length].index = i;
+        opcodes[length].count = profile->opcodes[i];
+        ++length;
+    }
+    qsort(opcodes, length, sizeof(struct entry), &compare_entries);
+
+    fputs("opcodes:\n", out);
+    for (size_t i = 0; i < length; ++i)
+        fprintf(out, "%12llu %6.2f%%  %s\n", opcodes[i].count,
+                percent(opcodes[i].count, profile->total),
+                instruction_names[opcodes[i].index]);
+
+    struct entry *entries = sorted_sites(profile,
+                                         offsetof(struct site, executed),
+                                         &length);
+    if (entries == NULL)
+        return;
+    fprintf(out, "hot instructions (top %d):\n", PROFILE_TOP);
+    for (size_t i = 0; i < length && i < PROFILE_TOP; ++i)
+        fprintf(out, "%12llu %6.2f%%  %8" PRId32 "  %s\n", entries[i].count,
+                percent(entries[i].count, profile->total), entries[i].index,
+                instruction_names[profile->sites[entries[i].index].opcode]);
+    free(entries);
+
+    entries = sorted_sites(profile, offsetof(struct site, jumped_to), &length);
+    if (entries == NULL)
+        return;
+    fprintf(out, "loop targets (top %d):\n", PROFILE_TOP);
+    for (size_t i = 0; i < length && i < PROFILE_TOP; ++i)
+        fprintf(out, "%12llu  %8" PRId32 "\n", entries[i].count,
+                entries[i].index);
+    free(entries);
+
+    /* branches are sorted by the count of executions */
+    size_t branches = 0;
+    entries = sorted_sites(profile, offsetof(struct site, executed), &length);
+    if (entries == NULL)
+        return;
+    fprintf(out, "loop branches (top %d):\n", PROFILE_TOP);
+    fprintf(out, "%12s %12s  %8s\n", "taken", "not taken", "index");
+    for (size_t i = 0; i < length && branches < PROFILE_TOP; ++i) {
+        const struct site *site = &profile->sites[entries[i].index];
+        if (site->opcode != 8)
+            continue;
+        fprintf(out, "%12llu %12llu  %8" PRId32 "\n", site->taken,
+                site->not_taken, entries[i].index);
+        ++branches;
+    }
+    free(entries);
+}
+
+void profile_json(const struct profile *profile, FILE *out)
+{
+    assert(profile != NULL);
+    assert(out != NULL);
+
+    fprintf(out, "{\n  \"instructions\": %llu,\n", profile->total);
+    fprintf(out, "  \"stack_high_water\": %zu,\n", profile->stack_high_water);
+
+    fputs("  \"opcodes\": {", out);
+    const char *separator = "";
+    for (int i = 0; i < 19; ++i) {
+        fprintf(out, "%s\"%s\": %llu", separator, instruction_names[i],
+                profile->opcodes[i]);
+        separator = ", ";
+    }
+    fputs("},\n", out);
+
+    size_t length = 0;
+    struct entry *entries = sorted_sites(profile,
+                                         offsetof(struct site, executed),
+                                         &length);
+    fputs("  \"instructions_by_index\": [", out);
+    for (size_t i = 0; entries != NULL && i < length; ++i) {
+        const struct site *site = &profile->sites[entries[i].index];
+        fprintf(out, "%s\n    {\"index\": %" PRId32 ", \"opcode\": \"%s\", "
+                "\"count\": %llu", i == 0 ? "" : ",", entries[i].index,
+                instruction_names[site->opcode], site->executed);
+        if (site->opcode == 8)
+            fprintf(out, ", \"taken\": %llu, \"not_taken\": %llu",
+                    site->taken, site->not_taken);
+        fputc('}', out);
+    }
+    fputs(length > 0 ? "\n  ],\n" : "],\n", out);
+    free(entries);
+
+    length = 0;
+    entries = sorted_sites(profile, offsetof(struct site, jumped_to), &length);
+    fputs("  \"loop_targets\": [", out);
+    for (size_t i = 0; entries != NULL && i < length; ++i)
+        fprintf(out, "%s\n    {\"index\": %" PRId32 ", \"count\": %llu}",
+                i == 0 ? "" : ",", entries[i].index, entries[i].count);
+    fputs(length > 0 ? "\n  ]\n}\n" : "]\n}\n", out);
+    free(entries);
+}
+
+void profile_destroy(struct profile *profile)
+{
+    free(profile);
+}
@@ -0,0 +1,533 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/replay.h"
+#include "../include/io.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* the longest event: the kind and a varint */
+#define EVENT_MAX_SIZE (1 + 5)
+
+/* magic without the terminating zero and the version */
+#define HEADER_SIZE (sizeof(REPLAY_MAGIC) - 1 + 1)
+
+struct replay_recorder {
+    /* must be the first member, struct cpu_io * is cast to replay_recorder * */
+    struct cpu_io io;
+    /* backend of the cpu, every call is passed to it */
+    struct cpu_io *inner;
+
+    int fd;
+    bool failed;
+
+    size_t length;
+    unsigned char buffer[REPLAY_BUFFER_SIZE];
+};
+
+struct checkpoint {
+    /* count of instructions executed from the start */
+    uint64_t step;
+    /* offset of the next event in the log */
+    size_t offset;
+    struct cpu_snapshot *snapshot;
+};
+
+struct replay {
+    /* must be the first member, struct cpu_io * is cast to replay * */
+    struct cpu_io io;
+    /* backend of the cpu, it gets only the output */
+    struct cpu_io *inner;
+    struct cpu *cpu;
+
+    /* the mapped log */
+    const unsigned char *log;
+    size_t length;
+    /* offset of the next event */
+    size_t offset;
+    bool diverged;
+    /* set while instructions in front of the frontier are executed again */
+    bool muted;
+
+    uint64_t position;
+    /* the furthest position reached, the output behind it was written */
+    uint64_t frontier;
+    size_t interval;
+    size_t budget;
+    /* sorted by step */
+    struct checkpoint *checkpoints;
+    size_t checkpoint_count;
+    size_t checkpoint_capacity;
+};
+
+static inline uint32_t zigzag(int32_t value)
+{
+    return ((uint32_t) value << 1) ^ (value < 0 ? UINT32_MAX : 0);
+}
+
+static inline int32_t unzigzag(uint32_t value)
+{
+    return (int32_t) ((value >> 1) ^ (0u - (value & 1)));
+}
+
+static void write_out(struct replay_recorder *recorder)
+{
+    size_t written = 0;
+    while (written < recorder->length && !recorder->failed) {
+        ssize_t result = write(recorder->fd, recorder->buffer + written,
+                               recorder->length - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            recorder->failed = true;
+        else
+            written += result;
+    }
+    recorder->length = 0;
+}
+
+static void put_event(struct replay_recorder *recorder,
+                      enum replay_event event, uint32_t value)
+{
+    if (REPLAY_BUFFER_SIZE - recorder->length < EVENT_MAX_SIZE)
+        write_out(recorder);
+
+    unsigned char *p = recorder->buffer + recorder->length;
+    *p++ = (unsigned char) event;
+    if (event == REPLAY_BYTE) {
+        *p++ = (unsigned char) value;
+    } else if (event == REPLAY_NUMBER) {
+        while (value >= 0x80) {
+            *p++ = (unsigned char) (value | 0x80);
+            value >>= 7;
+        }
+        *p++ = (unsigned char) value;
+    }
+    recorder->length = p - recorder->buffer;
+}
+
+static int recorder_read_number(struct cpu_io *io, int32_t *number)
+{
+    struct replay_recorder *recorder = (struct replay_recorder *) io;
+
+    int result = recorder->inner->read_number(recorder->inner, number);
+    switch (result) {
+    case 0:
+        put_event(recorder, REPLAY_NOT_NUMBER, 0);
+        break;
+    case EOF:
+        put_event(recorder, REPLAY_EOF, 0);
+        break;
+    case CPU_IO_WAIT:
+        put_event(recorder, REPLAY_WAIT, 0);
+        break;
+    default:
+        put_event(recorder, REPLAY_NUMBER, zigzag(*number));
+        break;
+    }
+    return result;
+}
+
+static int recorder_read_byte(struct cpu_io *io)
+{
+    struct replay_recorder *recorder = (struct replay_recorder *) io;
+
+    int result = recorder->inner->read_byte(recorder->inner);
+    if (result == EOF)
+        put_event(recorder, REPLAY_EOF, 0);
+    else if (result == CPU_IO_WAIT)
+        put_event(recorder, REPLAY_WAIT, 0);
+    else
+        put_event(recorder, REPLAY_BYTE, result);
+    return result;
+}
+
+static void recorder_write_number(struct cpu_io *io, int32_t number)
+{
+    struct cpu_io *inner = ((struct replay_recorder *) io)->inner;
+    inner->write_number(inner, number);
+}
+
+static void recorder_write_byte(struct cpu_io *io, unsigned char byte)
+{
+    struct cpu_io *inner = ((struct replay_recorder *) io)->inner;
+    inner->write_byte(inner, byte);
+}
+
+static void recorder_flush(struct cpu_io *io)
+{
+    struct replay_recorder *recorder = (struct replay_recorder *) io;
+
+    write_out(recorder);
+    recorder->inner->flush(recorder->inner);
+}
+
+struct replay_recorder *replay_record(struct cpu *cpu, int fd)
+{
+    assert(cpu != NULL);
+
+    struct replay_recorder *recorder = malloc(sizeof(struct replay_recorder));
+    if (recorder == NULL)
+        return NULL;
+
+    recorder->io.read_number = &recorder_read_number;
+    recorder->io.read_byte = &recorder_read_byte;
+    recorder->io.write_number = &recorder_write_number;
+    recorder->io.write_byte = &recorder_write_byte;
+    recorder->io.flush = &recorder_flush;
+    recorder->inner = cpu->io;
+    cpu->io = &recorder->io;
+
+    recorder->fd = fd;
+    recorder->failed = false;
+    memcpy(recorder->buffer, REPLAY_MAGIC, sizeof(REPLAY_MAGIC) - 1);
+    recorder->length = sizeof(REPLAY_MAGIC) - 1;
+    recorder->buffer[recorder->length++] = REPLAY_VERSION;
+    return recorder;
+}
+
+int replay_record_close(struct replay_recorder *recorder, struct cpu *cpu)
+{
+    assert(recorder != NULL);
+    assert(cpu != NULL);
+
+    write_out(recorder);
+    if (cpu->io == &recorder->io)
+        cpu->io = recorder->inner;
+
+    int result = recorder->failed ? -1 : 0;
+    free(recorder);
+    return result;
+}
+
+/*
+ * Consumes and returns the next event if a read of a number (`number`)
+ * or of a byte can get it, its value is stored to `value`. Returns -1 and
+ * marks the replay diverged if the read can't get it, -1 at the end of
+ * the log.
+ */
+static int next_event(struct replay *replay, bool number, uint32_t *value)
+{
+    const unsigned char *p = replay->log + replay->offset;
+    const unsigned char *end = replay->log + replay->length;
+    if (p == end)
+        return -1;
+
+    int event = *p++;
+    switch (event) {
+    case REPLAY_EOF:
+    case REPLAY_WAIT:
+        break;
+    case REPLAY_NOT_NUMBER:
+        if (!number)
+            event = -1;
+        break;
+    case REPLAY_BYTE:
+        if (number)
+            event = -1;
+        else if (p == end)
+            return -1;
+        else
+            *value = *p++;
+        break;
+    case REPLAY_NUMBER:
+        if (!number) {
+            event = -1;
+            break;
+        }
+        *value = 0;
+        for (int shift = 0; ; shift += 7) {
+            /* a truncated varint is the end of the log */
+            if (p == end || shift > 28)
+                return -1;
+            *value |= (uint32_t) (*p & 0x7f) << shift;
+            if (!(*p++ & 0x80))
+                break;
+        }
+        break;
+    default:
+        event = -1;
+        break;
+    }
+
+    if (event < 0)
+        replay->diverged = true;
+    else
+        replay->offset = p - replay->log;
+    return event;
+}
+
+static int replay_read_number(struct cpu_io *io, int32_t *number)
+{
+    struct replay *replay = (struct replay *) io;
+
+    uint32_t value;
+    switch (next_event(replay, true, &value)) {
+    case REPLAY_NUMBER:
+        *number = unzigzag(value);
+        return 1;
+    case REPLAY_NOT_NUMBER:
+        return 0;
+    case REPLAY_WAIT:
+        return CPU_IO_WAIT;
+    default:
+        return EOF;
+    }
+}
+
+static int replay_read_byte(struct cpu_io *io)
+{
+    struct replay *replay = (struct replay *) io;
+
+    uint32_t value;
+    switch (next_event(replay, false, &value)) {
+    case REPLAY_BYTE:
+        return (int) value;
+    case REPLAY_WAIT:
+        return CPU_IO_WAIT;
+    default:
+        return EOF;
+    }
+}
+
+static void replay_write_number(struct cpu_io *io, int32_t number)
+{
+    struct replay *replay = (struct replay *) io;
+    if (!replay->muted)
+        replay->inner->write_number(replay->inner, number);
+}
+
+static void replay_write_byte(struct cpu_io *io, unsigned char byte)
+{
+    struct replay *replay = (struct replay *) io;
+    if (!replay->muted)
+        replay->inner->write_byte(replay->inner, byte);
+}
+
+static void replay_flush(struct cpu_io *io)
+{
+    struct cpu_io *inner = ((struct replay *) io)->inner;
+    inner->flush(inner);
+}
+
+struct replay *replay_open(struct cpu *cpu, int fd, size_t interval,
+                           size_t budget)
+{
+    assert(cpu != NULL);
+
+    struct stat info;
+    if (fstat(fd, &info) != 0 || !S_ISREG(info.st_mode) ||
+        (size_t) info.st_size < HEADER_SIZE)
+        return NULL;
+
+    size_t length = info.st_size;
+    void *mapping = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapping == MAP_FAILED)
+        return NULL;
+    const unsigned char *log = mapping;
+    struct replay *replay = calloc(1, sizeof(struct replay));
+    if (replay == NULL ||
+        memcmp(log, REPLAY_MAGIC, sizeof(REPLAY_MAGIC) - 1) != 0 ||
+        log[sizeof(REPLAY_MAGIC) - 1] != REPLAY_VERSION) {
+        free(replay);
+        munmap(mapping, length);
+        return NULL;
+    }
+
+    replay->io.read_number = &replay_read_number;
+    replay->io.read_byte = &replay_read_byte;
+    replay->io.write_number = &replay_write_number;
+    replay->io.write_byte = &replay_write_byte;
+    replay->io.flush = &replay_flush;
+    replay->inner = cpu->io;
+    replay->cpu = cpu;
+    cpu->io = &replay->io;
+
+    replay->log = log;
+    replay->length = length;
+    replay->offset = HEADER_SIZE;
+    replay->interval = interval > 0 ? interval : REPLAY_INTERVAL;
+    replay->budget = budget > 0 ? budget : REPLAY_BUDGET;
+    return replay;
+}
+
+/*
+ * Doubles the interval and releases the checkpoints which are not at its
+ * multiple until the checkpoints fit into the budget (or only the first one
+ * is left).
+ */
+static void thin_out(struct replay *replay)
+{
+    for (;;) {
+        size_t size = 0;
+        for (size_t i = 0; i < replay->checkpoint_count; ++i)
+            size += cpu_snapshot_size(replay->checkpoints[i].snapshot);
+        if (size <= replay->budget || replay->checkpoint_count <= 1 ||
+            replay->interval > SIZE_MAX / 2)
+            return;
+
+        replay->interval *= 2;
+        size_t kept = 0;
+        for (size_t i = 0; i < replay->checkpoint_count; ++i) {
+            struct checkpoint *checkpoint = replay->checkpoints + i;
+            if (checkpoint->step % replay->interval == 0)
+                replay->checkpoints[kept++] = *checkpoint;
+            else
+                cpu_snapshot_destroy(checkpoint->snapshot);
+        }
+        replay->checkpoint_count = kept;
+    }
+}
+
+/* takes a checkpoint at the current position unless there is one already */
+static void take_checkpoint(struct replay *replay)
+{
+    size_t count = replay->checkpoint_count;
+    if (count > 0 && replay->checkpoints[count - 1].step >= replay->position)
+        return;
+
+    if (count == replay->checkpoint_capacity) {
+        size_t capacity = count > 0 ? 2 * count : 16;
+        struct checkpoint *checkpoints = realloc(replay->checkpoints,
+                                                 capacity
+                                                 * sizeof(struct checkpoint));
+        /* without the checkpoint seeking only executes more instructions */
+        if (checkpoints == NULL)
+            return;
+        replay->checkpoints = checkpoints;
+        replay->checkpoint_capacity = capacity;
+    }
+
+    struct cpu_snapshot *snapshot = cpu_snapshot(replay->cpu);
+    if (snapshot == NULL)
+        return;
+    replay->checkpoints[count].step = replay->position;
+    replay->checkpoints[count].offset = replay->offset;
+    replay->checkpoints[count].snapshot = snapshot;
+    ++replay->checkpoint_count;
+    thin_out(replay);
+}
+
+long long replay_run(struct replay *replay, size_t steps)
+{
+    assert(replay != NULL);
+
+    struct cpu *cpu = replay->cpu;
+    if (cpu->status != CPU_OK)
+        return 0;
+
+    size_t executed = 0;
+    while (executed < steps) {
+        /* checkpoints are taken at multiples of the interval */
+        size_t into = replay->position % replay->interval;
+        if (into == 0)
+            take_checkpoint(replay);
+        size_t chunk = replay->interval - into;
+        if (chunk > steps - executed)
+            chunk = steps - executed;
+        /* a chunk is either executed again or for the first time */
+        replay->muted = replay->position < replay->frontier;
+        if (replay->muted && chunk > replay->frontier - replay->position)
+            chunk = replay->frontier - replay->position;
+
+        long long result = cpu_run(cpu, chunk);
+        size_t done = result < 0 ? -result : result;
+        /* the instruction under a breakpoint was not executed */
+        if (cpu->status == CPU_BREAKPOINT)
+            --done;
+        executed += done;
+        replay->position += done;
+        if (replay->position > replay->frontier)
+            replay->frontier = replay->position;
+        if (cpu->status != CPU_OK)
+            return cpu->status == CPU_HALTED ? (long long) executed
+                                             : -(long long) executed;
+    }
+    return executed;
+}
+
+/* returns the last checkpoint at the step or in front of it, NULL if none */
+static const struct checkpoint *nearest(const struct replay *replay,
+                                        uint64_t step)
+{
+    size_t low = 0;
+    size_t high = replay->checkpoint_count;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (replay->checkpoints[middle].step <= step)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low > 0 ? replay->checkpoints + low - 1 : NULL;
+}
+
+int replay_seek(struct replay *replay, uint64_t step)
+{
+    assert(replay != NULL);
+
+    struct cpu *cpu = replay->cpu;
+    const struct checkpoint *checkpoint = nearest(replay, step);
+    /* going on from here is faster, unless a checkpoint is closer */
+    bool forward = step >= replay->position &&
+                   (cpu->status == CPU_OK ||
+                    cpu->status == CPU_WAITING_INPUT) &&
+                   (checkpoint == NULL || checkpoint->step <= replay->position);
+    if (!forward) {
+        if (checkpoint == NULL)
+            return -1;
+        cpu_restore(cpu, checkpoint->snapshot);
+        replay->offset = checkpoint->offset;
+        replay->position = checkpoint->step;
+    }
+
+    while (replay->position < step) {
+        /* the recorded run went on after the input came */
+        cpu_resume(cpu);
+        replay_run(replay, step - replay->position);
+        if (cpu->status != CPU_OK && cpu->status != CPU_WAITING_INPUT)
+            break;
+    }
+    return replay->position == step ? 0 : -1;
+}
+
+uint64_t replay_checkpoint(const struct replay *replay, uint64_t step)
+{
+    assert(replay != NULL);
+
+    const struct checkpoint *checkpoint = nearest(replay, step);
+    return checkpoint != NULL ? checkpoint->step : 0;
+}
+
+uint64_t replay_position(const struct replay *replay)
+{
+    assert(replay != NULL);
+    return replay->position;
+}
+
+int replay_diverged(const struct replay *replay)
+{
+    assert(replay != NULL);
+    return replay->diverged;
+}
+
+void replay_close(struct replay *replay)
+{
+    if (replay == NULL)
+        return;
+
+    if (replay->cpu->io == &replay->io)
+        replay->cpu->io = replay->inner;
+    for (size_t i = 0; i < replay->checkpoint_count; ++i)
+        cpu_snapshot_destroy(replay->checkpoints[i].snapshot);
+    free(replay->checkpoints);
+    munmap((void *) replay->log, replay->length);
+    free(replay);
+}
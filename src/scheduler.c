@@ -0,0 +1,117 @@
+#include "../include/scheduler.h"
+#include <assert.h>
+
+static void enqueue(struct scheduler *scheduler, struct scheduler_task *task)
+{
+    task->next = NULL;
+    task->queued = 1;
+    if (scheduler->tail != NULL)
+        scheduler->tail->next = task;
+    else
+        scheduler->head = task;
+    scheduler->tail = task;
+    ++scheduler->runnable;
+}
+
+static struct scheduler_task *dequeue(struct scheduler *scheduler)
+{
+    struct scheduler_task *task = scheduler->head;
+    scheduler->head = task->next;
+    if (scheduler->head == NULL)
+        scheduler->tail = NULL;
+    task->next = NULL;
+    task->queued = 0;
+    --scheduler->runnable;
+    return task;
+}
+
+void scheduler_init(struct scheduler *scheduler, scheduler_engine engine)
+{
+    assert(scheduler != NULL);
+    assert(engine != NULL);
+
+    scheduler->engine = engine;
+    scheduler->head = NULL;
+    scheduler->tail = NULL;
+    scheduler->runnable = 0;
+}
+
+void scheduler_add(struct scheduler *scheduler, struct scheduler_task *task)
+{
+    assert(scheduler != NULL);
+    assert(task != NULL && task->cpu != NULL);
+    assert(task->budget > 0);
+
+    task->executed = 0;
+    task->next = NULL;
+    task->queued = 0;
+    if (cpu_get_status(task->cpu) == CPU_OK)
+        enqueue(scheduler, task);
+}
+
+void scheduler_wake(struct scheduler *scheduler, struct scheduler_task *task)
+{
+    assert(scheduler != NULL);
+    assert(task != NULL);
+
+    cpu_resume(task->cpu);
+    if (!task->queued && cpu_get_status(task->cpu) == CPU_OK)
+        enqueue(scheduler, task);
+}
+
+void scheduler_remove(struct scheduler *scheduler,
+                      struct scheduler_task *task)
+{
+    assert(scheduler != NULL);
+    assert(task != NULL);
+
+    if (!task->queued)
+        return;
+
+    struct scheduler_task *previous = NULL;
+    struct scheduler_task *current = scheduler->head;
+    while (current != task) {
+        previous = current;
+        current = current->next;
+    }
+
+    if (previous != NULL)
+        previous->next = task->next;
+    else
+        scheduler->head = task->next;
+    if (scheduler->tail == task)
+        scheduler->tail = previous;
+    task->next = NULL;
+    task->queued = 0;
+    --scheduler->runnable;
+}
+
+size_t scheduler_runnable(const struct scheduler *scheduler)
+{
+    assert(scheduler != NULL);
+
+    return scheduler->runnable;
+}
+
+struct scheduler_task *scheduler_step(struct scheduler *scheduler)
+{
+    assert(scheduler != NULL);
+
+    if (scheduler->head == NULL)
+        return NULL;
+
+    struct scheduler_task *task = dequeue(scheduler);
+    long long executed = scheduler->engine(task->cpu, task->budget);
+    if (executed < 0) {
+        executed = -executed;
+        /* the waiting in or get is executed again when the task is woken */
+        if (cpu_get_status(task->cpu) == CPU_WAITING_INPUT)
+            --executed;
+    }
+    task->executed += executed;
+
+    if (cpu_get_status(task->cpu) != CPU_OK)
+        return task;
+    enqueue(scheduler, task);
+    return NULL;
+}
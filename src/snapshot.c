@@ -0,0 +1,231 @@
+#include "../include/snapshot.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct cpu_page {
+    /* count of snapshots and cpus sharing the block */
+    long references;
+    int32_t cells[CPU_PAGE_CELLS];
+};
+
+struct cpu_snapshot {
+    enum cpu_status status;
+    int32_t instruction_index;
+    int32_t arithmetic_regs[4];
+    size_t stack_size;
+    /* stack top as an offset from stack roof */
+    ptrdiff_t stack_top;
+
+    /* captured cpu, only to check it is restored into a matching one */
+    const struct decoded_op *program;
+    ptrdiff_t stack_capacity;
+
+    size_t page_count;
+    /* captured blocks, NULL for a block containing only zeros */
+    struct cpu_page *pages[];
+};
+
+/* snapshots are restored from many threads, references are atomic with GCC */
+static void page_acquire(struct cpu_page *page)
+{
+    if (page == NULL)
+        return;
+#ifdef __GNUC__
+    __atomic_add_fetch(&page->references, 1, __ATOMIC_RELAXED);
+#else
+    ++page->references;
+#endif
+}
+
+static void page_release(struct cpu_page *page)
+{
+    if (page == NULL)
+        return;
+#ifdef __GNUC__
+    if (__atomic_sub_fetch(&page->references, 1, __ATOMIC_ACQ_REL) == 0)
+        free(page);
+#else
+    if (--page->references == 0)
+        free(page);
+#endif
+}
+
+size_t snapshot_page_count(const struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    if (cpu->stack_bottom < cpu->stack_roof)
+        return 0;
+    return (cpu->stack_bottom - cpu->stack_pages) / CPU_PAGE_CELLS + 1;
+}
+
+void snapshot_release(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    if (cpu->snapshot_pages == NULL)
+        return;
+    size_t count = snapshot_page_count(cpu);
+    for (size_t i = 0; i < count; ++i)
+        page_release(cpu->snapshot_pages[i]);
+    free(cpu->snapshot_pages);
+    cpu->snapshot_pages = NULL;
+}
+
+/* stores the range of stack cells covered by the block into first and end */
+static void page_range(const struct cpu *cpu, size_t index,
+                       int32_t **first, int32_t **end)
+{
+    *first = cpu->stack_pages + index * CPU_PAGE_CELLS;
+    *end = *first + CPU_PAGE_CELLS;
+    if (*first < cpu->stack_roof)
+        *first = cpu->stack_roof;
+    if (*end > cpu->stack_bottom + 1)
+        *end = cpu->stack_bottom + 1;
+}
+
+/* makes the blocks of the snapshot the ones the cpu is compared with */
+static void set_base(struct cpu *cpu, const struct cpu_snapshot *snapshot)
+{
+    if (cpu->snapshot_pages == NULL) {
+        cpu->snapshot_pages = calloc(snapshot->page_count + 1,
+                                     sizeof(struct cpu_page *));
+        /* without the base every block is copied, it is still correct */
+        if (cpu->snapshot_pages == NULL)
+            return;
+    }
+
+    for (size_t i = 0; i < snapshot->page_count; ++i) {
+        page_acquire(snapshot->pages[i]);
+        page_release(cpu->snapshot_pages[i]);
+        cpu->snapshot_pages[i] = snapshot->pages[i];
+        cpu->stack_dirty[i] = 0;
+    }
+}
+
+struct cpu_snapshot *cpu_snapshot(struct cpu *cpu)
+{
+    assert(cpu != NULL);
+
+    size_t count = snapshot_page_count(cpu);
+    struct cpu_snapshot *snapshot = malloc(sizeof(struct cpu_snapshot) +
+                                           count * sizeof(struct cpu_page *));
+    if (snapshot == NULL)
+        return NULL;
+
+    snapshot->status = cpu->status;
+    snapshot->instruction_index = cpu->instruction_index;
+    memcpy(snapshot->arithmetic_regs, cpu->arithmetic_regs,
+           sizeof(cpu->arithmetic_regs));
+    snapshot->stack_size = cpu->stack_size;
+    snapshot->stack_top = cpu->stack_top - cpu->stack_roof;
+    snapshot->program = cpu->program;
+    snapshot->stack_capacity = cpu->stack_bottom - cpu->stack_roof + 1;
+    snapshot->page_count = count;
+
+    /* cells in front of the stack top are always zero (pop clears them) */
+    const int32_t *filled = cpu->stack_size > 0 ? cpu->stack_top
+                                                : cpu->stack_bottom + 1;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (cpu->snapshot_pages != NULL && !cpu->stack_dirty[i]) {
+            snapshot->pages[i] = cpu->snapshot_pages[i];
+            page_acquire(snapshot->pages[i]);
+            continue;
+        }
+
+        int32_t *first, *end;
+        page_range(cpu, i, &first, &end);
+        if (end <= filled) {
+            snapshot->pages[i] = NULL;
+            continue;
+        }
+
+        struct cpu_page *page = malloc(sizeof(struct cpu_page));
+        if (page == NULL) {
+            snapshot->page_count = i;
+            cpu_snapshot_destroy(snapshot);
+            return NULL;
+        }
+        page->references = 1;
+        ptrdiff_t offset = first - (cpu->stack_pages + i * CPU_PAGE_CELLS);
+        memcpy(page->cells + offset, first, (end - first) * sizeof(int32_t));
+        snapshot->pages[i] = page;
+    }
+
+    set_base(cpu, snapshot);
+    return snapshot;
+}
+
+void cpu_restore(struct cpu *cpu, const struct cpu_snapshot *snapshot)
+{
+    assert(cpu != NULL);
+    assert(snapshot != NULL);
+    assert(snapshot->program == cpu->program);
+    assert(snapshot->stack_capacity == cpu->stack_bottom - cpu->stack_roof + 1);
+
+    /*
+     * cells in front of the stack top are zero, an empty page of the snapshot
+     * only clears what is filled now (a fresh clone touches no pages)
+     */
+    int32_t *filled = cpu->stack_size > 0 ? cpu->stack_top
+                                          : cpu->stack_bottom + 1;
+
+    for (size_t i = 0; i < snapshot->page_count; ++i) {
+        if (cpu->snapshot_pages != NULL && !cpu->stack_dirty[i] &&
+            cpu->snapshot_pages[i] == snapshot->pages[i])
+            continue;
+
+        int32_t *first, *end;
+        page_range(cpu, i, &first, &end);
+        if (snapshot->pages[i] == NULL) {
+            if (first < filled)
+                first = filled;
+            if (first < end)
+                memset(first, 0, (end - first) * sizeof(int32_t));
+        } else {
+            ptrdiff_t offset = first - (cpu->stack_pages + i * CPU_PAGE_CELLS);
+            memcpy(first, snapshot->pages[i]->cells + offset,
+                   (end - first) * sizeof(int32_t));
+        }
+    }
+
+    cpu->status = snapshot->status;
+    cpu->instruction_index = snapshot->instruction_index;
+    memcpy(cpu->arithmetic_regs, snapshot->arithmetic_regs,
+           sizeof(cpu->arithmetic_regs));
+    cpu->stack_size = snapshot->stack_size;
+    cpu->stack_top = cpu->stack_roof + snapshot->stack_top;
+
+    set_base(cpu, snapshot);
+}
+
+void cpu_snapshot_destroy(struct cpu_snapshot *snapshot)
+{
+    if (snapshot == NULL)
+        return;
+    for (size_t i = 0; i < snapshot->page_count; ++i)
+        page_release(snapshot->pages[i]);
+    free(snapshot);
+}
+
+size_t cpu_snapshot_size(const struct cpu_snapshot *snapshot)
+{
+    assert(snapshot != NULL);
+
+    size_t size = sizeof(struct cpu_snapshot) +
+                  snapshot->page_count * sizeof(struct cpu_page *);
+    for (size_t i = 0; i < snapshot->page_count; ++i) {
+        const struct cpu_page *page = snapshot->pages[i];
+        if (page == NULL)
+            continue;
+#ifdef __GNUC__
+        long references = __atomic_load_n(&page->references, __ATOMIC_RELAXED);
+#else
+        long references = page->references;
+#endif
+        size += sizeof(struct cpu_page) / references;
+    }
+    return size;
+}
@@ -0,0 +1,237 @@
+#include "../include/cpu.h"
+#include "../include/instructions.h"
+#include "../include/decode.h"
+#include "../include/io.h"
+#include <stdlib.h>
+#include <assert.h>
+
+#ifdef __GNUC__
+
+/*
+ * Direct-threaded interpreter. Every decoded op gets the address of the label
+ * implementing it (labels as values, GCC extension), so dispatching the next
+ * op is a single indirect jump. Registers and stack pointers are kept
+ * in locals and written back to struct cpu only when a handler from
+ * instructions.c has to be called or the execution stops.
+ */
+
+#define SAVE_STATE() do { \
+    cpu->instruction_index = index; \
+    cpu->arithmetic_regs[REGISTER_A] = regs[REGISTER_A]; \
+    cpu->arithmetic_regs[REGISTER_B] = regs[REGISTER_B]; \
+    cpu->arithmetic_regs[REGISTER_C] = regs[REGISTER_C]; \
+    cpu->arithmetic_regs[REGISTER_D] = regs[REGISTER_D]; \
+    cpu->stack_top = stack_top; \
+    cpu->stack_size = stack_size; \
+} while (0)
+
+#define LOAD_STATE() do { \
+    index = cpu->instruction_index; \
+    regs[REGISTER_A] = cpu->arithmetic_regs[REGISTER_A]; \
+    regs[REGISTER_B] = cpu->arithmetic_regs[REGISTER_B]; \
+    regs[REGISTER_C] = cpu->arithmetic_regs[REGISTER_C]; \
+    regs[REGISTER_D] = cpu->arithmetic_regs[REGISTER_D]; \
+    stack_top = cpu->stack_top; \
+    stack_size = cpu->stack_size; \
+} while (0)
+
+#define DISPATCH() do { \
+    if (executed == steps) \
+        goto out_of_steps; \
+    ++executed; \
+    if ((uint32_t) index >= size) \
+        goto invalid_address; \
+    op = program + index; \
+    goto *code[index]; \
+} while (0)
+
+#define FAIL(error) do { \
+    cpu->status = (error); \
+    goto stop; \
+} while (0)
+
+long long cpu_run_threaded(struct cpu *cpu, size_t steps)
+{
+    static void *const labels[19] = {
+        &&op_nop, &&op_halt, &&op_add, &&op_sub, &&op_mul,
+        &&op_div, &&op_inc, &&op_dec, &&op_loop, &&op_movr,
+        &&op_load, &&op_store, &&op_handler, &&op_handler, &&op_handler,
+        &&op_handler, &&op_swap, &&op_push, &&op_pop
+    };
+
+    assert(cpu != NULL);
+
+    if (cpu->status != CPU_OK)
+        return 0;
+
+    const struct decoded_op *program = cpu->program;
+    const uint32_t size = (uint32_t) cpu->program_size;
+
+    if (cpu->threaded_code == NULL) {
+        cpu->threaded_code = malloc((size > 0 ? size : 1) * sizeof(void *));
+        if (cpu->threaded_code == NULL)
+            return cpu_run(cpu, steps);
+
+        /* fused ops are executed instruction by instruction */
+        for (uint32_t i = 0; i < size; ++i)
+            cpu->threaded_code[i] = decoded_is_valid(program + i)
+                                    ? labels[program[i].opcode] : &&op_handler;
+    }
+    void *const *code = cpu->threaded_code;
+
+    int32_t *const stack_bottom = cpu->stack_bottom;
+    int32_t *const stack_roof = cpu->stack_roof;
+    const int8_t has_stack = cpu->has_stack;
+    /* written blocks of the stack are marked as in snapshot_mark() */
+    int32_t *const stack_pages = cpu->stack_pages;
+    unsigned char *const stack_dirty = cpu->stack_dirty;
+
+    int32_t index;
+    int32_t regs[4];
+    int32_t *stack_top;
+    size_t stack_size;
+    LOAD_STATE();
+
+    const struct decoded_op *op;
+    size_t executed = 0;
+    int32_t *pointer;
+    int64_t offset;
+    int32_t temp;
+
+    DISPATCH();
+
+op_nop:
+    index = op->next;
+    DISPATCH();
+
+op_halt:
+    index = op->next;
+    FAIL(CPU_HALTED);
+
+op_add:
+    regs[REGISTER_A] += regs[op->reg1];
+    index = op->next;
+    DISPATCH();
+
+op_sub:
+    regs[REGISTER_A] -= regs[op->reg1];
+    index = op->next;
+    DISPATCH();
+
+op_mul:
+    regs[REGISTER_A] *= regs[op->reg1];
+    index = op->next;
+    DISPATCH();
+
+op_div:
+    if (regs[op->reg1] == 0)
+        FAIL(CPU_DIV_BY_ZERO);
+    if (regs[op->reg1] == -1)
+        regs[REGISTER_A] = (int32_t) (0u - (uint32_t) regs[REGISTER_A]);
+    else
+        regs[REGISTER_A] /= regs[op->reg1];
+    index = op->next;
+    DISPATCH();
+
+op_inc:
+    ++regs[op->reg1];
+    index = op->next;
+    DISPATCH();
+
+op_dec:
+    --regs[op->reg1];
+    index = op->next;
+    DISPATCH();
+
+op_loop:
+    index = regs[REGISTER_C] ? op->number : op->next;
+    DISPATCH();
+
+op_movr:
+    regs[op->reg1] = op->number;
+    index = op->next;
+    DISPATCH();
+
+op_load:
+    offset = (int64_t) regs[REGISTER_D] + op->number;
+    if (!has_stack || stack_size == 0 || offset < 0 ||
+        offset > stack_bottom - stack_top)
+        FAIL(CPU_INVALID_STACK_OPERATION);
+    pointer = stack_top + offset;
+    regs[op->reg1] = *pointer;
+    index = op->next;
+    DISPATCH();
+
+op_store:
+    offset = (int64_t) regs[REGISTER_D] + op->number;
+    if (!has_stack || stack_size == 0 || offset < 0 ||
+        offset > stack_bottom - stack_top)
+        FAIL(CPU_INVALID_STACK_OPERATION);
+    pointer = stack_top + offset;
+    *pointer = regs[op->reg1];
+    stack_dirty[(pointer - stack_pages) / CPU_PAGE_CELLS] = 1;
+    index = op->next;
+    DISPATCH();
+
+op_swap:
+    temp = regs[op->reg1];
+    regs[op->reg1] = regs[op->reg2];
+    regs[op->reg2] = temp;
+    index = op->next;
+    DISPATCH();
+
+op_push:
+    if (stack_bottom - stack_size < stack_roof)
+        FAIL(CPU_INVALID_STACK_OPERATION);
+    if (stack_size != 0)
+        --stack_top;
+    *stack_top = regs[op->reg1];
+    stack_dirty[(stack_top - stack_pages) / CPU_PAGE_CELLS] = 1;
+    ++stack_size;
+    index = op->next;
+    DISPATCH();
+
+op_pop:
+    if (stack_size == 0)
+        FAIL(CPU_INVALID_STACK_OPERATION);
+    regs[op->reg1] = *stack_top;
+    *stack_top = 0;
+    stack_dirty[(stack_top - stack_pages) / CPU_PAGE_CELLS] = 1;
+    if (stack_size > 1)
+        ++stack_top;
+    --stack_size;
+    index = op->next;
+    DISPATCH();
+
+op_handler:
+    /* I/O, invalid and dynamic ops are executed by their handler */
+    SAVE_STATE();
+    if (!execute_single(cpu, op)) {
+        LOAD_STATE();
+        goto stop;
+    }
+    LOAD_STATE();
+    DISPATCH();
+
+invalid_address:
+    FAIL(CPU_INVALID_ADDRESS);
+
+out_of_steps:
+    SAVE_STATE();
+    return executed;
+
+stop:
+    SAVE_STATE();
+    cpu->io->flush(cpu->io);
+    return cpu->status == CPU_HALTED ? (long long) executed
+                                     : -(long long) executed;
+}
+
+#else
+
+long long cpu_run_threaded(struct cpu *cpu, size_t steps)
+{
+    return cpu_run(cpu, steps);
+}
+
+#endif  // __GNUC__
@@ -0,0 +1,456 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "../include/trace.h"
+#include "../include/instructions.h"
+#include "../include/decode.h"
+#include "../include/io.h"
+#include <assert.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+
+/* the longest record: flags, index, registers, stack size and status */
+#define RECORD_MAX_SIZE (1 + 5 + 4 * 5 + 5 + 1)
+
+struct trace_writer {
+    /* must be the first member, struct cpu_io * is cast to trace_writer * */
+    struct cpu_io io;
+    /* backend of the cpu, every call is passed to it */
+    struct cpu_io *inner;
+
+    int fd;
+    bool failed;
+    struct trace_state last;
+
+    size_t length;
+    unsigned char buffer[TRACE_BUFFER_SIZE];
+};
+
+struct trace_reader {
+    FILE *file;
+    /* program from the header, decoded to know where instructions end */
+    struct decoded_op *program;
+    int32_t program_size;
+    unsigned char *output;
+    size_t output_capacity;
+};
+
+static inline uint32_t zigzag(int32_t value)
+{
+    return ((uint32_t) value << 1) ^ (value < 0 ? UINT32_MAX : 0);
+}
+
+static inline int32_t unzigzag(uint32_t value)
+{
+    return (int32_t) ((value >> 1) ^ (0u - (value & 1)));
+}
+
+/* difference of two 32-bit values, wrapping around */
+static inline int32_t delta(int32_t new_value, int32_t old_value)
+{
+    return (int32_t) ((uint32_t) new_value - (uint32_t) old_value);
+}
+
+static void write_out(struct trace_writer *writer)
+{
+    size_t written = 0;
+    while (written < writer->length && !writer->failed) {
+        ssize_t result = write(writer->fd, writer->buffer + written,
+                               writer->length - written);
+        if (result < 0 && errno == EINTR)
+            continue;
+        if (result <= 0)
+            writer->failed = true;
+        else
+            written += result;
+    }
+    writer->length = 0;
+}
+
+/* makes room for `size` bytes in the buffer */
+static inline void reserve(struct trace_writer *writer, size_t size)
+{
+    if (TRACE_BUFFER_SIZE - writer->length < size)
+        write_out(writer);
+}
+
+/* writes the varint at p (at most 5 bytes), returns the end of it */
+static inline unsigned char *encode(unsigned char *p, uint32_t value)
+{
+    while (value >= 0x80) {
+        *p++ = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    *p++ = (unsigned char) value;
+    return p;
+}
+
+/* the caller reserves 5 bytes */
+static inline void put_varint(struct trace_writer *writer, uint32_t value)
+{
+    unsigned char *end = encode(writer->buffer + writer->length, value);
+    writer->length = end - writer->buffer;
+}
+
+static void put_output(struct trace_writer *writer, const char *bytes,
+                       size_t length)
+{
+    assert(length > 0 && length < TRACE_OUTPUT);
+
+    reserve(writer, 1 + length);
+    writer->buffer[writer->length++] = TRACE_OUTPUT | length;
+    memcpy(writer->buffer + writer->length, bytes, length);
+    writer->length += length;
+}
+
+static void put_state(struct trace_writer *writer, const struct cpu *cpu)
+{
+    reserve(writer, RECORD_MAX_SIZE);
+    put_varint(writer, zigzag(cpu->instruction_index));
+    for (int i = 0; i < 4; ++i)
+        put_varint(writer, zigzag(cpu->arithmetic_regs[i]));
+    put_varint(writer, zigzag((int32_t) cpu->stack_size));
+    writer->buffer[writer->length++] = (unsigned char) cpu->status;
+}
+
+static int writer_read_number(struct cpu_io *io, int32_t *number)
+{
+    struct cpu_io *inner = ((struct trace_writer *) io)->inner;
+    return inner->read_number(inner, number);
+}
+
+static int writer_read_byte(struct cpu_io *io)
+{
+    struct cpu_io *inner = ((struct trace_writer *) io)->inner;
+    return inner->read_byte(inner);
+}
+
+static void writer_write_number(struct cpu_io *io, int32_t number)
+{
+    struct trace_writer *writer = (struct trace_writer *) io;
+
+    /* same format as printf("%" PRId32) of the stdio backend */
+    char digits[16];
+    int length = snprintf(digits, sizeof(digits), "%" PRId32, number);
+    put_output(writer, digits, length);
+    writer->inner->write_number(writer->inner, number);
+}
+
+static void writer_write_byte(struct cpu_io *io, unsigned char byte)
+{
+    struct trace_writer *writer = (struct trace_writer *) io;
+
+    put_output(writer, (const char *) &byte, 1);
+    writer->inner->write_byte(writer->inner, byte);
+}
+
+static void writer_flush(struct cpu_io *io)
+{
+    struct trace_writer *writer = (struct trace_writer *) io;
+
+    write_out(writer);
+    writer->inner->flush(writer->inner);
+}
+
+struct trace_writer *trace_create(struct cpu *cpu, int fd)
+{
+    assert(cpu != NULL);
+
+    struct trace_writer *writer = malloc(sizeof(struct trace_writer));
+    if (writer == NULL)
+        return NULL;
+
+    writer->io.read_number = &writer_read_number;
+    writer->io.read_byte = &writer_read_byte;
+    writer->io.write_number = &writer_write_number;
+    writer->io.write_byte = &writer_write_byte;
+    writer->io.flush = &writer_flush;
+    writer->inner = cpu->io;
+    cpu->io = &writer->io;
+
+    writer->fd = fd;
+    writer->failed = false;
+    writer->length = 0;
+
+    memcpy(writer->buffer, TRACE_MAGIC, sizeof(TRACE_MAGIC) - 1);
+    writer->length = sizeof(TRACE_MAGIC) - 1;
+    writer->buffer[writer->length++] = TRACE_VERSION;
+    put_varint(writer, cpu->program_size);
+    for (int32_t i = 0; i < cpu->program_size; ++i) {
+        reserve(writer, 5);
+        put_varint(writer, zigzag(cpu->memory[i]));
+    }
+    put_state(writer, cpu);
+
+    writer->last.instruction_index = cpu->instruction_index;
+    memcpy(writer->last.arithmetic_regs, cpu->arithmetic_regs,
+           sizeof(cpu->arithmetic_regs));
+    writer->last.stack_size = (int32_t) cpu->stack_size;
+    writer->last.status = cpu->status;
+    return writer;
+}
+
+long long trace_run(struct trace_writer *writer, struct cpu *cpu,
+                    size_t steps)
+{
+    assert(writer != NULL);
+    assert(cpu != NULL);
+
+    if (cpu->status != CPU_OK)
+        return 0;
+
+    /* the state is kept in locals, byte stores would make the compiler
+     * reload it from the writer after every one of them */
+    int32_t last_index = writer->last.instruction_index;
+    int32_t last_regs[4];
+    memcpy(last_regs, writer->last.arithmetic_regs, sizeof(last_regs));
+    int32_t last_stack_size = writer->last.stack_size;
+
+    size_t executed = 0;
+    int result = 1;
+    while (executed < steps && result > 0) {
+        /* negative index is converted to a big unsigned number */
+        uint32_t index = (uint32_t) cpu->instruction_index;
+        if (index >= (uint32_t) cpu->program_size) {
+            cpu->status = CPU_INVALID_ADDRESS;
+            result = 0;
+        } else {
+            result = execute_single(cpu, cpu->program + index);
+        }
+        ++executed;
+
+        reserve(writer, RECORD_MAX_SIZE);
+        unsigned char *flags = writer->buffer + writer->length;
+        unsigned char *p = flags + 1;
+        unsigned char mask = 0;
+
+        /* moving to the following instruction is implied */
+        if (index >= (uint32_t) cpu->program_size ||
+            cpu->instruction_index != cpu->program[index].next) {
+            mask |= TRACE_JUMP;
+            p = encode(p, zigzag(delta(cpu->instruction_index, last_index)));
+        }
+        last_index = cpu->instruction_index;
+
+        for (int i = 0; i < 4; ++i) {
+            int32_t value = cpu->arithmetic_regs[i];
+            if (value != last_regs[i]) {
+                mask |= TRACE_REGISTER(i);
+                p = encode(p, zigzag(delta(value, last_regs[i])));
+                last_regs[i] = value;
+            }
+        }
+        int32_t stack_size = (int32_t) cpu->stack_size;
+        if (stack_size != last_stack_size) {
+            mask |= TRACE_STACK;
+            p = encode(p, zigzag(delta(stack_size, last_stack_size)));
+            last_stack_size = stack_size;
+        }
+        /* the status changes only with the last instruction */
+        if (result <= 0) {
+            mask |= TRACE_STATUS;
+            *p++ = (unsigned char) cpu->status;
+        }
+
+        *flags = mask;
+        writer->length = p - writer->buffer;
+    }
+
+    writer->last.instruction_index = last_index;
+    memcpy(writer->last.arithmetic_regs, last_regs, sizeof(last_regs));
+    writer->last.stack_size = last_stack_size;
+    writer->last.status = cpu->status;
+
+    if (result > 0)
+        return steps;
+    cpu->io->flush(cpu->io);
+    return cpu->status == CPU_HALTED ? (long long) executed
+                                     : -(long long) executed;
+}
+
+int trace_close(struct trace_writer *writer, struct cpu *cpu)
+{
+    assert(writer != NULL);
+    assert(cpu != NULL);
+
+    write_out(writer);
+    if (cpu->io == &writer->io)
+        cpu->io = writer->inner;
+
+    int result = writer->failed ? -1 : 0;
+    free(writer);
+    return result;
+}
+
+/* returns false at the end of the file */
+static bool get_varint(FILE *file, uint32_t *value)
+{
+    *value = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        int byte = getc(file);
+        if (byte == EOF)
+            return false;
+        *value |= (uint32_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
+static bool get_signed(FILE *file, int32_t *value)
+{
+    uint32_t encoded;
+    if (!get_varint(file, &encoded))
+        return false;
+    *value = unzigzag(encoded);
+    return true;
+}
+
+static bool get_status(FILE *file, enum cpu_status *status)
+{
+    int byte = getc(file);
+    if (byte == EOF || byte > CPU_WAITING_INPUT)
+        return false;
+    *status = (enum cpu_status) byte;
+    return true;
+}
+
+static bool get_program(struct trace_reader *reader)
+{
+    uint32_t size;
+    if (!get_varint(reader->file, &size) || size > INT32_MAX)
+        return false;
+
+    int32_t *words = malloc((size + 1) * sizeof(int32_t));
+    if (words == NULL)
+        return false;
+    for (uint32_t i = 0; i < size; ++i) {
+        if (!get_signed(reader->file, &words[i])) {
+            free(words);
+            return false;
+        }
+    }
+    reader->program = cpu_decode(words, size);
+    reader->program_size = size;
+    free(words);
+    return reader->program != NULL;
+}
+
+struct trace_reader *trace_open(FILE *file, struct trace_state *state)
+{
+    assert(file != NULL);
+    assert(state != NULL);
+
+    char magic[sizeof(TRACE_MAGIC) - 1];
+    if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) ||
+        memcmp(magic, TRACE_MAGIC, sizeof(magic)) != 0 ||
+        getc(file) != TRACE_VERSION)
+        return NULL;
+
+    struct trace_reader *reader = calloc(1, sizeof(struct trace_reader));
+    if (reader == NULL)
+        return NULL;
+    reader->file = file;
+    if (!get_program(reader) ||
+        !get_signed(file, &state->instruction_index)) {
+        trace_reader_destroy(reader);
+        return NULL;
+    }
+    for (int i = 0; i < 4; ++i) {
+        if (!get_signed(file, &state->arithmetic_regs[i])) {
+            trace_reader_destroy(reader);
+            return NULL;
+        }
+    }
+    if (!get_signed(file, &state->stack_size) ||
+        !get_status(file, &state->status)) {
+        trace_reader_destroy(reader);
+        return NULL;
+    }
+    return reader;
+}
+
+/* appends `count` bytes of output from the file */
+static bool get_output(struct trace_reader *reader, size_t count,
+                       size_t *length)
+{
+    if (*length + count > reader->output_capacity) {
+        size_t capacity = (*length + count) * 2;
+        unsigned char *output = realloc(reader->output, capacity);
+        if (output == NULL)
+            return false;
+        reader->output = output;
+        reader->output_capacity = capacity;
+    }
+    if (fread(reader->output + *length, 1, count, reader->file) != count)
+        return false;
+    *length += count;
+    return true;
+}
+
+int trace_next(struct trace_reader *reader, struct trace_state *state,
+               const unsigned char **output, size_t *length)
+{
+    assert(reader != NULL);
+    assert(state != NULL);
+    assert(output != NULL);
+    assert(length != NULL);
+
+    *length = 0;
+    *output = reader->output;
+
+    int flags;
+    while ((flags = getc(reader->file)) != EOF && (flags & TRACE_OUTPUT)) {
+        if (!get_output(reader, flags & ~TRACE_OUTPUT, length))
+            return 0;
+        *output = reader->output;
+    }
+    if (flags == EOF)
+        return 0;
+
+    /* the record is applied to a copy, a truncated one is ignored */
+    struct trace_state next = *state;
+    int32_t value;
+    if (flags & TRACE_JUMP) {
+        if (!get_signed(reader->file, &value))
+            return 0;
+        next.instruction_index = (int32_t) ((uint32_t) next.instruction_index
+                                            + (uint32_t) value);
+    } else {
+        uint32_t index = (uint32_t) next.instruction_index;
+        if (index >= (uint32_t) reader->program_size)
+            return 0;
+        next.instruction_index = reader->program[index].next;
+    }
+    for (int i = 0; i < 4; ++i) {
+        if (!(flags & TRACE_REGISTER(i)))
+            continue;
+        if (!get_signed(reader->file, &value))
+            return 0;
+        next.arithmetic_regs[i] = (int32_t) ((uint32_t) next.arithmetic_regs[i]
+                                             + (uint32_t) value);
+    }
+    if (flags & TRACE_STACK) {
+        if (!get_signed(reader->file, &value))
+            return 0;
+        next.stack_size = (int32_t) ((uint32_t) next.stack_size +
+                                     (uint32_t) value);
+    }
+    if ((flags & TRACE_STATUS) && !get_status(reader->file, &next.status))
+        return 0;
+
+    *state = next;
+    return 1;
+}
+
+void trace_reader_destroy(struct trace_reader *reader)
+{
+    if (reader == NULL)
+        return;
+    free(reader->program);
+    free(reader->output);
+    free(reader);
+}
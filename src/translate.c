@@ -0,0 +1,698 @@
+#include "../include/translate.h"
+#include "../include/decode.h"
+#include "../include/instructions.h"
+#include "../include/io.h"
+#include <stdlib.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+
+enum micro_kind {
+    MICRO_SET,          /* reg = value */
+    MICRO_MOVE,         /* reg = source */
+    MICRO_SWAP,         /* reg <-> source */
+    MICRO_ADD,          /* reg += source */
+    MICRO_SUB,          /* reg -= source */
+    MICRO_MUL,          /* reg *= source */
+    MICRO_ADD_NUMBER,   /* reg += value */
+    MICRO_MUL_NUMBER,   /* reg *= value */
+    MICRO_SHIFT,        /* reg <<= value */
+    MICRO_DIV_NUMBER,   /* reg /= value, value is neither 0 nor -1 */
+    /* I/O micro-ops are the last ones */
+    MICRO_OUT,          /* out source */
+    MICRO_OUT_NUMBER,   /* out value */
+    MICRO_PUT_NUMBER    /* put value, value is in <0, 255> */
+};
+
+struct micro_op {
+    uint8_t kind;
+    uint8_t reg;
+    uint8_t source;
+    int32_t value;
+};
+
+/* rows and columns of the affine map of registers A-D (see affine_map()) */
+#define AFFINE_SIZE 5
+
+struct block {
+    /* count of instructions of the block */
+    int32_t length;
+    /* instruction_index after the block (after `loop` if it is not taken) */
+    int32_t next;
+    /* non-zero if the block ends with `loop` to `target` */
+    int8_t loops;
+    int32_t target;
+    /* non-zero if `target` is the start of the block and it has no I/O */
+    int8_t repeats;
+    /* non-zero if the iterations can be skipped at once by `map` */
+    int8_t closed_form;
+    uint32_t map[AFFINE_SIZE][AFFINE_SIZE];
+    int32_t count;
+    struct micro_op ops[];
+};
+
+struct translation {
+    int32_t size;
+    /* block starting at each index, NULL where none was translated */
+    struct block **blocks;
+};
+
+/* the fewest iterations skipped in closed form, fewer are run one by one */
+#define CLOSED_FORM_MIN 64
+
+/* the most micro-ops of a block, two per instruction and four stores */
+#define MICRO_MAX (2 * FUSED_MAX_LENGTH + 4)
+
+/* state of registers while the block is lifted */
+struct lifter {
+    /* registers whose values are known, they are stored at the end */
+    bool known[4];
+    uint32_t value[4];
+
+    struct micro_op ops[MICRO_MAX];
+    int32_t count;
+
+    int32_t next;
+    int8_t loops;
+    int32_t target;
+};
+
+static void emit(struct lifter *lifter, enum micro_kind kind, int32_t reg,
+                 int32_t source, uint32_t value)
+{
+    assert(lifter->count < MICRO_MAX);
+
+    struct micro_op *op = lifter->ops + lifter->count++;
+    op->kind = kind;
+    op->reg = reg;
+    op->source = source;
+    op->value = (int32_t) value;
+}
+
+/* A = A * number for A not known */
+static void multiply(struct lifter *lifter, uint32_t number)
+{
+    if (number == 0) {
+        lifter->known[REGISTER_A] = true;
+        lifter->value[REGISTER_A] = 0;
+    } else if ((number & (number - 1)) == 0) {
+        uint32_t shift = 0;
+        while ((number >> shift) != 1)
+            ++shift;
+        if (shift > 0)
+            emit(lifter, MICRO_SHIFT, REGISTER_A, 0, shift);
+    } else {
+        emit(lifter, MICRO_MUL_NUMBER, REGISTER_A, 0, number);
+    }
+}
+
+static void lift_add(struct lifter *lifter, int32_t source, bool subtract)
+{
+    bool *known = lifter->known;
+    uint32_t *value = lifter->value;
+
+    if (known[REGISTER_A] && known[source]) {
+        value[REGISTER_A] += subtract ? 0u - value[source] : value[source];
+    } else if (known[source]) {
+        if (value[source] != 0)
+            emit(lifter, MICRO_ADD_NUMBER, REGISTER_A, 0,
+                 subtract ? 0u - value[source] : value[source]);
+    } else if (subtract && source == REGISTER_A) {
+        known[REGISTER_A] = true;
+        value[REGISTER_A] = 0;
+    } else if (known[REGISTER_A] && !subtract) {
+        emit(lifter, MICRO_MOVE, REGISTER_A, source, 0);
+        if (value[REGISTER_A] != 0)
+            emit(lifter, MICRO_ADD_NUMBER, REGISTER_A, 0, value[REGISTER_A]);
+        known[REGISTER_A] = false;
+    } else {
+        if (known[REGISTER_A])
+            emit(lifter, MICRO_SET, REGISTER_A, 0, value[REGISTER_A]);
+        emit(lifter, subtract ? MICRO_SUB : MICRO_ADD, REGISTER_A, source, 0);
+        known[REGISTER_A] = false;
+    }
+}
+
+static void lift_mul(struct lifter *lifter, int32_t source)
+{
+    bool *known = lifter->known;
+    uint32_t *value = lifter->value;
+
+    if (known[REGISTER_A] && known[source]) {
+        value[REGISTER_A] *= value[source];
+    } else if (known[source]) {
+        multiply(lifter, value[source]);
+    } else if (known[REGISTER_A]) {
+        uint32_t number = value[REGISTER_A];
+        emit(lifter, MICRO_MOVE, REGISTER_A, source, 0);
+        known[REGISTER_A] = false;
+        multiply(lifter, number);
+    } else {
+        emit(lifter, MICRO_MUL, REGISTER_A, source, 0);
+    }
+}
+
+/* returns false if the division could fail, the state is not changed then */
+static bool lift_div(struct lifter *lifter, int32_t source)
+{
+    if (!lifter->known[source] || lifter->value[source] == 0)
+        return false;
+
+    int32_t divisor = (int32_t) lifter->value[source];
+    uint32_t *a = &lifter->value[REGISTER_A];
+    /* INT32_MIN / -1 wraps around like in exec_div() */
+    if (lifter->known[REGISTER_A])
+        *a = divisor == -1 ? 0u - *a : (uint32_t) ((int32_t) *a / divisor);
+    else if (divisor == -1)
+        emit(lifter, MICRO_MUL_NUMBER, REGISTER_A, 0, UINT32_MAX);
+    else if (divisor != 1)
+        emit(lifter, MICRO_DIV_NUMBER, REGISTER_A, 0, divisor);
+    return true;
+}
+
+static void lift_swap(struct lifter *lifter, int32_t reg1, int32_t reg2)
+{
+    bool *known = lifter->known;
+    uint32_t *value = lifter->value;
+
+    if (reg1 == reg2)
+        return;
+    if (!known[reg1] && !known[reg2]) {
+        emit(lifter, MICRO_SWAP, reg1, reg2, 0);
+        return;
+    }
+    /* the unknown one is moved, the known value only changes its place */
+    if (known[reg1] != known[reg2])
+        emit(lifter, MICRO_MOVE, known[reg1] ? reg1 : reg2,
+             known[reg1] ? reg2 : reg1, 0);
+
+    bool known1 = known[reg1];
+    uint32_t value1 = value[reg1];
+    known[reg1] = known[reg2];
+    value[reg1] = value[reg2];
+    known[reg2] = known1;
+    value[reg2] = value1;
+}
+
+/* returns false if the instruction can't be a part of a block */
+static bool lift_instruction(struct lifter *lifter, const struct decoded_op *op)
+{
+    bool *known = lifter->known;
+    uint32_t *value = lifter->value;
+
+    switch (op->opcode) {
+    case 0:
+        return true;
+    case 2:
+    case 3:
+        lift_add(lifter, op->reg1, op->opcode == 3);
+        return true;
+    case 4:
+        lift_mul(lifter, op->reg1);
+        return true;
+    case 5:
+        return lift_div(lifter, op->reg1);
+    case 6:
+    case 7:
+        if (known[op->reg1])
+            value[op->reg1] += op->opcode == 6 ? 1 : UINT32_MAX;
+        else
+            emit(lifter, MICRO_ADD_NUMBER, op->reg1, 0,
+                 op->opcode == 6 ? 1 : UINT32_MAX);
+        return true;
+    case 8:
+        lifter->loops = 1;
+        lifter->target = op->number;
+        return true;
+    case 9:
+        known[op->reg1] = true;
+        value[op->reg1] = (uint32_t) op->number;
+        return true;
+    case 14:
+        if (known[op->reg1])
+            emit(lifter, MICRO_OUT_NUMBER, 0, 0, value[op->reg1]);
+        else
+            emit(lifter, MICRO_OUT, 0, op->reg1, 0);
+        return true;
+    case 15:
+        /* put of an unknown value could fail */
+        if (!known[op->reg1] || value[op->reg1] > UCHAR_MAX)
+            return false;
+        emit(lifter, MICRO_PUT_NUMBER, 0, 0, value[op->reg1]);
+        return true;
+    case 16:
+        lift_swap(lifter, op->reg1, op->reg2);
+        return true;
+    default:
+        return false;
+    }
+}
+
+/*
+ * Lifts instructions from `start` until one which can't be a part of a block,
+ * `loop` or FUSED_MAX_LENGTH of them, returns their count.
+ */
+static int32_t lift(struct lifter *lifter, const struct decoded_op *program,
+                    int32_t size, int32_t start)
+{
+    memset(lifter, 0, sizeof(struct lifter));
+
+    int32_t index = start;
+    int32_t length = 0;
+    /* negative index is converted to a big unsigned number */
+    while (length < FUSED_MAX_LENGTH && (uint32_t) index < (uint32_t) size) {
+        const struct decoded_op *op = program + index;
+        if (!decoded_is_valid(op) || !lift_instruction(lifter, op))
+            break;
+        ++length;
+        index = op->next;
+        if (lifter->loops)
+            break;
+    }
+    lifter->next = index;
+    return length;
+}
+
+/*
+ * Removes micro-ops writing registers which are written again before
+ * they are read, every register is read at the end of the block.
+ */
+static void eliminate_dead_stores(struct lifter *lifter)
+{
+    bool live[4] = { true, true, true, true };
+    bool keep[MICRO_MAX];
+
+    for (int32_t i = lifter->count - 1; i >= 0; --i) {
+        const struct micro_op *op = lifter->ops + i;
+        keep[i] = true;
+        switch (op->kind) {
+        case MICRO_SET:
+            keep[i] = live[op->reg];
+            live[op->reg] = false;
+            break;
+        case MICRO_MOVE:
+            keep[i] = live[op->reg];
+            if (keep[i]) {
+                live[op->reg] = false;
+                live[op->source] = true;
+            }
+            break;
+        case MICRO_SWAP: {
+            bool live1 = live[op->reg];
+            live[op->reg] = live[op->source];
+            live[op->source] = live1;
+            keep[i] = live[op->reg] || live[op->source];
+            break;
+        }
+        case MICRO_ADD:
+        case MICRO_SUB:
+        case MICRO_MUL:
+            keep[i] = live[op->reg];
+            if (keep[i])
+                live[op->source] = true;
+            break;
+        case MICRO_ADD_NUMBER:
+        case MICRO_MUL_NUMBER:
+        case MICRO_SHIFT:
+        case MICRO_DIV_NUMBER:
+            keep[i] = live[op->reg];
+            break;
+        case MICRO_OUT:
+            live[op->source] = true;
+            break;
+        default:
+            break;
+        }
+    }
+
+    int32_t count = 0;
+    for (int32_t i = 0; i < lifter->count; ++i)
+        if (keep[i])
+            lifter->ops[count++] = lifter->ops[i];
+    lifter->count = count;
+}
+
+/* stores the known registers and optimizes the micro-ops of the block */
+static void finish(struct lifter *lifter)
+{
+    for (int32_t reg = REGISTER_A; reg <= REGISTER_D; ++reg)
+        if (lifter->known[reg])
+            emit(lifter, MICRO_SET, reg, 0, lifter->value[reg]);
+    eliminate_dead_stores(lifter);
+}
+
+/* returns count of ops the interpreter would dispatch to run the block */
+static int32_t count_dispatches(const struct decoded_op *program, int32_t size,
+                                int32_t start, int32_t length)
+{
+    int32_t dispatches = 0;
+    int32_t index = start;
+    for (int32_t covered = 0; covered < length; ++dispatches) {
+        int32_t fused = program[index].length;
+        covered += fused;
+        for (int32_t i = 0; i < fused && covered < length; ++i)
+            index = program[index].next;
+        /* the fused op reaches behind the block, it ends there anyway */
+        if ((uint32_t) index >= (uint32_t) size)
+            break;
+    }
+    return dispatches;
+}
+
+/*
+ * Returns true if the block runs faster than the ops it replaces. A micro-op
+ * costs less than dispatching an op, but the block has its own overhead,
+ * so it has to save at least 3 dispatches or have fewer micro-ops. Loops
+ * to the start of the block always pay off, they iterate in the block.
+ */
+static bool pays_off(const struct lifter *lifter,
+                     const struct decoded_op *program, int32_t size,
+                     int32_t start, int32_t length)
+{
+    if (length < 2)
+        return false;
+    if (lifter->loops && lifter->target == start)
+        return true;
+    if (length <= program[start].length)
+        return false;
+    int32_t dispatches = count_dispatches(program, size, start, length);
+    return dispatches >= 3 || lifter->count < dispatches;
+}
+
+/*
+ * Builds the map of registers at the start of an iteration to registers
+ * at its end, new[r] = sum of map[r][j] * old[j] + map[r][4], all modulo 2^32.
+ * Returns false if some micro-op is not affine (mul of two registers, div)
+ * or touches I/O.
+ */
+static bool affine_map(const struct lifter *lifter,
+                       uint32_t map[AFFINE_SIZE][AFFINE_SIZE])
+{
+    memset(map, 0, AFFINE_SIZE * sizeof(map[0]));
+    for (int i = 0; i < AFFINE_SIZE; ++i)
+        map[i][i] = 1;
+
+    for (int32_t i = 0; i < lifter->count; ++i) {
+        const struct micro_op *op = lifter->ops + i;
+        uint32_t *row = map[op->reg];
+        uint32_t *source = map[op->source];
+        uint32_t temp[AFFINE_SIZE];
+
+        for (int j = 0; j < AFFINE_SIZE; ++j) {
+            switch (op->kind) {
+            case MICRO_SET:
+                row[j] = j == AFFINE_SIZE - 1 ? (uint32_t) op->value : 0;
+                break;
+            case MICRO_MOVE:
+                row[j] = source[j];
+                break;
+            case MICRO_SWAP:
+                temp[j] = row[j];
+                row[j] = source[j];
+                source[j] = temp[j];
+                break;
+            case MICRO_ADD:
+                row[j] += source[j];
+                break;
+            case MICRO_SUB:
+                row[j] -= source[j];
+                break;
+            case MICRO_ADD_NUMBER:
+                if (j == AFFINE_SIZE - 1)
+                    row[j] += (uint32_t) op->value;
+                break;
+            case MICRO_MUL_NUMBER:
+                row[j] *= (uint32_t) op->value;
+                break;
+            case MICRO_SHIFT:
+                row[j] <<= op->value;
+                break;
+            default:
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static struct block *translate_block(const struct lifter *lifter,
+                                     int32_t start, int32_t length)
+{
+    struct block *block = malloc(sizeof(struct block)
+                                 + lifter->count * sizeof(struct micro_op));
+    if (block == NULL)
+        return NULL;
+    block->length = length;
+    block->next = lifter->next;
+    block->loops = lifter->loops;
+    block->target = lifter->target;
+    block->count = lifter->count;
+    memcpy(block->ops, lifter->ops, lifter->count * sizeof(struct micro_op));
+
+    block->repeats = false;
+    block->closed_form = false;
+    if (lifter->loops && lifter->target == start) {
+        block->repeats = true;
+        for (int32_t i = 0; i < lifter->count; ++i)
+            if (lifter->ops[i].kind >= MICRO_OUT)
+                block->repeats = false;
+    }
+    if (block->repeats && affine_map(lifter, block->map)) {
+        /* C has to count by one, so the count of iterations is known */
+        const uint32_t *counter = block->map[REGISTER_C];
+        uint32_t step = counter[AFFINE_SIZE - 1];
+        block->closed_form = counter[REGISTER_A] == 0 &&
+                             counter[REGISTER_B] == 0 &&
+                             counter[REGISTER_C] == 1 &&
+                             counter[REGISTER_D] == 0 &&
+                             (step == 1 || step == UINT32_MAX);
+    }
+    return block;
+}
+
+/* runs the micro-ops of the block once */
+static inline void run_block(const struct block *block, uint32_t *regs,
+                             struct cpu_io *io)
+{
+    const struct micro_op *end = block->ops + block->count;
+    for (const struct micro_op *micro = block->ops; micro < end; ++micro) {
+        uint32_t *reg = regs + micro->reg;
+        switch (micro->kind) {
+        case MICRO_SET:
+            *reg = micro->value;
+            break;
+        case MICRO_MOVE:
+            *reg = regs[micro->source];
+            break;
+        case MICRO_SWAP: {
+            uint32_t temp = *reg;
+            *reg = regs[micro->source];
+            regs[micro->source] = temp;
+            break;
+        }
+        case MICRO_ADD:
+            *reg += regs[micro->source];
+            break;
+        case MICRO_SUB:
+            *reg -= regs[micro->source];
+            break;
+        case MICRO_MUL:
+            *reg *= regs[micro->source];
+            break;
+        case MICRO_ADD_NUMBER:
+            *reg += (uint32_t) micro->value;
+            break;
+        case MICRO_MUL_NUMBER:
+            *reg *= (uint32_t) micro->value;
+            break;
+        case MICRO_SHIFT:
+            *reg <<= micro->value;
+            break;
+        case MICRO_DIV_NUMBER:
+            *reg = (uint32_t) ((int32_t) *reg / micro->value);
+            break;
+        case MICRO_OUT:
+            io->write_number(io, (int32_t) regs[micro->source]);
+            break;
+        case MICRO_OUT_NUMBER:
+            io->write_number(io, micro->value);
+            break;
+        case MICRO_PUT_NUMBER:
+            io->write_byte(io, micro->value);
+            break;
+        }
+    }
+}
+
+static void multiply_maps(uint32_t result[AFFINE_SIZE][AFFINE_SIZE],
+                          const uint32_t left[AFFINE_SIZE][AFFINE_SIZE],
+                          const uint32_t right[AFFINE_SIZE][AFFINE_SIZE])
+{
+    for (int i = 0; i < AFFINE_SIZE; ++i) {
+        for (int j = 0; j < AFFINE_SIZE; ++j) {
+            uint32_t sum = 0;
+            for (int k = 0; k < AFFINE_SIZE; ++k)
+                sum += left[i][k] * right[k][j];
+            result[i][j] = sum;
+        }
+    }
+}
+
+/* applies the map of the block `count` times at once, by repeated squaring */
+static void jump_ahead(const struct block *block, uint32_t *regs,
+                       uint32_t count)
+{
+    uint32_t power[AFFINE_SIZE][AFFINE_SIZE];
+    uint32_t square[AFFINE_SIZE][AFFINE_SIZE];
+    memcpy(power, block->map, sizeof(power));
+
+    for (;;) {
+        if (count & 1) {
+            uint32_t vector[AFFINE_SIZE] = { regs[0], regs[1], regs[2],
+                                             regs[3], 1 };
+            for (int i = 0; i < 4; ++i) {
+                uint32_t sum = 0;
+                for (int j = 0; j < AFFINE_SIZE; ++j)
+                    sum += power[i][j] * vector[j];
+                regs[i] = sum;
+            }
+        }
+        count >>= 1;
+        if (count == 0)
+            break;
+        multiply_maps(square, power, power);
+        memcpy(power, square, sizeof(power));
+    }
+}
+
+/*
+ * Runs further iterations of a block looping to itself while C is not zero,
+ * at most `limit` of them, returns their count.
+ */
+static uint32_t iterate(const struct block *block, uint32_t *regs,
+                        struct cpu_io *io, uint32_t limit)
+{
+    if (block->closed_form && limit >= CLOSED_FORM_MIN) {
+        /* C reaches zero after C (counting down) or 2^32 - C iterations */
+        uint32_t left = block->map[REGISTER_C][AFFINE_SIZE - 1] == UINT32_MAX
+                        ? regs[REGISTER_C] : 0u - regs[REGISTER_C];
+        uint32_t count = left < limit ? left : limit;
+        jump_ahead(block, regs, count);
+        return count;
+    }
+
+    uint32_t count = 0;
+    while (count < limit && regs[REGISTER_C] != 0) {
+        run_block(block, regs, io);
+        ++count;
+    }
+    return count;
+}
+
+static int exec_block(struct cpu *cpu, const struct decoded_op *op)
+{
+    const struct block *block = cpu->translation->blocks[op - cpu->program];
+
+    /* unsigned arithmetic wraps around like the instructions do */
+    uint32_t regs[4];
+    memcpy(regs, cpu->arithmetic_regs, sizeof(regs));
+    run_block(block, regs, cpu->io);
+
+    uint32_t iterations = 1;
+    if (block->repeats && regs[REGISTER_C] != 0) {
+        /* whole iterations which fit into the budget and into the result */
+        size_t budget = cpu->budget < INT_MAX ? cpu->budget : INT_MAX;
+        size_t limit = budget / block->length;
+        if (limit > 1)
+            iterations += iterate(block, regs, cpu->io, limit - 1);
+    }
+
+    memcpy(cpu->arithmetic_regs, regs, sizeof(regs));
+    cpu->instruction_index = block->loops && regs[REGISTER_C] != 0
+                             ? block->target : block->next;
+    return iterations * block->length;
+}
+
+/* pushes the index to be visited if it is inside the program and new */
+static void visit(unsigned char *visited, int32_t *pending, int32_t *count,
+                  int32_t size, int32_t index)
+{
+    /* negative index is converted to a big unsigned number */
+    if ((uint32_t) index < (uint32_t) size && !visited[index]) {
+        visited[index] = 1;
+        pending[(*count)++] = index;
+    }
+}
+
+struct translation *cpu_translate(struct decoded_op *program, int32_t size)
+{
+    assert(program != NULL || size == 0);
+    assert(size >= 0);
+
+    struct translation *translation = calloc(1, sizeof(struct translation));
+    if (translation == NULL)
+        return NULL;
+    translation->size = size;
+    translation->blocks = calloc(size > 0 ? size : 1, sizeof(struct block *));
+    unsigned char *visited = calloc(size > 0 ? size : 1, 1);
+    /* every index is pushed at most once, when it is visited */
+    int32_t *pending = malloc((size > 0 ? size : 1) * sizeof(int32_t));
+    bool failed = translation->blocks == NULL || visited == NULL
+                  || pending == NULL;
+
+    int32_t count = 0;
+    if (!failed)
+        visit(visited, pending, &count, size, 0);
+    while (!failed && count > 0) {
+        int32_t start = pending[--count];
+        const struct decoded_op *op = program + start;
+        struct lifter lifter;
+        int32_t length = lift(&lifter, program, size, start);
+
+        if (length == 0) {
+            /* the instruction runs on its own, only its successors matter */
+            if (decoded_is_valid(op) && op->opcode != 1)
+                visit(visited, pending, &count, size, op->next);
+            if (decoded_is_valid(op) && op->opcode == 8)
+                visit(visited, pending, &count, size, op->number);
+            continue;
+        }
+
+        visit(visited, pending, &count, size, lifter.next);
+        if (lifter.loops)
+            visit(visited, pending, &count, size, lifter.target);
+        finish(&lifter);
+        if (pays_off(&lifter, program, size, start, length)) {
+            struct block *block = translate_block(&lifter, start, length);
+            translation->blocks[start] = block;
+            failed = block == NULL;
+        }
+    }
+    free(visited);
+    free(pending);
+
+    if (failed) {
+        translation_destroy(translation);
+        return NULL;
+    }
+    for (int32_t i = 0; i < size; ++i) {
+        if (translation->blocks[i] != NULL) {
+            program[i].execute = &exec_block;
+            program[i].length = translation->blocks[i]->length;
+        }
+    }
+    return translation;
+}
+
+void translation_destroy(struct translation *translation)
+{
+    if (translation == NULL)
+        return;
+
+    if (translation->blocks != NULL)
+        for (int32_t i = 0; i < translation->size; ++i)
+            free(translation->blocks[i]);
+    free(translation->blocks);
+    free(translation);
+}
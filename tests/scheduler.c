@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/cpu32.h"
+
+/*
+ * Runs two vms of one program by the scheduler of the public API, both
+ * suspend on `in` until their input is pushed:
+ *
+ *     in B
+ *     add B
+ *     in B
+ *     add B
+ *     out A
+ *     halt
+ *
+ * Prints the output and the count of executed instructions of each vm.
+ */
+
+static const unsigned char program[] = {
+    12, 0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 1, 0, 0, 0,
+    12, 0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 1, 0, 0, 0,
+    14, 0, 0, 0, 0, 0, 0, 0, 1, 0, 0, 0
+};
+
+/* runs the queued vms until all of them stopped, returns -1 if one failed */
+static int run(struct cpu32_scheduler *scheduler)
+{
+    while (cpu32_scheduler_runnable(scheduler) > 0) {
+        struct cpu32_vm *vm = cpu32_scheduler_step(scheduler);
+        if (vm == NULL)
+            continue;
+        enum cpu32_status status = cpu32_get_status(vm);
+        if (status != CPU32_WAITING_INPUT && status != CPU32_HALTED)
+            return -1;
+    }
+    return 0;
+}
+
+static int print_output(struct cpu32_vm *vm)
+{
+    char output[64];
+    size_t length = cpu32_take_output(vm, output, sizeof(output));
+    printf("%.*s %lld\n", (int) length, output, cpu32_scheduler_executed(vm));
+    return cpu32_get_status(vm) == CPU32_HALTED ? 0 : -1;
+}
+
+int main(void)
+{
+    struct cpu32_scheduler *scheduler = cpu32_scheduler_create();
+    struct cpu32_vm *first = cpu32_create(program, sizeof(program), 0);
+    struct cpu32_vm *second = first ? cpu32_clone(first) : NULL;
+    int result = -1;
+    if (!scheduler || !first || !second ||
+        cpu32_set_queue_io(first) != 0 || cpu32_set_queue_io(second) != 0) {
+        puts("Insufficient memory for allocation.");
+        goto cleanup;
+    }
+
+    cpu32_scheduler_add(scheduler, first, 1);
+    cpu32_scheduler_add(scheduler, second, 1);
+    if (run(scheduler) != 0 ||
+        cpu32_get_status(first) != CPU32_WAITING_INPUT ||
+        cpu32_get_status(second) != CPU32_WAITING_INPUT)
+        goto cleanup;
+
+    /* "2 " completes the first number, the second `in` waits again */
+    cpu32_push_input(first, "2 ", 2);
+    cpu32_scheduler_wake(scheduler, first);
+    if (run(scheduler) != 0 ||
+        cpu32_get_status(first) != CPU32_WAITING_INPUT)
+        goto cleanup;
+
+    cpu32_push_input(first, "40", 2);
+    cpu32_close_input(first);
+    cpu32_scheduler_wake(scheduler, first);
+    cpu32_push_input(second, "1 2\n", 4);
+    cpu32_scheduler_wake(scheduler, second);
+    if (run(scheduler) != 0)
+        goto cleanup;
+
+    result = print_output(first) | print_output(second);
+
+cleanup:
+    cpu32_destroy(second);
+    cpu32_destroy(first);
+    cpu32_scheduler_destroy(scheduler);
+    return result == 0 ? 0 : 1;
+}
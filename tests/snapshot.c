@@ -0,0 +1,83 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "../include/cpu.h"
+
+/*
+ * Restores a snapshot with one filled stack cell into a fresh clone with
+ * a huge stack, which has to touch only the page of that cell:
+ *
+ *     movr A 7
+ *     push A
+ *     halt
+ */
+
+/* stack capacity in cells, 400 MB */
+#define STACK_CAPACITY (100 * 1000 * 1000)
+
+/* resident memory the restore may add */
+#define RESTORE_LIMIT_KB (16 * 1024)
+
+static long resident_kb(void)
+{
+    long size, resident;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file == NULL)
+        return 0;
+    if (fscanf(file, "%ld %ld", &size, &resident) != 2)
+        resident = 0;
+    fclose(file);
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+int main(void)
+{
+    const int32_t program[] = {9, REGISTER_A, 7, 17, REGISTER_A, 1};
+    int32_t *stack_bottom;
+    int32_t *memory = cpu_create_memory_from_words(program, 6, STACK_CAPACITY,
+                                                   &stack_bottom);
+    struct cpu *cpu = memory ? cpu_create(memory, stack_bottom, STACK_CAPACITY)
+                             : NULL;
+    if (cpu == NULL) {
+        free(memory);
+        puts("Insufficient memory for allocation.");
+        return 1;
+    }
+
+    int result = 1;
+    cpu_run(cpu, 2);
+    struct cpu_snapshot *snapshot = cpu_snapshot(cpu);
+    struct cpu *clone = snapshot ? cpu_clone(cpu) : NULL;
+    if (clone == NULL) {
+        puts("Insufficient memory for allocation.");
+        goto cleanup;
+    }
+
+    long before = resident_kb();
+    cpu_restore(clone, snapshot);
+    long added = resident_kb() - before;
+    cpu_run(clone, 1);
+    if (cpu_get_stack_size(clone) != 1 || *clone->stack_top != 7 ||
+        cpu_get_status(clone) != CPU_HALTED)
+        puts("the clone was restored into a wrong state");
+    else if (added > RESTORE_LIMIT_KB)
+        printf("restoring into the clone committed %ld KiB\n", added);
+    else
+        result = 0;
+
+cleanup:
+    if (result == 0)
+        puts("snapshot restored into a clone");
+    if (clone) {
+        cpu_destroy(clone);
+        free(clone);
+    }
+    if (snapshot)
+        cpu_snapshot_destroy(snapshot);
+    cpu_destroy(cpu);
+    free(cpu);
+    return result;
+}